@@ -1,11 +1,28 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <readline/readline.h>
 #include <readline/history.h>
 
 #include "mpc.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LVEC_X86
+#define LVEC_AVX2 __attribute__((target("avx2")))
+#define LVEC_AVX2_POPCNT __attribute__((target("avx2,popcnt")))
+#endif
+
 #define LASSERT(arg, cond, fmt, ...) \
 	if (!(cond)) {\
 		lval *err = lval_err(fmt, ##__VA_ARGS__);\
@@ -22,6 +39,12 @@
 #define LASSERT_NUM_AT(arg, pos, fn) \
 	LASSERT_TYPE_AT(arg, pos, LVAL_NUM, fn)
 
+#define LASSERT_NUMERIC_AT(arg, pos, fn) \
+	LASSERT(arg, lval_is_num(arg->cell[pos]),\
+		"Function '%s' passed incorrect type for argument %i! "\
+		"Got %s, expected %s",\
+		fn, pos + 1, ltype_name(arg->cell[pos]->type), ltype_name(LVAL_NUM))
+
 #define LASSERT_QEXPR_AT(arg, pos, fn) \
 	LASSERT_TYPE_AT(arg, pos, LVAL_QEXPR, fn)
 
@@ -31,13 +54,38 @@
 #define LASSERT_STR_AT(arg, pos, fn) \
 	LASSERT_TYPE_AT(arg, pos, LVAL_STR, fn)
 
+#define LASSERT_VEC_AT(arg, pos, fn) \
+	LASSERT_TYPE_AT(arg, pos, LVAL_VEC, fn)
+
+#define LASSERT_MAT_AT(arg, pos, fn) \
+	LASSERT_TYPE_AT(arg, pos, LVAL_MAT, fn)
+
+#define LASSERT_MAP_AT(arg, pos, fn) \
+	LASSERT_TYPE_AT(arg, pos, LVAL_MAP, fn)
+
+#define LASSERT_SORTED_AT(arg, pos, fn) \
+	LASSERT_TYPE_AT(arg, pos, LVAL_SORTED, fn)
+
+#define LASSERT_SET_AT(arg, pos, fn) \
+	LASSERT_TYPE_AT(arg, pos, LVAL_SET, fn)
+
+#define LASSERT_BYTES_AT(arg, pos, fn) \
+	LASSERT_TYPE_AT(arg, pos, LVAL_BYTES, fn)
+
+#define LASSERT_GRAMMAR_AT(arg, pos, fn) \
+	LASSERT_TYPE_AT(arg, pos, LVAL_GRAMMAR, fn)
+
 #define LASSERT_COUNT(arg, num, fn) \
 	LASSERT(arg, arg->count == num, \
 		"Function '%s' passed incorrect number of arguments! "\
 		"Got %i, expected %i", fn, arg->count, num)
 
 typedef enum { LVAL_ERR, LVAL_NUM,   LVAL_SYM,  LVAL_BOOL,
-       LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR } lval_type;
+       LVAL_STR, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR,
+       LVAL_BIG, LVAL_FLOAT, LVAL_VEC, LVAL_MAT,
+       LVAL_MAP, LVAL_RECUR, LVAL_LAZY, LVAL_TABLE,
+       LVAL_PQ, LVAL_SORTED, LVAL_SET, LVAL_BYTES,
+       LVAL_GRAMMAR } lval_type;
 enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
 
 typedef struct lval lval;
@@ -46,6 +94,196 @@ typedef lval * (*lbuiltin)(lenv *, lval *);
 
 typedef unsigned int boolean;
 
+typedef enum { LVEC_INT, LVEC_FLOAT } lvec_type;
+enum { LBUF_HEAP, LBUF_MAP_RO, LBUF_MAP_COW };
+
+/* Reference counted storage shared by vectors, byte buffers and their
+ * slices. The data is either on the heap or a mapping of a file. */
+typedef struct {
+	int refs;
+	int kind;
+	size_t size;
+	char *data;
+} lbuf;
+
+/* Length prefixed string storage, always NUL terminated */
+typedef struct {
+	int refs;
+	int interned;
+	unsigned long hash;
+	size_t len;
+	char data[];
+} lstr;
+
+typedef struct lrope lrope;
+struct lrope {
+	int refs;
+	size_t len;
+	/* either a leaf with text or the concatenation of left and right */
+	lstr *leaf;
+	lrope *left;
+	lrope *right;
+};
+
+/* Arbitrary precision integer: sign and magnitude in 32 bit limbs,
+ * least significant limb first. A normalized bignum has no leading
+ * zero limbs and never fits into a long (those are demoted). */
+typedef struct {
+	int neg;
+	int len;
+	uint32_t *d;
+} lbig;
+
+/* Hash map trie: a leaf holds one key and value, a node up to 32 slots
+ * which are either a leaf or a sub node */
+typedef struct {
+	int refs;
+	uint64_t hash;
+	lval *key;
+	lval *val;
+} lhleaf;
+
+typedef struct lhnode lhnode;
+typedef struct {
+	lhleaf *leaf;
+	lhnode *node;
+} lhslot;
+
+struct lhnode {
+	int refs;
+	int collision;
+	uint32_t bitmap;
+	int n;
+	lhslot slots[];
+};
+
+/* Cache of a memoized function, entries are kept in a hash table and
+ * in a list ordered from most to least recently used */
+typedef struct lmemo_entry lmemo_entry;
+struct lmemo_entry {
+	uint64_t hash;
+	lval *args;
+	lval *val;
+	lmemo_entry *prev;
+	lmemo_entry *next;
+};
+
+typedef struct {
+	int refs;
+	lval *fn;
+	long cap;
+	long count;
+	long hits;
+	long misses;
+	size_t size;
+	lmemo_entry **slots;
+	lmemo_entry *head;
+	lmemo_entry *tail;
+} lmemo;
+
+/* Lazy sequence, see the section on lazy sequences */
+typedef struct {
+	int refs;
+	int kind;
+	long start;
+	long end;
+	long step;
+	lval *f;
+	lval *x;
+	lval *src;
+	lval *realized;
+} llazy;
+
+/* Table column, an array of int64_t, double or lstr * */
+typedef struct {
+	int refs;
+	int type;
+	char *name;
+	long len;
+	void *data;
+} lcol;
+
+/* Column store, row r is at position sel[r] of the columns or at r if
+ * there is no selection vector */
+typedef struct {
+	int refs;
+	long nrows;
+	int ncols;
+	lcol **cols;
+	lbuf *sel;
+} ltable;
+
+/* Priority queue, key is the number an item is ordered by */
+typedef struct {
+	lval *key;
+	lval *v;
+} lpq_item;
+
+typedef struct {
+	int refs;
+	lval *cmp;
+	long n;
+	long cap;
+	lpq_item *items;
+} lpq;
+
+/* B+tree node of a sorted map. Inner nodes hold the smallest key of
+ * each child, leaves the entries, a set member has no value. pre holds
+ * an order preserving prefix of each key, searches scan it first. */
+#define LBT_ORDER 16
+
+typedef struct lbtnode lbtnode;
+typedef union {
+	lval *val;
+	lbtnode *kid;
+} lbtsub;
+
+struct lbtnode {
+	uint64_t pre[LBT_ORDER];
+	int refs;
+	int leaf;
+	int n;
+	lval *keys[LBT_ORDER];
+	lbtsub sub[LBT_ORDER];
+};
+
+/* Integer set container, the values sharing their upper 48 bits: the
+ * low 16 bits in a sorted array, in a 65536 bit bitmap, or as runs of
+ * {start, length - 1} pairs in vals */
+typedef struct {
+	int refs;
+	int type;
+	int card;
+	int n;
+	int cap;
+	uint16_t *vals;
+	uint64_t *bits;
+} lrcont;
+
+/* Integer set, containers in order of their keys (the upper bits) */
+typedef struct {
+	int refs;
+	long n;
+	long cap;
+	long card;
+	int64_t *keys;
+	lrcont **conts;
+} lroar;
+
+/* Rules of a grammar compiled by mpca_lang, kept in a cache of recently
+ * compiled grammars */
+typedef struct lgrammar lgrammar;
+struct lgrammar {
+	int refs;
+	unsigned long hash;
+	char *text;
+	int n;
+	char **names;
+	mpc_parser_t **rules;
+	lgrammar *prev;
+	lgrammar *next;
+};
+
 static lval * lval_err(char *fmt, ...);
 static void lval_del(lval *v);
 static lval * lval_eval(lenv *e, lval *v);
@@ -57,6 +295,31 @@ static lval * lval_pop(lval *v, int i);
 static lval * lval_call(lenv *e, lval *f, lval *a);
 static lval * builtin_eval(lenv *e, lval *a);
 static lval * builtin_list(lenv *e, lval *a);
+static lval * lvec_ref(lval *v, long i);
+static void lbuf_release(lbuf *b);
+static void lhnode_release(lhnode *h);
+static void lhamt_each(lhnode *h, void (*f)(lhleaf *, void *), void *ctx);
+static int lhamt_within(lhnode *x, lhnode *y);
+static void lcons_remove(lval *v);
+static lval * lval_cons(lval *v);
+static lval * lval_thaw(lval *v);
+static lval * lmemo_call(lenv *e, lval *f, lval *a);
+static void lmemo_release(lmemo *m);
+static void llazy_release(llazy *z);
+static void ltable_release(ltable *t);
+static int ltable_eq(ltable *x, ltable *y);
+static void lval_print_table(lval *v);
+static void lpq_release(lpq *q);
+static void lbtnode_release(lbtnode *x);
+static int lval_sorted_eq(lval *x, lval *y);
+static uint64_t lval_sorted_hash(lval *v);
+static void lval_print_sorted(lval *v);
+static void lroar_release(lroar *s);
+static int lroar_eq(lroar *x, lroar *y);
+static uint64_t lroar_hash(lroar *s);
+static void lval_print_set(lval *v);
+static void lgrammar_release(lgrammar *g);
+static void lval_print_grammar(lval *v);
 
 static mpc_parser_t *Number;
 static mpc_parser_t *Symbol;
@@ -67,25 +330,90 @@ static mpc_parser_t *Qexpr;
 static mpc_parser_t *Expr;
 static mpc_parser_t *Lispy;
 
+/* The payload depends on the type, only the fields of the current type
+ * are valid */
 struct lval {
 	lval_type type;
 
-	/* Basic */
-	long num;
-	boolean b;
-	char *err;
-	char *sym;
-	char *str;
-
-	/* Function */
-	lbuiltin builtin;
-	lenv *env;
-	lval *formals;
-	lval *body;
-
-	/* Expression */
-	int count;
-	lval **cell;
+	union {
+		/* Basic */
+		long num;
+		double fnum;
+		boolean b;
+		char *err;
+		char *sym;
+
+		/* String */
+		struct {
+			lstr *str;
+			size_t slen;
+			size_t soff;
+			lrope *rope;
+		};
+
+		/* Bignum */
+		lbig big;
+
+		/* Vector of int64_t or double, or vlen bytes, a view into
+		 * vbuf. A matrix is stored like a vector. */
+		struct {
+			lvec_type vtype;
+			long vlen;
+			void *vdata;
+			lbuf *vbuf;
+			long mrows;
+			long mcols;
+		};
+
+		/* Map */
+		struct {
+			lhnode *hroot;
+			long hcount;
+		};
+
+		/* Lazy sequence */
+		llazy *lazy;
+
+		/* Table */
+		ltable *tbl;
+
+		/* Priority queue */
+		lpq *pq;
+
+		/* Sorted map of bcount keys, all numbers or all strings,
+		 * either a set or a map (bmap) with a value for every key */
+		struct {
+			lbtnode *broot;
+			long bcount;
+			int bkind;
+			int bmap;
+		};
+
+		/* Integer set */
+		lroar *set;
+
+		/* Grammar */
+		lgrammar *gram;
+
+		/* Function */
+		struct {
+			lbuiltin builtin;
+			lenv *env;
+			lval *formals;
+			lval *body;
+			lmemo *memo;
+		};
+
+		/* Expression. Hash consed lists are shared and must not be
+		 * modified, hash is their cached structural hash. */
+		struct {
+			int count;
+			lval **cell;
+			int consed;
+			int refs;
+			uint64_t hash;
+		};
+	};
 };
 
 struct lenv {
@@ -106,6 +434,19 @@ static char * ltype_name(int t) {
 	case LVAL_SEXPR: return "S-Expression";
 	case LVAL_QEXPR: return "Q-Expression";
 	case LVAL_BOOL: return "Boolean";
+	case LVAL_BIG: return "Bignum";
+	case LVAL_FLOAT: return "Float";
+	case LVAL_VEC: return "Vector";
+	case LVAL_MAT: return "Matrix";
+	case LVAL_MAP: return "Map";
+	case LVAL_RECUR: return "Recur";
+	case LVAL_LAZY: return "Lazy Sequence";
+	case LVAL_TABLE: return "Table";
+	case LVAL_PQ: return "Priority Queue";
+	case LVAL_SORTED: return "Sorted Map";
+	case LVAL_SET: return "Integer Set";
+	case LVAL_BYTES: return "Bytes";
+	case LVAL_GRAMMAR: return "Grammar";
 	default: return "Unknown";
 	}
 }
@@ -193,6 +534,13 @@ static lval * lval_num(long x) {
 	return v;
 }
 
+static lval * lval_float(double x) {
+	lval *v = malloc(sizeof(lval));
+	v->type = LVAL_FLOAT;
+	v->fnum = x;
+	return v;
+}
+
 static lval * lval_bool(boolean x) {
 	lval *v = malloc(sizeof(lval));
 	v->type = LVAL_BOOL;
@@ -230,18 +578,280 @@ static lval * lval_sym(char *sym) {
 	return v;
 }
 
-static lval * lval_str(char *str) {
+/* String storage
+ *
+ * Text lives in a reference counted, length prefixed lstr, so copying
+ * a string never copies its bytes. String literals are interned: equal
+ * literals share one lstr, the table only holds weak references and an
+ * lstr leaves it when the last value using it is deleted. */
+
+static lstr * lstr_new(size_t len) {
+	lstr *s = malloc(sizeof(lstr) + len + 1);
+	s->refs = 1;
+	s->interned = 0;
+	s->hash = 0;
+	s->len = len;
+	s->data[len] = '\0';
+	return s;
+}
+
+/* FNV-1a, 0 is reserved for "not computed yet" */
+static unsigned long lstr_hash_bytes(const char *p, size_t len) {
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)p[i]) * 1099511628211ULL;
+	}
+	return h ? h : 1;
+}
+
+/* hash of the whole text, computed once */
+static unsigned long lstr_hash(lstr *s) {
+	if (s->hash == 0) { s->hash = lstr_hash_bytes(s->data, s->len); }
+	return s->hash;
+}
+
+/* open addressing with linear probing, size is a power of two */
+static struct {
+	lstr **slots;
+	size_t size;
+	size_t count;
+} lstr_interned;
+
+static size_t lstr_intern_slot(const char *p, size_t len, unsigned long h) {
+	size_t mask = lstr_interned.size - 1;
+	size_t i = h & mask;
+	while (lstr_interned.slots[i]) {
+		lstr *s = lstr_interned.slots[i];
+		if (s->hash == h && s->len == len && memcmp(s->data, p, len) == 0) {
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+static void lstr_intern_grow(void) {
+	lstr **old = lstr_interned.slots;
+	size_t n = lstr_interned.size;
+	lstr_interned.size = n ? n * 2 : 256;
+	lstr_interned.slots = calloc(lstr_interned.size, sizeof(lstr *));
+	for (size_t i = 0; i < n; i++) {
+		if (old[i]) {
+			lstr *s = old[i];
+			lstr_interned.slots[lstr_intern_slot(s->data, s->len, s->hash)] = s;
+		}
+	}
+	free(old);
+}
+
+/* The unique lstr with these bytes, a new reference is returned */
+static lstr * lstr_intern(const char *p, size_t len, unsigned long h) {
+	if (2 * (lstr_interned.count + 1) > lstr_interned.size) {
+		lstr_intern_grow();
+	}
+
+	size_t i = lstr_intern_slot(p, len, h);
+	lstr *s = lstr_interned.slots[i];
+	if (s) {
+		s->refs++;
+		return s;
+	}
+
+	s = lstr_new(len);
+	memcpy(s->data, p, len);
+	s->hash = h;
+	s->interned = 1;
+	lstr_interned.slots[i] = s;
+	lstr_interned.count++;
+	return s;
+}
+
+static void lstr_unintern(lstr *s) {
+	size_t mask = lstr_interned.size - 1;
+	size_t i = lstr_intern_slot(s->data, s->len, s->hash);
+	lstr_interned.slots[i] = NULL;
+	lstr_interned.count--;
+
+	/* shift following entries of the probe sequence back */
+	for (size_t j = (i + 1) & mask; lstr_interned.slots[j]; j = (j + 1) & mask) {
+		lstr *t = lstr_interned.slots[j];
+		lstr_interned.slots[j] = NULL;
+		lstr_interned.slots[lstr_intern_slot(t->data, t->len, t->hash)] = t;
+	}
+}
+
+static void lstr_release(lstr *s) {
+	if (--s->refs > 0) { return; }
+	if (s->interned) { lstr_unintern(s); }
+	free(s);
+}
+
+static lval * lval_str_lstr(lstr *s) {
 	lval *v = malloc(sizeof(lval));
 	v->type = LVAL_STR;
-	v->str = malloc(strlen(str) + 1);
-	strcpy(v->str, str);
+	v->str = s;
+	v->slen = s->len;
+	v->soff = 0;
+	v->rope = NULL;
 	return v;
 }
 
+static lval * lval_str(char *str) {
+	size_t len = strlen(str);
+	lstr *s = lstr_new(len);
+	memcpy(s->data, str, len);
+	return lval_str_lstr(s);
+}
+
+/* Long strings are ropes: a tree of shared, reference counted pieces.
+ * Concatenation is O(1), the characters are copied only once when a
+ * contiguous view is needed (see lval_cstr). */
+
+/* below this length concatenation simply copies */
+#define LROPE_FLAT_MAX 64
+
+static lrope * lrope_leaf(lstr *s) {
+	lrope *r = malloc(sizeof(lrope));
+	r->refs = 1;
+	r->len = s->len;
+	r->left = r->right = NULL;
+	r->leaf = s;
+	return r;
+}
+
+static lrope * lrope_cat(lrope *a, lrope *b) {
+	lrope *r = malloc(sizeof(lrope));
+	r->refs = 1;
+	r->len = a->len + b->len;
+	r->left = a;
+	r->right = b;
+	r->leaf = NULL;
+	return r;
+}
+
+/* ropes built by appending are deep, so both walks below use an
+ * explicit stack instead of recursion */
+static void lrope_release(lrope *r) {
+	int sp = 0, cap = 64;
+	lrope **stack = malloc(sizeof(lrope *) * cap);
+	stack[sp++] = r;
+	while (sp) {
+		lrope *n = stack[--sp];
+		if (--n->refs > 0) { continue; }
+		if (n->leaf) {
+			lstr_release(n->leaf);
+		} else {
+			if (sp + 2 > cap) {
+				cap *= 2;
+				stack = realloc(stack, sizeof(lrope *) * cap);
+			}
+			stack[sp++] = n->right;
+			stack[sp++] = n->left;
+		}
+		free(n);
+	}
+	free(stack);
+}
+
+static void lrope_write(lrope *r, char *out) {
+	int sp = 0, cap = 64;
+	lrope **stack = malloc(sizeof(lrope *) * cap);
+	stack[sp++] = r;
+	while (sp) {
+		lrope *n = stack[--sp];
+		if (n->leaf) {
+			memcpy(out, n->leaf->data, n->len);
+			out += n->len;
+		} else {
+			if (sp + 2 > cap) {
+				cap *= 2;
+				stack = realloc(stack, sizeof(lrope *) * cap);
+			}
+			stack[sp++] = n->right;
+			stack[sp++] = n->left;
+		}
+	}
+	free(stack);
+}
+
+/* Contiguous view of the slen bytes of a string. A concatenation is
+ * flattened on first use and turned into a leaf in place, so every copy
+ * sharing the node benefits from it; v itself becomes a flat string.
+ * Slices are not NUL terminated, use lval_cstr where that matters. */
+static char * lval_sdata(lval *v) {
+	if (!v->rope) { return v->str->data + v->soff; }
+
+	lrope *r = v->rope;
+	if (!r->leaf) {
+		lstr *s = lstr_new(r->len);
+		lrope_write(r, s->data);
+		lrope_release(r->left);
+		lrope_release(r->right);
+		r->left = r->right = NULL;
+		r->leaf = s;
+	}
+	v->str = r->leaf;
+	v->str->refs++;
+	v->soff = 0;
+	v->rope = NULL;
+	lrope_release(r);
+	return v->str->data;
+}
+
+/* NUL terminated view of a string, a slice ending before the end of
+ * its storage gets a copy of its own */
+static char * lval_cstr(lval *v) {
+	char *p = lval_sdata(v);
+	if (v->soff + v->slen != v->str->len) {
+		lstr *s = lstr_new(v->slen);
+		memcpy(s->data, p, v->slen);
+		lstr_release(v->str);
+		v->str = s;
+		v->soff = 0;
+		p = s->data;
+	}
+	return p;
+}
+
+/* Turn a string into a rope node, taking over its storage */
+static lrope * lval_to_rope(lval *v) {
+	if (v->rope) {
+		lrope *r = v->rope;
+		v->rope = NULL;
+		return r;
+	}
+
+	/* leaves hold whole lstrs */
+	if (v->soff != 0 || v->slen != v->str->len) {
+		lval_cstr(v);
+	}
+	lrope *r = lrope_leaf(v->str);
+	v->str = NULL;
+	return r;
+}
+
+/* Concatenate two strings, consuming both */
+static lval * lval_str_cat(lval *x, lval *y) {
+	if (x->slen + y->slen <= LROPE_FLAT_MAX) {
+		lstr *s = lstr_new(x->slen + y->slen);
+		memcpy(s->data, lval_sdata(x), x->slen);
+		memcpy(s->data + x->slen, lval_sdata(y), y->slen);
+		lval_del(x);
+		lval_del(y);
+		return lval_str_lstr(s);
+	}
+
+	x->rope = lrope_cat(lval_to_rope(x), lval_to_rope(y));
+	x->slen += y->slen;
+	lval_del(y);
+	return x;
+}
+
 static lval * lval_fun(lbuiltin func) {
 	lval *v = malloc(sizeof(lval));
 	v->type = LVAL_FUN;
 	v->builtin = func;
+	v->memo = NULL;
 	return v;
 }
 
@@ -250,6 +860,7 @@ static lval * lval_sexpr(void) {
 	v->type = LVAL_SEXPR;
 	v->count = 0;
 	v->cell = NULL;
+	v->consed = 0;
 	return v;
 }
 
@@ -258,6 +869,7 @@ static lval * lval_qexpr(void) {
 	v->type = LVAL_QEXPR;
 	v->count = 0;
 	v->cell = NULL;
+	v->consed = 0;
 	return v;
 }
 
@@ -266,6 +878,7 @@ static lval * lval_lambda(lval *formals, lval *body) {
 	v->type = LVAL_FUN;
 
 	v->builtin = NULL;
+	v->memo = NULL;
 
 	/* Build new environment */
 	v->env = lenv_new();
@@ -277,13 +890,468 @@ static lval * lval_lambda(lval *formals, lval *body) {
 }
 
 
+/* Bignum arithmetic
+ *
+ * Magnitudes are plain little endian arrays of 32 bit limbs. The
+ * helpers below work on fixed lengths and tolerate leading zero limbs,
+ * only lbig values stored in an lval are normalized. */
+
+#define LBIG_KARATSUBA_CUTOFF 32
+
+static int mag_norm(const uint32_t *a, int n) {
+	while (n > 0 && a[n - 1] == 0) { n--; }
+	return n;
+}
+
+static int mag_cmp(const uint32_t *a, int na, const uint32_t *b, int nb) {
+	na = mag_norm(a, na);
+	nb = mag_norm(b, nb);
+	if (na != nb) { return na < nb ? -1 : 1; }
+	for (int i = na - 1; i >= 0; i--) {
+		if (a[i] != b[i]) { return a[i] < b[i] ? -1 : 1; }
+	}
+	return 0;
+}
+
+/* r += a, r has room for nr limbs and nr >= na */
+static void mag_add_into(uint32_t *r, int nr, const uint32_t *a, int na) {
+	uint64_t carry = 0;
+	int i;
+	for (i = 0; i < na; i++) {
+		uint64_t t = (uint64_t)r[i] + a[i] + carry;
+		r[i] = (uint32_t)t;
+		carry = t >> 32;
+	}
+	for (; carry && i < nr; i++) {
+		uint64_t t = (uint64_t)r[i] + carry;
+		r[i] = (uint32_t)t;
+		carry = t >> 32;
+	}
+}
+
+/* r -= a, requires r >= a */
+static void mag_sub_into(uint32_t *r, int nr, const uint32_t *a, int na) {
+	uint64_t borrow = 0;
+	int i;
+	for (i = 0; i < na; i++) {
+		uint64_t t = (uint64_t)r[i] - a[i] - borrow;
+		r[i] = (uint32_t)t;
+		borrow = (t >> 63) & 1;
+	}
+	for (; borrow && i < nr; i++) {
+		uint64_t t = (uint64_t)r[i] - borrow;
+		r[i] = (uint32_t)t;
+		borrow = (t >> 63) & 1;
+	}
+}
+
+/* r = a * b (schoolbook), r must hold na + nb limbs */
+static void mag_mul_school(uint32_t *r, const uint32_t *a, int na,
+			   const uint32_t *b, int nb) {
+	memset(r, 0, sizeof(uint32_t) * (na + nb));
+	for (int i = 0; i < na; i++) {
+		uint64_t carry = 0;
+		if (a[i] == 0) { continue; }
+		for (int j = 0; j < nb; j++) {
+			uint64_t t = (uint64_t)a[i] * b[j] + r[i + j] + carry;
+			r[i + j] = (uint32_t)t;
+			carry = t >> 32;
+		}
+		r[i + nb] = (uint32_t)carry;
+	}
+}
+
+/* r = a * b, r must hold na + nb limbs and must not alias a or b */
+static void mag_mul(uint32_t *r, const uint32_t *a, int na,
+		    const uint32_t *b, int nb) {
+	if (na < nb) {
+		const uint32_t *t = a; a = b; b = t;
+		int n = na; na = nb; nb = n;
+	}
+
+	if (nb < LBIG_KARATSUBA_CUTOFF) {
+		mag_mul_school(r, a, na, b, nb);
+		return;
+	}
+
+	/* very unbalanced operands: multiply slices of a with all of b */
+	if (2 * nb <= na) {
+		uint32_t *t = malloc(sizeof(uint32_t) * 2 * nb);
+		memset(r, 0, sizeof(uint32_t) * (na + nb));
+		for (int i = 0; i < na; i += nb) {
+			int n = (na - i < nb) ? na - i : nb;
+			mag_mul(t, a + i, n, b, nb);
+			mag_add_into(r + i, na + nb - i, t, n + nb);
+		}
+		free(t);
+		return;
+	}
+
+	/* Karatsuba: a = a1 * B^m + a0, b = b1 * B^m + b0 */
+	int m = nb / 2;
+	int la = na - m + 1;
+	int lb = nb - m + 1;
+
+	/* z0 = a0 * b0 into the low and z2 = a1 * b1 into the high half */
+	mag_mul(r, a, m, b, m);
+	mag_mul(r + 2 * m, a + m, na - m, b + m, nb - m);
+
+	uint32_t *sa = calloc(la + lb, sizeof(uint32_t));
+	uint32_t *sb = sa + la;
+	memcpy(sa, a + m, sizeof(uint32_t) * (na - m));
+	mag_add_into(sa, la, a, m);
+	memcpy(sb, b + m, sizeof(uint32_t) * (nb - m));
+	mag_add_into(sb, lb, b, m);
+
+	/* z1 = (a0 + a1) * (b0 + b1) - z0 - z2 */
+	uint32_t *z1 = malloc(sizeof(uint32_t) * (la + lb));
+	mag_mul(z1, sa, la, sb, lb);
+	mag_sub_into(z1, la + lb, r, 2 * m);
+	mag_sub_into(z1, la + lb, r + 2 * m, na + nb - 2 * m);
+
+	mag_add_into(r + m, na + nb - m, z1, mag_norm(z1, la + lb));
+
+	free(z1);
+	free(sa);
+}
+
+/* q = u / v, r = u % v; nu >= nv >= 1 and v[nv - 1] != 0.
+ * q must hold nu - nv + 1 limbs, r must hold nv limbs.
+ * Knuth, TAOCP Vol. 2, Algorithm D */
+static void mag_divmod(uint32_t *q, uint32_t *r, const uint32_t *u, int nu,
+		       const uint32_t *v, int nv) {
+	if (nv == 1) {
+		uint64_t rem = 0;
+		for (int i = nu - 1; i >= 0; i--) {
+			uint64_t cur = (rem << 32) | u[i];
+			q[i] = (uint32_t)(cur / v[0]);
+			rem = cur % v[0];
+		}
+		r[0] = (uint32_t)rem;
+		return;
+	}
+
+	/* normalize so that the top bit of the divisor is set */
+	int s = __builtin_clz(v[nv - 1]);
+	uint32_t *vn = malloc(sizeof(uint32_t) * nv);
+	uint32_t *un = malloc(sizeof(uint32_t) * (nu + 1));
+	for (int i = nv - 1; i > 0; i--) {
+		vn[i] = (v[i] << s) | (uint32_t)((uint64_t)v[i - 1] >> (32 - s));
+	}
+	vn[0] = v[0] << s;
+	un[nu] = (uint32_t)((uint64_t)u[nu - 1] >> (32 - s));
+	for (int i = nu - 1; i > 0; i--) {
+		un[i] = (u[i] << s) | (uint32_t)((uint64_t)u[i - 1] >> (32 - s));
+	}
+	un[0] = u[0] << s;
+
+	for (int j = nu - nv; j >= 0; j--) {
+		/* estimate quotient digit */
+		uint64_t num = ((uint64_t)un[j + nv] << 32) | un[j + nv - 1];
+		uint64_t qhat = num / vn[nv - 1];
+		uint64_t rhat = num % vn[nv - 1];
+		while (qhat > 0xffffffffULL
+		       || qhat * vn[nv - 2] > ((rhat << 32) | un[j + nv - 2])) {
+			qhat--;
+			rhat += vn[nv - 1];
+			if (rhat > 0xffffffffULL) { break; }
+		}
+
+		/* multiply and subtract */
+		int64_t k = 0, t;
+		for (int i = 0; i < nv; i++) {
+			uint64_t p = qhat * vn[i];
+			t = (int64_t)un[i + j] - k - (int64_t)(p & 0xffffffffULL);
+			un[i + j] = (uint32_t)t;
+			k = (int64_t)(p >> 32) - (t >> 32);
+		}
+		t = (int64_t)un[j + nv] - k;
+		un[j + nv] = (uint32_t)t;
+
+		/* subtracted too much: add back */
+		q[j] = (uint32_t)qhat;
+		if (t < 0) {
+			uint64_t c = 0;
+			q[j]--;
+			for (int i = 0; i < nv; i++) {
+				uint64_t w = (uint64_t)un[i + j] + vn[i] + c;
+				un[i + j] = (uint32_t)w;
+				c = w >> 32;
+			}
+			un[j + nv] += (uint32_t)c;
+		}
+	}
+
+	/* unnormalize remainder */
+	for (int i = 0; i < nv; i++) {
+		r[i] = (un[i] >> s) | (uint32_t)((uint64_t)un[i + 1] << (32 - s));
+	}
+
+	free(vn);
+	free(un);
+}
+
+/* multiply by a small factor and add a small value in place */
+static void mag_mul_add_small(uint32_t *a, int n, uint32_t mul, uint32_t add) {
+	uint64_t carry = add;
+	for (int i = 0; i < n; i++) {
+		uint64_t t = (uint64_t)a[i] * mul + carry;
+		a[i] = (uint32_t)t;
+		carry = t >> 32;
+	}
+}
+
+static void lbig_init(lbig *b, int len) {
+	b->neg = 0;
+	b->len = len;
+	b->d = calloc(len ? len : 1, sizeof(uint32_t));
+}
+
+static void lbig_free(lbig *b) {
+	free(b->d);
+	b->d = NULL;
+	b->len = 0;
+}
+
+static void lbig_from_long(lbig *b, long x) {
+	unsigned long m = x < 0 ? -(unsigned long)x : (unsigned long)x;
+	lbig_init(b, 2);
+	b->neg = x < 0;
+	b->d[0] = (uint32_t)m;
+	b->d[1] = (uint32_t)((uint64_t)m >> 32);
+	b->len = mag_norm(b->d, 2);
+}
+
+/* Does the value fit into a long? Store it in *x if it does. */
+static int lbig_to_long(lbig *b, long *x) {
+	int n = mag_norm(b->d, b->len);
+	if (n > 2) { return 0; }
+	uint64_t m = 0;
+	if (n > 0) { m = b->d[0]; }
+	if (n > 1) { m |= (uint64_t)b->d[1] << 32; }
+	if (b->neg) {
+		if (m > (uint64_t)LONG_MAX + 1) { return 0; }
+		*x = (long)(0 - m);
+	} else {
+		if (m > (uint64_t)LONG_MAX) { return 0; }
+		*x = (long)m;
+	}
+	return 1;
+}
+
+static double lbig_to_double(lbig *b) {
+	double r = 0.0;
+	for (int i = b->len - 1; i >= 0; i--) {
+		r = r * 4294967296.0 + b->d[i];
+	}
+	return b->neg ? -r : r;
+}
+
+/* r = a + b, or a - b if sub is set */
+static void lbig_add(lbig *r, lbig *a, lbig *b, int sub) {
+	int bneg = sub ? !b->neg : b->neg;
+	int n = (a->len > b->len ? a->len : b->len) + 1;
+	lbig_init(r, n);
+
+	if (a->neg == bneg) {
+		memcpy(r->d, a->d, sizeof(uint32_t) * a->len);
+		mag_add_into(r->d, n, b->d, b->len);
+		r->neg = a->neg;
+	} else if (mag_cmp(a->d, a->len, b->d, b->len) >= 0) {
+		memcpy(r->d, a->d, sizeof(uint32_t) * a->len);
+		mag_sub_into(r->d, n, b->d, b->len);
+		r->neg = a->neg;
+	} else {
+		memcpy(r->d, b->d, sizeof(uint32_t) * b->len);
+		mag_sub_into(r->d, n, a->d, a->len);
+		r->neg = bneg;
+	}
+	r->len = mag_norm(r->d, n);
+	if (r->len == 0) { r->neg = 0; }
+}
+
+static void lbig_mul(lbig *r, lbig *a, lbig *b) {
+	lbig_init(r, a->len + b->len);
+	if (a->len && b->len) {
+		mag_mul(r->d, a->d, a->len, b->d, b->len);
+	}
+	r->len = mag_norm(r->d, a->len + b->len);
+	r->neg = r->len ? a->neg != b->neg : 0;
+}
+
+/* truncating division like C: quotient rounds towards zero and the
+ * remainder takes the sign of the dividend. b must not be zero. */
+static void lbig_divmod(lbig *q, lbig *r, lbig *a, lbig *b) {
+	if (mag_cmp(a->d, a->len, b->d, b->len) < 0) {
+		lbig_init(q, 1);
+		q->len = 0;
+		lbig_init(r, a->len);
+		memcpy(r->d, a->d, sizeof(uint32_t) * a->len);
+		r->neg = a->neg;
+		return;
+	}
+	lbig_init(q, a->len - b->len + 1);
+	lbig_init(r, b->len);
+	mag_divmod(q->d, r->d, a->d, a->len, b->d, b->len);
+	q->len = mag_norm(q->d, q->len);
+	r->len = mag_norm(r->d, r->len);
+	q->neg = q->len ? a->neg != b->neg : 0;
+	r->neg = r->len ? a->neg : 0;
+}
+
+/* exponentiation by squaring, e >= 0 */
+static void lbig_pow(lbig *r, lbig *base, unsigned long e) {
+	lbig acc, sq, t;
+	lbig_from_long(&acc, 1);
+	lbig_init(&sq, base->len);
+	memcpy(sq.d, base->d, sizeof(uint32_t) * base->len);
+	sq.neg = base->neg;
+
+	while (e) {
+		if (e & 1) {
+			lbig_mul(&t, &acc, &sq);
+			lbig_free(&acc);
+			acc = t;
+		}
+		e >>= 1;
+		if (e) {
+			lbig_mul(&t, &sq, &sq);
+			lbig_free(&sq);
+			sq = t;
+		}
+	}
+	lbig_free(&sq);
+	*r = acc;
+}
+
+/* parse an optionally signed decimal string */
+static void lbig_from_str(lbig *b, const char *s) {
+	int neg = 0;
+	if (*s == '-') { neg = 1; s++; }
+	int digits = strlen(s);
+	/* 9 decimal digits fit into one limb, log2(10) < 3.33 */
+	int n = digits * 10 / 96 + 2;
+	lbig_init(b, n);
+	b->len = n;
+
+	int first = digits % 9 ? digits % 9 : 9;
+	while (*s) {
+		uint32_t chunk = 0, mul = 1;
+		for (int i = 0; i < first; i++, s++) {
+			chunk = chunk * 10 + (*s - '0');
+			mul *= 10;
+		}
+		mag_mul_add_small(b->d, n, mul, chunk);
+		first = 9;
+	}
+	b->len = mag_norm(b->d, n);
+	b->neg = b->len ? neg : 0;
+}
+
+/* decimal representation, caller frees */
+static char * lbig_to_str(lbig *b) {
+	int n = b->len;
+	uint32_t *t = malloc(sizeof(uint32_t) * (n ? n : 1));
+	uint32_t *chunks = malloc(sizeof(uint32_t) * (n * 32 / 29 + 2));
+	int nchunks = 0;
+	memcpy(t, b->d, sizeof(uint32_t) * n);
+
+	/* peel off 9 decimal digits at a time */
+	while (n > 0) {
+		uint64_t rem = 0;
+		for (int i = n - 1; i >= 0; i--) {
+			uint64_t cur = (rem << 32) | t[i];
+			t[i] = (uint32_t)(cur / 1000000000);
+			rem = cur % 1000000000;
+		}
+		chunks[nchunks++] = (uint32_t)rem;
+		n = mag_norm(t, n);
+	}
+
+	char *s = malloc(nchunks * 9 + 3);
+	char *p = s;
+	if (b->neg) { *p++ = '-'; }
+	if (nchunks == 0) {
+		*p++ = '0';
+		*p = '\0';
+	} else {
+		p += sprintf(p, "%u", chunks[nchunks - 1]);
+		for (int i = nchunks - 2; i >= 0; i--) {
+			p += sprintf(p, "%09u", chunks[i]);
+		}
+	}
+
+	free(chunks);
+	free(t);
+	return s;
+}
+
+static lval * lval_big(lbig *b) {
+	long x;
+	/* demote back to a fixnum whenever possible */
+	if (lbig_to_long(b, &x)) {
+		lbig_free(b);
+		return lval_num(x);
+	}
+	lval *v = malloc(sizeof(lval));
+	v->type = LVAL_BIG;
+	v->big = *b;
+	return v;
+}
+
+static int lval_is_num(lval *v) {
+	return v->type == LVAL_NUM || v->type == LVAL_BIG
+		|| v->type == LVAL_FLOAT;
+}
+
+static double lval_to_double(lval *v) {
+	switch (v->type) {
+	case LVAL_FLOAT: return v->fnum;
+	case LVAL_BIG: return lbig_to_double(&v->big);
+	default: return (double)v->num;
+	}
+}
+
+/* view any integer lval as a bignum, caller frees */
+static void lval_to_big(lval *v, lbig *b) {
+	if (v->type == LVAL_NUM) {
+		lbig_from_long(b, v->num);
+	} else {
+		lbig_init(b, v->big.len);
+		memcpy(b->d, v->big.d, sizeof(uint32_t) * v->big.len);
+		b->neg = v->big.neg;
+	}
+}
+
+
+static int lval_consed(lval *v) {
+	return (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->consed;
+}
+
 static void lval_del(lval *v) {
+	/* shared literals go with their last reference */
+	if (lval_consed(v)) {
+		if (--v->refs > 0) { return; }
+		lcons_remove(v);
+	}
+
 	switch (v->type) {
 	/* no special handling for numbers or functions */
 	case LVAL_NUM: break;
+	case LVAL_FLOAT: break;
 	case LVAL_BOOL: break;
+	case LVAL_BIG:
+		       lbig_free(&v->big);
+		       break;
+	case LVAL_VEC: /* no break! */
+	case LVAL_MAT:
+	case LVAL_BYTES:
+		       lbuf_release(v->vbuf);
+		       break;
 	case LVAL_FUN:
-		      if (v->builtin == NULL) {
+		      if (v->memo) {
+			      lmemo_release(v->memo);
+		      } else if (v->builtin == NULL) {
 			      lenv_del(v->env);
 			      lval_del(v->formals);
 			      lval_del(v->body);
@@ -295,10 +1363,33 @@ static void lval_del(lval *v) {
 	case LVAL_SYM:
 		       free(v->sym);
 		       break;
+	case LVAL_MAP:
+		       if (v->hroot) { lhnode_release(v->hroot); }
+		       break;
+	case LVAL_LAZY:
+		       llazy_release(v->lazy);
+		       break;
+	case LVAL_TABLE:
+		       ltable_release(v->tbl);
+		       break;
+	case LVAL_PQ:
+		       lpq_release(v->pq);
+		       break;
+	case LVAL_SORTED:
+		       if (v->broot) { lbtnode_release(v->broot); }
+		       break;
+	case LVAL_SET:
+		       lroar_release(v->set);
+		       break;
+	case LVAL_GRAMMAR:
+		       lgrammar_release(v->gram);
+		       break;
 	case LVAL_STR:
-		       free(v->str);
+		       if (v->str) { lstr_release(v->str); }
+		       if (v->rope) { lrope_release(v->rope); }
 		       break;
 	case LVAL_QEXPR: /* no break! */
+	case LVAL_RECUR:
 	case LVAL_SEXPR:
 		       for (int i = 0; i < v->count; i++) {
 			       lval_del(v->cell[i]);
@@ -310,22 +1401,88 @@ static void lval_del(lval *v) {
 }
 
 
-static lval * lval_read_num(mpc_ast_t *t) {
+/* Length of the number at the start of s in the syntax of the reader,
+ * -?[0-9]+(\.[0-9]+)?([eE][-+]?[0-9]+)?, or 0 */
+static size_t lnum_syntax(const char *s) {
+	const char *p = s + (*s == '-'), *d = p;
+	while (*p >= '0' && *p <= '9') { p++; }
+	if (p == d) { return 0; }
+
+	if (*p == '.' && p[1] >= '0' && p[1] <= '9') {
+		for (p++; *p >= '0' && *p <= '9'; p++) {}
+	}
+	if (*p == 'e' || *p == 'E') {
+		const char *e = p + 1 + (p[1] == '-' || p[1] == '+');
+		if (*e >= '0' && *e <= '9') {
+			for (p = e; *p >= '0' && *p <= '9'; p++) {}
+		}
+	}
+	return p - s;
+}
+
+/* The value of a number in the syntax of the reader */
+static lval * lval_num_from_str(const char *s) {
+	/* fraction or exponent makes it a float */
+	if (strpbrk(s, ".eE")) {
+		return lval_float(strtod(s, NULL));
+	}
+
 	errno = 0;
-	long x = strtol(t->contents, NULL, 10);
-	return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+	long x = strtol(s, NULL, 10);
+	if (errno != ERANGE) {
+		return lval_num(x);
+	}
+
+	/* too large for a fixnum, read as bignum */
+	lbig b;
+	lbig_from_str(&b, s);
+	return lval_big(&b);
+}
+
+static lval * lval_read_num(mpc_ast_t *t) {
+	return lval_num_from_str(t->contents);
 }
 
+/* Decode a string literal token into a scratch buffer and intern the
+ * result, so each distinct literal is stored once. */
 static lval * lval_read_str(mpc_ast_t *t) {
-	/* strip trailing " */
-	t->contents[strlen(t->contents) - 1] = '\0';
-	char *unescaped = malloc(strlen(t->contents + 1) + 1);
-	/* copy without leading " */
-	strcpy(unescaped, t->contents + 1);
-	unescaped = mpcf_unescape(unescaped);
-	lval *str = lval_str(unescaped);
-	free(unescaped);
-	return str;
+	static char *buf = NULL;
+	static size_t cap = 0;
+
+	/* skip the quotes, the decoded text is never longer */
+	const char *p = t->contents + 1;
+	size_t n = strlen(p) - 1;
+	if (n + 1 > cap) {
+		cap = 2 * n + 1;
+		buf = realloc(buf, cap);
+	}
+
+	size_t len = 0;
+	for (size_t i = 0; i < n; i++) {
+		char c = p[i];
+		if (c == '\\' && i + 1 < n) {
+			switch (p[++i]) {
+			case 'a':  c = '\a'; break;
+			case 'b':  c = '\b'; break;
+			case 'f':  c = '\f'; break;
+			case 'n':  c = '\n'; break;
+			case 'r':  c = '\r'; break;
+			case 't':  c = '\t'; break;
+			case 'v':  c = '\v'; break;
+			case '\\': c = '\\'; break;
+			case '\'': c = '\''; break;
+			case '"':  c = '"'; break;
+			case '0':  c = '\0'; break;
+			default:
+				/* unknown escapes are kept as they are */
+				buf[len++] = '\\';
+				c = p[i];
+			}
+		}
+		buf[len++] = c;
+	}
+
+	return lval_str_lstr(lstr_intern(buf, len, lstr_hash_bytes(buf, len)));
 }
 
 static lval * lval_add(lval *v, lval *x) {
@@ -358,6 +1515,8 @@ static lval * lval_read(mpc_ast_t *t) {
 		x = lval_add(x, lval_read(t->children[i]));
 	}
 
+	/* quoted data is immutable and shared */
+	if (x->type == LVAL_QEXPR) { return lval_cons(x); }
 	return x;
 }
 
@@ -369,11 +1528,19 @@ static lval * lval_eval(lenv *e, lval *v) {
 		return x;
 	}
 	if (v->type == LVAL_SEXPR) {
-		return lval_eval_sexpr(e, v);
+		return lval_eval_sexpr(e, lval_thaw(v));
 	}
 	return v;
 }
 
+/* recur passes through tail positions up to its loop, anywhere else
+ * it is an error */
+static lval * lval_no_recur(lval *x) {
+	if (x->type != LVAL_RECUR) { return x; }
+	lval_del(x);
+	return lval_err("Function 'recur' used outside the tail position of a loop!");
+}
+
 static lval * lval_eval_sexpr(lenv *e, lval *v) {
 	for (int i = 0; i < v->count; i++) {
 		v->cell[i] = lval_eval(e, v->cell[i]);
@@ -383,6 +1550,10 @@ static lval * lval_eval_sexpr(lenv *e, lval *v) {
 		if (v->cell[i]->type == LVAL_ERR) {
 			return lval_take(v, i);
 		}
+		/* a single expression is in tail position, arguments are not */
+		if (v->cell[i]->type == LVAL_RECUR && v->count > 1) {
+			return lval_no_recur(lval_take(v, i));
+		}
 	}
 
 	if (v->count == 0) { return v; }
@@ -407,8 +1578,17 @@ static lval * lval_eval_sexpr(lenv *e, lval *v) {
 
 static lval * lval_call(lenv *e, lval *f, lval *a) {
 
-	/* If builtin then simply call that */
+	/* Memoized functions look into their cache first */
+	if (f->memo) {
+		return lmemo_call(e, f, a);
+	}
+
+	/* If builtin then simply call that, builtins may modify the
+	 * arguments so they get private copies of shared literals */
 	if (f->builtin) {
+		for (int i = 0; i < a->count; i++) {
+			a->cell[i] = lval_thaw(a->cell[i]);
+		}
 		return f->builtin(e, a);
 	}
 
@@ -487,9 +1667,10 @@ static lval * lval_call(lenv *e, lval *f, lval *a) {
 		/* Set environment parent */
 		f->env->par = e;
 
-		/* Evaluate */
-		return builtin_eval(f->env,
-				    lval_add(lval_sexpr(), lval_copy(f->body)));
+		/* Evaluate, the body of a function is not a loop */
+		lval *x = builtin_eval(f->env,
+				       lval_add(lval_sexpr(), lval_copy(f->body)));
+		return lval_no_recur(x);
 	} else {
 		/* otherwise return partially evaluated function */
 		return lval_copy(f);
@@ -511,20 +1692,162 @@ static void lval_expr_print(lval *v, char open, char close) {
 }
 
 static void lval_print_str(lval *v) {
-	char *escaped = malloc(strlen(v->str) + 1);
-	strcpy(escaped, v->str);
-
-	escaped = mpcf_escape(escaped);
-	printf("\"%s\"", escaped);
+	const char *s = lval_sdata(v);
+
+	/* same escapes as the reader understands */
+	putchar('"');
+	for (size_t i = 0; i < v->slen; i++) {
+		switch (s[i]) {
+		case '\a': fputs("\\a", stdout); break;
+		case '\b': fputs("\\b", stdout); break;
+		case '\f': fputs("\\f", stdout); break;
+		case '\n': fputs("\\n", stdout); break;
+		case '\r': fputs("\\r", stdout); break;
+		case '\t': fputs("\\t", stdout); break;
+		case '\v': fputs("\\v", stdout); break;
+		case '\\': fputs("\\\\", stdout); break;
+		case '\'': fputs("\\'", stdout); break;
+		case '"': fputs("\\\"", stdout); break;
+		case '\0': fputs("\\0", stdout); break;
+		default: putchar(s[i]);
+		}
+	}
+	putchar('"');
+}
 
-	free(escaped);
+static void lval_print_big(lval *v) {
+	char *s = lbig_to_str(&v->big);
+	fputs(s, stdout);
+	free(s);
 }
 
-static void lval_print(lval *v) {
-	switch (v->type) {
-	case LVAL_NUM:
-	       	printf("%li", v->num);
+/* Format with the fewest of 15 to 17 significant digits that read back
+ * to the same double, 17 always do. Infinities and nan print as the
+ * names of the constants holding them. */
+static void lfloat_format(double x, char *buf) {
+	if (isnan(x)) {
+		strcpy(buf, "nan");
+		return;
+	}
+	if (isinf(x)) {
+		strcpy(buf, x > 0 ? "inf" : "-inf");
+		return;
+	}
+
+	for (int prec = 15; prec <= 17; prec++) {
+		snprintf(buf, 32, "%.*g", prec, x);
+		if (strtod(buf, NULL) == x) { break; }
+	}
+
+	/* keep it readable as a float */
+	if (!strpbrk(buf, ".e")) {
+		strcat(buf, ".0");
+	}
+}
+
+static void lval_print_float(lval *v) {
+	char buf[32];
+	lfloat_format(v->fnum, buf);
+	fputs(buf, stdout);
+}
+
+static void lval_print_vec(lval *v) {
+	printf("#[");
+	for (long i = 0; i < v->vlen; i++) {
+		lval *x = lvec_ref(v, i);
+		lval_print(x);
+		lval_del(x);
+		if (i != v->vlen - 1) {
+			putchar(' ');
+		}
+	}
+	putchar(']');
+}
+
+static void lval_print_bytes(lval *v) {
+	const unsigned char *p = v->vdata;
+	printf("#bytes[");
+	for (long i = 0; i < v->vlen; i++) {
+		printf(i ? " %02x" : "%02x", p[i]);
+	}
+	putchar(']');
+}
+
+static void lval_print_mat(lval *v) {
+	double *d = v->vdata;
+	printf("#mat[");
+	for (long i = 0; i < v->mrows; i++) {
+		putchar('{');
+		for (long j = 0; j < v->mcols; j++) {
+			lval x;
+			x.fnum = d[i * v->mcols + j];
+			lval_print_float(&x);
+			if (j != v->mcols - 1) { putchar(' '); }
+		}
+		putchar('}');
+		if (i != v->mrows - 1) { putchar(' '); }
+	}
+	putchar(']');
+}
+
+static void lval_print_map_entry(lhleaf *l, void *first) {
+	if (!*(int *)first) { putchar(' '); }
+	*(int *)first = 0;
+	putchar('{');
+	lval_print(l->key);
+	putchar(' ');
+	lval_print(l->val);
+	putchar('}');
+}
+
+static void lval_print_map(lval *v) {
+	int first = 1;
+	printf("#map{");
+	lhamt_each(v->hroot, lval_print_map_entry, &first);
+	putchar('}');
+}
+
+static void lval_print(lval *v) {
+	switch (v->type) {
+	case LVAL_NUM:
+	       	printf("%li", v->num);
 	       	break;
+	case LVAL_BIG:
+		lval_print_big(v);
+		break;
+	case LVAL_FLOAT:
+		lval_print_float(v);
+		break;
+	case LVAL_VEC:
+		lval_print_vec(v);
+		break;
+	case LVAL_MAT:
+		lval_print_mat(v);
+		break;
+	case LVAL_MAP:
+		lval_print_map(v);
+		break;
+	case LVAL_LAZY:
+		printf("<lazy sequence>");
+		break;
+	case LVAL_TABLE:
+		lval_print_table(v);
+		break;
+	case LVAL_PQ:
+		printf("<priority queue of %li>", v->pq->n);
+		break;
+	case LVAL_SORTED:
+		lval_print_sorted(v);
+		break;
+	case LVAL_SET:
+		lval_print_set(v);
+		break;
+	case LVAL_GRAMMAR:
+		lval_print_grammar(v);
+		break;
+	case LVAL_BYTES:
+		lval_print_bytes(v);
+		break;
 	case LVAL_ERR:
 		printf("Error: %s", v->err);
 		break;
@@ -535,7 +1858,11 @@ static void lval_print(lval *v) {
 		lval_print_str(v);
 		break;
 	case LVAL_FUN:
-		if (v->builtin) {
+		if (v->memo) {
+			printf("(memo ");
+			lval_print(v->memo->fn);
+			putchar(')');
+		} else if (v->builtin) {
 			printf("<function>");
 		} else {
 			printf("(\\ ");
@@ -551,6 +1878,11 @@ static void lval_print(lval *v) {
 	case LVAL_QEXPR:
 		lval_expr_print(v, '{', '}');
 		break;
+	case LVAL_RECUR:
+		printf("<recur ");
+		lval_expr_print(v, '{', '}');
+		putchar('>');
+		break;
 	case LVAL_BOOL:
 		if (v->b) {
 			printf("t");
@@ -601,6 +1933,11 @@ static lval * lval_join(lval *x, lval *y) {
 }
 
 static lval * lval_copy(lval *v) {
+	if (lval_consed(v)) {
+		v->refs++;
+		return v;
+	}
+
 	lval *x = malloc(sizeof(lval));
 	x->type = v->type;
 
@@ -612,8 +1949,68 @@ static lval * lval_copy(lval *v) {
 	case LVAL_BOOL:
 		x->b = v->b;
 		break;
+	case LVAL_BIG:
+		lval_to_big(v, &x->big);
+		break;
+	case LVAL_FLOAT:
+		x->fnum = v->fnum;
+		break;
+	case LVAL_MAT:
+		x->mrows = v->mrows;
+		x->mcols = v->mcols;
+		/* no break! */
+	case LVAL_VEC:
+	case LVAL_BYTES:
+		/* vectors are immutable, share the storage */
+		x->vtype = v->vtype;
+		x->vlen = v->vlen;
+		x->vdata = v->vdata;
+		x->vbuf = v->vbuf;
+		x->vbuf->refs++;
+		break;
+	case LVAL_MAP:
+		/* maps are persistent, share the trie */
+		x->hroot = v->hroot;
+		x->hcount = v->hcount;
+		if (v->hroot) { v->hroot->refs++; }
+		break;
+	case LVAL_LAZY:
+		x->lazy = v->lazy;
+		x->lazy->refs++;
+		break;
+	case LVAL_TABLE:
+		x->tbl = v->tbl;
+		x->tbl->refs++;
+		break;
+	case LVAL_PQ:
+		/* queues are handles, copies share the heap */
+		x->pq = v->pq;
+		x->pq->refs++;
+		break;
+	case LVAL_SORTED:
+		/* nodes are copied on write, share the tree */
+		x->broot = v->broot;
+		x->bcount = v->bcount;
+		x->bkind = v->bkind;
+		x->bmap = v->bmap;
+		if (v->broot) { v->broot->refs++; }
+		break;
+	case LVAL_SET:
+		/* containers are copied on write, share the set */
+		x->set = v->set;
+		x->set->refs++;
+		break;
+	case LVAL_GRAMMAR:
+		x->gram = v->gram;
+		x->gram->refs++;
+		break;
 	case LVAL_FUN:
-		if (v->builtin) {
+		/* memoized functions share their cache */
+		x->memo = v->memo;
+		if (v->memo) {
+			x->builtin = NULL;
+			v->memo->refs++;
+		} else if (v->builtin) {
 			x->builtin = v->builtin;
 		} else {
 			x->builtin = NULL;
@@ -633,13 +2030,20 @@ static lval * lval_copy(lval *v) {
 		strcpy(x->sym, v->sym);
 		break;
 	case LVAL_STR:
-		x->str = malloc(strlen(v->str) + 1);
-		strcpy(x->str, v->str);
+		/* strings are immutable, share the storage */
+		x->slen = v->slen;
+		x->soff = v->soff;
+		x->str = v->str;
+		x->rope = v->rope;
+		if (v->str) { v->str->refs++; }
+		if (v->rope) { v->rope->refs++; }
 		break;
 
 		/* copy lists by copying each element */
 	case LVAL_SEXPR: /* no break! */
+	case LVAL_RECUR:
 	case LVAL_QEXPR:
+		x->consed = 0;
 		x->count = v->count;
 		x->cell = malloc(sizeof(lval *) * x->count);
 		for (int i = 0; i < x->count; i++) {
@@ -664,16 +2068,53 @@ int lval_eq(lval *x, lval *y) {
 		return x->num == y->num;
 	case LVAL_BOOL:
 		return x->b == y->b;
+	case LVAL_FLOAT:
+		return x->fnum == y->fnum;
+	case LVAL_MAT:
+		if (x->mrows != y->mrows || x->mcols != y->mcols) { return 0; }
+		/* no break! */
+	case LVAL_VEC:
+		return x->vtype == y->vtype && x->vlen == y->vlen
+			&& memcmp(x->vdata, y->vdata, 8 * x->vlen) == 0;
+	case LVAL_MAP:
+		return x->hcount == y->hcount && lhamt_within(x->hroot, y->hroot);
+	case LVAL_LAZY:
+		return x->lazy == y->lazy;
+	case LVAL_TABLE:
+		return ltable_eq(x->tbl, y->tbl);
+	case LVAL_PQ:
+		return x->pq == y->pq;
+	case LVAL_SORTED:
+		return lval_sorted_eq(x, y);
+	case LVAL_SET:
+		return lroar_eq(x->set, y->set);
+	case LVAL_GRAMMAR:
+		return x->gram == y->gram || strcmp(x->gram->text, y->gram->text) == 0;
+	case LVAL_BYTES:
+		return x->vlen == y->vlen && memcmp(x->vdata, y->vdata, x->vlen) == 0;
+	case LVAL_BIG:
+		return x->big.neg == y->big.neg
+			&& mag_cmp(x->big.d, x->big.len, y->big.d, y->big.len) == 0;
 	case LVAL_ERR:
 		return (strcmp(x->err, y->err) == 0);
 	case LVAL_SYM:
 		return (strcmp(x->sym, y->sym) == 0);
 	case LVAL_STR:
-		return (strcmp(x->str, y->str) == 0);
+		if (x->slen != y->slen) { return 0; }
+		if (x->str && x->str == y->str && x->soff == y->soff) { return 1; }
+		/* interned text is unique */
+		if (x->str && y->str && x->str->interned && y->str->interned
+		    && x->str->len == x->slen && y->str->len == y->slen) {
+			return 0;
+		}
+		return memcmp(lval_sdata(x), lval_sdata(y), x->slen) == 0;
 
 	case LVAL_FUN:
 		/* If builtin compare pointer otherwise
 		 * compare formals and body */
+		if (x->memo || y->memo) {
+			return x->memo == y->memo;
+		}
 		if (x->builtin || y->builtin) {
 			return x->builtin == y->builtin;
 		} else {
@@ -682,7 +2123,12 @@ int lval_eq(lval *x, lval *y) {
 		}
 
 	case LVAL_QEXPR:
+	case LVAL_RECUR:
 	case LVAL_SEXPR:
+		/* consed lists are unique */
+		if (x == y) { return 1; }
+		if (x->consed && y->consed) { return 0; }
+
 		/* for lists compare each element individually */
 		if (x->count != y->count) { return 0; }
 		for (int i = 0; i < x->count; i++) {
@@ -696,12 +2142,415 @@ int lval_eq(lval *x, lval *y) {
 	return 0;
 }
 
+/* splitmix64 finalizer, spreads the bits of h over the whole word */
+static uint64_t lhash_mix(uint64_t h) {
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+static void lval_hash_map_entry(lhleaf *l, void *h);
+
+/* Hash consistent with lval_eq: equal values hash equal */
+static uint64_t lval_hash(lval *v) {
+	uint64_t h = 0;
+	double d;
+
+	switch (v->type) {
+	case LVAL_NUM:
+		h = v->num;
+		break;
+	case LVAL_BOOL:
+		h = v->b;
+		break;
+	case LVAL_FLOAT:
+		/* 0.0 == -0.0 */
+		d = v->fnum == 0 ? 0.0 : v->fnum;
+		memcpy(&h, &d, sizeof(h));
+		break;
+	case LVAL_BIG:
+		h = v->big.neg;
+		for (int i = 0; i < v->big.len; i++) {
+			h = lhash_mix(h ^ v->big.d[i]);
+		}
+		break;
+	case LVAL_MAT:
+		h = lhash_mix(v->mrows);
+		/* no break! */
+	case LVAL_VEC:
+		h ^= lstr_hash_bytes(v->vdata, 8 * v->vlen) + v->vtype;
+		break;
+	case LVAL_ERR:
+		h = lstr_hash_bytes(v->err, strlen(v->err));
+		break;
+	case LVAL_SYM:
+		h = lstr_hash_bytes(v->sym, strlen(v->sym));
+		break;
+	case LVAL_STR:
+		if (v->str && v->soff == 0 && v->slen == v->str->len) {
+			h = lstr_hash(v->str);
+		} else {
+			h = lstr_hash_bytes(lval_sdata(v), v->slen);
+		}
+		break;
+	case LVAL_FUN:
+		if (v->memo) {
+			h = (uintptr_t)v->memo;
+		} else if (v->builtin) {
+			h = (uintptr_t)v->builtin;
+		} else {
+			h = lval_hash(v->formals) * 31 + lval_hash(v->body);
+		}
+		break;
+	case LVAL_LAZY:
+		h = (uintptr_t)v->lazy;
+		break;
+	case LVAL_PQ:
+		h = (uintptr_t)v->pq;
+		break;
+	case LVAL_SORTED:
+		h = lval_sorted_hash(v);
+		break;
+	case LVAL_SET:
+		h = lroar_hash(v->set);
+		break;
+	case LVAL_GRAMMAR:
+		h = v->gram->hash;
+		break;
+	case LVAL_BYTES:
+		h = lstr_hash_bytes(v->vdata, v->vlen);
+		break;
+	case LVAL_TABLE:
+		/* the shape, values are only compared */
+		h = lhash_mix(v->tbl->nrows) + v->tbl->ncols;
+		break;
+	case LVAL_MAP:
+		/* independent of the order of the entries */
+		lhamt_each(v->hroot, lval_hash_map_entry, &h);
+		break;
+	case LVAL_QEXPR:
+	case LVAL_RECUR:
+	case LVAL_SEXPR:
+		if (v->consed) { return v->hash; }
+		h = v->count;
+		for (int i = 0; i < v->count; i++) {
+			h = lhash_mix(h) + lval_hash(v->cell[i]);
+		}
+		break;
+	}
+	return lhash_mix(h ^ ((uint64_t)v->type << 56));
+}
+
+static void lval_hash_map_entry(lhleaf *l, void *h) {
+	*(uint64_t *)h += lhash_mix(l->hash + 31 * lval_hash(l->val));
+}
+
+/* Hash consing
+ *
+ * Q-expression literals are read into shared, immutable lists: equal
+ * literals are the same node, so comparing them is a pointer comparison
+ * and their structural hash is computed once. Like interned strings the
+ * table only holds weak references. Code that modifies a list first
+ * takes a private copy of the top node with lval_thaw. */
+
+static struct {
+	lval **slots;
+	size_t size;
+	size_t count;
+} lcons_table;
+
+/* Elements of consed lists are consed lists or atoms, so comparing
+ * them is cheap. Merging literals must not change a result, so floats
+ * compare by their bits: 0.0 and -0.0 stay apart and nan matches
+ * itself. */
+static int lcons_same(lval *x, lval *y) {
+	if (x->type == LVAL_FLOAT && y->type == LVAL_FLOAT) {
+		return memcmp(&x->fnum, &y->fnum, sizeof(double)) == 0;
+	}
+	if (lval_consed(x) && lval_consed(y)) { return x == y; }
+	return lval_eq(x, y);
+}
+
+static size_t lcons_slot(lval *v, uint64_t h) {
+	size_t mask = lcons_table.size - 1;
+	size_t i = h & mask;
+	while (lcons_table.slots[i]) {
+		lval *c = lcons_table.slots[i];
+		if (c->hash == h && c->type == v->type && c->count == v->count) {
+			int j = 0;
+			while (j < v->count && lcons_same(c->cell[j], v->cell[j])) { j++; }
+			if (j == v->count) { break; }
+		}
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+static void lcons_grow(void) {
+	lval **old = lcons_table.slots;
+	size_t n = lcons_table.size;
+	lcons_table.size = n ? n * 2 : 256;
+	lcons_table.slots = calloc(lcons_table.size, sizeof(lval *));
+	for (size_t i = 0; i < n; i++) {
+		if (old[i]) {
+			lcons_table.slots[lcons_slot(old[i], old[i]->hash)] = old[i];
+		}
+	}
+	free(old);
+}
+
+/* The shared node equal to the list v, consumes v */
+static lval * lval_cons(lval *v) {
+	if (v->consed) { return v; }
+
+	for (int i = 0; i < v->count; i++) {
+		lval *c = v->cell[i];
+		if (c->type == LVAL_SEXPR || c->type == LVAL_QEXPR) {
+			v->cell[i] = lval_cons(c);
+		}
+	}
+
+	if (2 * (lcons_table.count + 1) > lcons_table.size) {
+		lcons_grow();
+	}
+
+	uint64_t h = lval_hash(v);
+	size_t i = lcons_slot(v, h);
+	lval *c = lcons_table.slots[i];
+	if (c) {
+		c->refs++;
+		lval_del(v);
+		return c;
+	}
+
+	v->consed = 1;
+	v->refs = 1;
+	v->hash = h;
+	lcons_table.slots[i] = v;
+	lcons_table.count++;
+	return v;
+}
+
+static void lcons_remove(lval *v) {
+	size_t mask = lcons_table.size - 1;
+	size_t i = lcons_slot(v, v->hash);
+	lcons_table.slots[i] = NULL;
+	lcons_table.count--;
+
+	/* shift following entries of the probe sequence back */
+	for (size_t j = (i + 1) & mask; lcons_table.slots[j]; j = (j + 1) & mask) {
+		lval *t = lcons_table.slots[j];
+		lcons_table.slots[j] = NULL;
+		lcons_table.slots[lcons_slot(t, t->hash)] = t;
+	}
+}
+
+/* A version of v that may be modified: consed lists are copied one
+ * level deep, their elements stay shared. Consumes v. */
+static lval * lval_thaw(lval *v) {
+	if (!lval_consed(v)) { return v; }
+
+	lval *x = v->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+	x->count = v->count;
+	x->cell = malloc(sizeof(lval *) * x->count);
+	for (int i = 0; i < x->count; i++) {
+		x->cell[i] = lval_copy(v->cell[i]);
+	}
+	lval_del(v);
+	return x;
+}
+
+
+/* Slow path of the arithmetic operators: both operands are promoted to
+ * bignums and the result is demoted again if it fits into a fixnum.
+ * Consumes x and y. */
+static lval * lval_arith_big(lval *x, lval *y, char *op) {
+	lbig a, b, r, m;
+	lval_to_big(x, &a);
+	lval_to_big(y, &b);
+	lval_del(x);
+	lval_del(y);
+
+	if (strcmp(op, "+") == 0) { lbig_add(&r, &a, &b, 0); }
+	if (strcmp(op, "-") == 0) { lbig_add(&r, &a, &b, 1); }
+	if (strcmp(op, "*") == 0) { lbig_mul(&r, &a, &b); }
+	if (strcmp(op, "/") == 0 || strcmp(op, "%") == 0) {
+		if (b.len == 0) {
+			lbig_free(&a);
+			lbig_free(&b);
+			return lval_err("Division by zero!");
+		}
+		lbig_divmod(&r, &m, &a, &b);
+		if (strcmp(op, "%") == 0) {
+			lbig_free(&r);
+			r = m;
+		} else {
+			lbig_free(&m);
+		}
+	}
+	if (strcmp(op, "^") == 0) {
+		long ex;
+		if (b.neg && a.len == 0) {
+			lbig_free(&a);
+			lbig_free(&b);
+			return lval_err("Division by zero!");
+		} else if (b.neg) {
+			/* integer part of a negative power */
+			int one = a.len == 1 && a.d[0] == 1;
+			lbig_from_long(&r, !one ? 0
+				       : (a.neg && (b.d[0] & 1)) ? -1 : 1);
+		} else if (a.len <= 1 && (a.len == 0 || a.d[0] == 1)) {
+			/* 0, 1 and -1 stay small for any exponent */
+			lbig_from_long(&r, a.len == 0 ? 0
+				       : (a.neg && (b.d[0] & 1)) ? -1 : 1);
+		} else if (!lbig_to_long(&b, &ex)
+			   || (double)ex * a.len > (1 << 24)) {
+			lbig_free(&a);
+			lbig_free(&b);
+			return lval_err("Exponent too large!");
+		} else {
+			lbig_pow(&r, &a, ex);
+		}
+	}
+
+	lbig_free(&a);
+	lbig_free(&b);
+	return lval_big(&r);
+}
+
+/* Float arithmetic: the other operand is converted and the result is
+ * stored unboxed in x, so no allocation happens. Consumes x and y. */
+static lval * lval_arith_float(lval *x, lval *y, char *op) {
+	double a = lval_to_double(x);
+	double b = lval_to_double(y);
+	lval_del(y);
+
+	if (x->type == LVAL_BIG) { lbig_free(&x->big); }
+	x->type = LVAL_FLOAT;
+
+	switch (op[0]) {
+	case '+': x->fnum = a + b; break;
+	case '-': x->fnum = a - b; break;
+	case '*': x->fnum = a * b; break;
+	case '/': x->fnum = a / b; break;
+	case '%': x->fnum = fmod(a, b); break;
+	case '^': x->fnum = pow(a, b); break;
+	}
+	return x;
+}
+
+/* Apply op to x and y. Fixnums are computed in place with overflow
+ * checks, everything that does not fit is handed to the bignum path.
+ * Consumes x and y. */
+static lval * lval_arith(lval *x, lval *y, char *op) {
+	if (x->type == LVAL_FLOAT || y->type == LVAL_FLOAT) {
+		return lval_arith_float(x, y, op);
+	}
+
+	if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+		long r;
+		switch (op[0]) {
+		case '+':
+			if (__builtin_add_overflow(x->num, y->num, &r)) { break; }
+			x->num = r;
+			lval_del(y);
+			return x;
+		case '-':
+			if (__builtin_sub_overflow(x->num, y->num, &r)) { break; }
+			x->num = r;
+			lval_del(y);
+			return x;
+		case '*':
+			if (__builtin_mul_overflow(x->num, y->num, &r)) { break; }
+			x->num = r;
+			lval_del(y);
+			return x;
+		case '/':
+		case '%':
+			if (y->num == 0) {
+				lval_del(x);
+				lval_del(y);
+				return lval_err("Division by zero!");
+			}
+			/* LONG_MIN / -1 is the only overflowing case */
+			if (x->num == LONG_MIN && y->num == -1) { break; }
+			x->num = op[0] == '/' ? x->num / y->num : x->num % y->num;
+			lval_del(y);
+			return x;
+		case '^':
+			if (y->num < 0) {
+				if (x->num == 0) {
+					lval_del(x);
+					lval_del(y);
+					return lval_err("Division by zero!");
+				}
+				break;
+			}
+			/* exponentiation by squaring */
+			r = 1;
+			long b = x->num;
+			unsigned long ex = y->num;
+			int overflow = 0;
+			while (ex && !overflow) {
+				if (ex & 1) {
+					overflow |= __builtin_mul_overflow(r, b, &r);
+				}
+				ex >>= 1;
+				if (ex) {
+					overflow |= __builtin_mul_overflow(b, b, &b);
+				}
+			}
+			if (overflow) { break; }
+			x->num = r;
+			lval_del(y);
+			return x;
+		}
+	}
+
+	if (y->type == LVAL_BIG && y->big.len == 0) {
+		/* never produced by lval_big, kept for robustness */
+		lval_del(x);
+		lval_del(y);
+		return lval_err("Division by zero!");
+	}
+	if (x->type == LVAL_BIG && y->type == LVAL_NUM && y->num == 0
+	    && (op[0] == '/' || op[0] == '%')) {
+		lval_del(x);
+		lval_del(y);
+		return lval_err("Division by zero!");
+	}
+
+	return lval_arith_big(x, y, op);
+}
+
+/* -1, 0 or 1 depending on the order of the numbers x and y */
+static int lval_num_cmp(lval *x, lval *y) {
+	if (x->type == LVAL_FLOAT || y->type == LVAL_FLOAT) {
+		double a = lval_to_double(x);
+		double b = lval_to_double(y);
+		return (a > b) - (a < b);
+	}
+
+	if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+		return (x->num > y->num) - (x->num < y->num);
+	}
+
+	/* a normalized bignum is always beyond the fixnum range */
+	if (x->type == LVAL_NUM) { return y->big.neg ? 1 : -1; }
+	if (y->type == LVAL_NUM) { return x->big.neg ? -1 : 1; }
+
+	if (x->big.neg != y->big.neg) { return x->big.neg ? -1 : 1; }
+	int c = mag_cmp(x->big.d, x->big.len, y->big.d, y->big.len);
+	return x->big.neg ? -c : c;
+}
 
 static lval * builtin_op(lenv *e, lval *a, char *op) {
 
 	/* Ensure all arguments are numbers */
 	for (int i = 0; i < a->count; i++) {
-		LASSERT_NUM_AT(a, i, op);
+		LASSERT_NUMERIC_AT(a, i, op);
 	}
 
 	/* Pop the first element */
@@ -709,7 +2558,7 @@ static lval * builtin_op(lenv *e, lval *a, char *op) {
 
 	/* If no arguments and sub then perform unary negation */
 	if (a->count == 0 && (strcmp(op, "-") == 0)) {
-		x->num = -x->num;
+		x = lval_arith(lval_num(0), x, op);
 	}
 
 	/* while there are still elements remaining */
@@ -718,29 +2567,8 @@ static lval * builtin_op(lenv *e, lval *a, char *op) {
 		/* pop the next element */
 		lval *y = lval_pop(a, 0);
 
-		if (strcmp(op, "+") == 0) { x->num += y->num; }
-		if (strcmp(op, "-") == 0) { x->num -= y->num; }
-		if (strcmp(op, "*") == 0) { x->num *= y->num; }
-		if (strcmp(op, "/") == 0) {
-			if (y->num == 0) {
-				lval_del(x);
-				lval_del(y);
-				x = lval_err("Division by zero!");
-				break;
-			}
-			x->num /= y->num;
-		}
-		if (strcmp(op, "%") == 0) {
-			if (y->num == 0) {
-				lval_del(x);
-				lval_del(y);
-				x = lval_err("Division by zero!");
-				break;
-			}
-			x->num %= y->num;
-		}
-		if (strcmp(op, "^") == 0) { x->num = pow(x->num, y->num); }
-		lval_del(y);
+		x = lval_arith(x, y, op);
+		if (x->type == LVAL_ERR) { break; }
 	}
 
 	lval_del(a);
@@ -749,21 +2577,22 @@ static lval * builtin_op(lenv *e, lval *a, char *op) {
 
 static lval * builtin_ord(lenv *e, lval *a, char *op) {
 	LASSERT_COUNT(a, 2, op);
-	LASSERT_NUM_AT(a, 0, op);
-	LASSERT_NUM_AT(a, 1, op);
+	LASSERT_NUMERIC_AT(a, 0, op);
+	LASSERT_NUMERIC_AT(a, 1, op);
 
+	int c = lval_num_cmp(a->cell[0], a->cell[1]);
 	int r;
 	if (strcmp(op, ">") == 0) {
-		r = (a->cell[0]->num > a->cell[1]->num);
+		r = (c > 0);
 	}
 	if (strcmp(op, "<") == 0) {
-		r = (a->cell[0]->num < a->cell[1]->num);
+		r = (c < 0);
 	}
 	if (strcmp(op, ">=") == 0) {
-		r = (a->cell[0]->num >= a->cell[1]->num);
+		r = (c >= 0);
 	}
 	if (strcmp(op, "<=") == 0) {
-		r = (a->cell[0]->num <= a->cell[1]->num);
+		r = (c <= 0);
 	}
 	lval_del(a);
 	return lval_bool(r);
@@ -848,61 +2677,499 @@ static lval * builtin_join(lenv *e, lval *a) {
 	return x;
 }
 
-static lval * builtin_add(lenv *e, lval *a) {
-	return builtin_op(e, a, "+");
-}
+/* Higher order list functions
+ *
+ * These walk the cell array of the list in place. Builtins are called
+ * directly, lambdas go through lval_call. */
 
-static lval * builtin_sub(lenv *e, lval *a) {
-	return builtin_op(e, a, "-");
-}
+/* Apply f to the arguments a, consumes a but not f. A lambda given all
+ * of its arguments binds them in a new environment, the formals are
+ * read in place so f is not copied for every call. */
+static lval * lval_apply(lenv *e, lval *f, lval *a) {
+	if (f->builtin) {
+		for (int i = 0; i < a->count; i++) {
+			a->cell[i] = lval_thaw(a->cell[i]);
+		}
+		return lval_no_recur(f->builtin(e, a));
+	}
 
-static lval * builtin_mul(lenv *e, lval *a) {
-	return builtin_op(e, a, "*");
-}
+	/* n plain formals, then possibly '&' and the symbol for the rest */
+	lval *formals = f->memo ? NULL : f->formals;
+	int n = formals ? formals->count : 0;
+	int rest = n >= 2 && strcmp(formals->cell[n - 2]->sym, "&") == 0;
+	if (rest) { n -= 2; }
+	int plain = formals != NULL;
+	for (int i = 0; i < n && plain; i++) {
+		plain = strcmp(formals->cell[i]->sym, "&") != 0;
+	}
 
-static lval * builtin_div(lenv *e, lval *a) {
-	return builtin_op(e, a, "/");
+	/* partial application, bad formals and memoized functions take
+	 * the general path, where binding consumes the formals */
+	if (!plain || (rest ? a->count < n : a->count != n)) {
+		lval *g = lval_copy(f);
+		lval *x = lval_call(e, g, a);
+		lval_del(g);
+		return x;
+	}
+
+	lenv *env = lenv_copy(f->env);
+	for (int i = 0; i < n; i++) {
+		lenv_put(env, formals->cell[i], a->cell[i]);
+	}
+	if (rest) {
+		lval *q = lval_qexpr();
+		q->count = a->count - n;
+		q->cell = malloc(sizeof(lval *) * (q->count ? q->count : 1));
+		memcpy(q->cell, a->cell + n, sizeof(lval *) * q->count);
+		a->count = n;
+		lenv_put(env, formals->cell[n + 1], q);
+		lval_del(q);
+	}
+	lval_del(a);
+
+	env->par = e;
+	lval *x = builtin_eval(env, lval_add(lval_sexpr(), lval_copy(f->body)));
+	lenv_del(env);
+	return lval_no_recur(x);
 }
 
-static lval * builtin_var(lenv *e, lval *a, char *func) {
-	LASSERT_QEXPR_AT(a, 0, func);
+static lval * lval_apply2(lenv *e, lval *f, lval *x, lval *y) {
+	return lval_apply(e, f, lval_add(lval_add(lval_sexpr(), x), y));
+}
 
-	lval *syms = a->cell[0];
-	for (int i = 0; i < syms->count; i++) {
-		LASSERT(a, syms->cell[i]->type == LVAL_SYM,
-			"Function '%s' cannot define non-symbol. Got %s, expected %s.",
-			func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+static lval * builtin_map(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "map");
+	LASSERT_TYPE_AT(a, 0, LVAL_FUN, "map");
+	LASSERT_QEXPR_AT(a, 1, "map");
+
+	lval *f = lval_pop(a, 0);
+	lval *q = lval_take(a, 0);
+	for (int i = 0; i < q->count; i++) {
+		q->cell[i] = lval_apply(e, f, lval_add(lval_sexpr(), q->cell[i]));
+		if (q->cell[i]->type == LVAL_ERR) {
+			lval_del(f);
+			return lval_take(q, i);
+		}
 	}
-	LASSERT(a, syms->count == a->count - 1,
-		"Function '%s' passed too many arguments for symbols. "
-		"Got %i, expected %i.", func, syms->count, a->count - 1);
 
-	for (int i = 0; i < syms->count; i++) {
-		/* If "def" define in globally. If "put" define locally. */
-		if (strcmp(func, "def") == 0) {
-			lenv_def(e, syms->cell[i], a->cell[i + 1]);
-		}
+	lval_del(f);
+	return q;
+}
 
-		if (strcmp(func, "=") == 0) {
-			lenv_put(e, syms->cell[i], a->cell[i + 1]);
+static lval * builtin_filter(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "filter");
+	LASSERT_TYPE_AT(a, 0, LVAL_FUN, "filter");
+	LASSERT_QEXPR_AT(a, 1, "filter");
+
+	lval *f = lval_pop(a, 0);
+	lval *q = lval_take(a, 0);
+	int n = 0;
+	for (int i = 0; i < q->count; i++) {
+		lval *x = q->cell[i];
+		lval *r = lval_apply(e, f, lval_add(lval_sexpr(), lval_copy(x)));
+		if (r->type != LVAL_BOOL) {
+			lval *err = r->type == LVAL_ERR ? r : lval_err(
+				"Function 'filter' predicate returned %s, expected %s",
+				ltype_name(r->type), ltype_name(LVAL_BOOL));
+			if (err != r) { lval_del(r); }
+			/* the kept elements were moved to the front */
+			q->count = n + (q->count - i);
+			memmove(&q->cell[n], &q->cell[i], sizeof(lval *) * (q->count - n));
+			lval_del(q);
+			lval_del(f);
+			return err;
+		}
+		if (r->b) {
+			q->cell[n++] = x;
+		} else {
+			lval_del(x);
 		}
+		lval_del(r);
 	}
+	q->count = n;
 
-	lval_del(a);
-	return lval_sexpr();
+	lval_del(f);
+	return q;
 }
 
-static lval * builtin_lambda(lenv *e, lval *a) {
-	/* Check two arguments, each of which are Q-Expressions */
-	LASSERT_COUNT(a, 2, "\\");
-	LASSERT_QEXPR_AT(a, 0, "\\");
-	LASSERT_QEXPR_AT(a, 1, "\\");
-
-	/* Check if first Q-Expression contains only symbols */
-	for (int i = 0; i < a->cell[0]->count; i++) {
-		LASSERT(a, a->cell[0]->cell[i]->type == LVAL_SYM,
-			"Cannot define non-symbol. Got %s, expected %s.",
-			ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+/* (foldl f z {a b c}) is (f (f (f z a) b) c) */
+static lval * builtin_foldl(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 3, "foldl");
+	LASSERT_TYPE_AT(a, 0, LVAL_FUN, "foldl");
+	LASSERT_QEXPR_AT(a, 2, "foldl");
+
+	lval *f = lval_pop(a, 0);
+	lval *acc = lval_pop(a, 0);
+	lval *q = lval_take(a, 0);
+	for (int i = 0; i < q->count && acc->type != LVAL_ERR; i++) {
+		acc = lval_apply2(e, f, acc, q->cell[i]);
+		q->cell[i] = NULL;
+	}
+
+	/* elements not used because of an error are still owned by q */
+	for (int i = 0; i < q->count; i++) {
+		if (q->cell[i]) { lval_del(q->cell[i]); }
+	}
+	q->count = 0;
+	lval_del(q);
+	lval_del(f);
+	return acc;
+}
+
+/* (foldr f z {a b c}) is (f a (f b (f c z))) */
+static lval * builtin_foldr(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 3, "foldr");
+	LASSERT_TYPE_AT(a, 0, LVAL_FUN, "foldr");
+	LASSERT_QEXPR_AT(a, 2, "foldr");
+
+	lval *f = lval_pop(a, 0);
+	lval *acc = lval_pop(a, 0);
+	lval *q = lval_take(a, 0);
+	while (q->count && acc->type != LVAL_ERR) {
+		acc = lval_apply2(e, f, q->cell[--q->count], acc);
+	}
+
+	lval_del(q);
+	lval_del(f);
+	return acc;
+}
+
+static lval * builtin_reverse(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "reverse");
+	LASSERT_QEXPR_AT(a, 0, "reverse");
+
+	lval *q = lval_take(a, 0);
+	for (int i = 0, j = q->count - 1; i < j; i++, j--) {
+		lval *t = q->cell[i];
+		q->cell[i] = q->cell[j];
+		q->cell[j] = t;
+	}
+	return q;
+}
+
+/* first n elements if take is set, otherwise all but the first n */
+static lval * builtin_take_drop(lenv *e, lval *a, char *fn, int take) {
+	LASSERT_COUNT(a, 2, fn);
+	LASSERT_NUM_AT(a, 0, fn);
+	LASSERT_QEXPR_AT(a, 1, fn);
+	LASSERT(a, a->cell[0]->num >= 0,
+		"Function '%s' passed negative count %li!", fn, a->cell[0]->num);
+
+	long n = a->cell[0]->num;
+	lval *q = lval_take(a, 1);
+	if (n > q->count) { n = q->count; }
+
+	int keep = take ? n : q->count - n;
+	int from = take ? 0 : n;
+	for (int i = 0; i < q->count; i++) {
+		if (i < from || i >= from + keep) { lval_del(q->cell[i]); }
+	}
+	memmove(&q->cell[0], &q->cell[from], sizeof(lval *) * keep);
+	q->count = keep;
+	q->cell = realloc(q->cell, sizeof(lval *) * keep);
+	return q;
+}
+
+static lval * builtin_take(lenv *e, lval *a) {
+	return builtin_take_drop(e, a, "take", 1);
+}
+
+static lval * builtin_drop(lenv *e, lval *a) {
+	return builtin_take_drop(e, a, "drop", 0);
+}
+
+/* (range end), (range start end) or (range start end step) */
+static lval * builtin_range(lenv *e, lval *a) {
+	LASSERT(a, a->count >= 1 && a->count <= 3,
+		"Function 'range' passed incorrect number of arguments! "
+		"Got %i, expected 1 to 3", a->count);
+	for (int i = 0; i < a->count; i++) {
+		LASSERT_NUM_AT(a, i, "range");
+	}
+
+	long start = a->count > 1 ? a->cell[0]->num : 0;
+	long end = a->count > 1 ? a->cell[1]->num : a->cell[0]->num;
+	long step = a->count > 2 ? a->cell[2]->num : 1;
+	LASSERT(a, step != 0, "Function 'range' passed a step of zero!");
+
+	/* the span of the range does not always fit into a long */
+	unsigned long n = 0;
+	if (step > 0 && end > start) {
+		n = ((unsigned long)end - start - 1) / step + 1;
+	} else if (step < 0 && start > end) {
+		n = ((unsigned long)start - end - 1) / -(unsigned long)step + 1;
+	}
+	LASSERT(a, n <= INT_MAX, "Function 'range' would build a list of %lu elements!", n);
+
+	lval *q = lval_qexpr();
+	q->count = n;
+	q->cell = malloc(sizeof(lval *) * n);
+	for (unsigned long i = 0; i < n; i++) {
+		q->cell[i] = lval_num((unsigned long)start + i * step);
+	}
+
+	lval_del(a);
+	return q;
+}
+
+/* Sorting
+ *
+ * sort and sort-by reorder the cell array of the list with a stable
+ * merge sort on (key, element) pairs. The key makes the common cases
+ * cheap: fixnums are radix sorted on it alone, strings compare their
+ * first eight bytes in it before looking at the text. */
+
+typedef struct {
+	uint64_t key;
+	lval *v;
+} lsort_item;
+
+typedef struct {
+	lenv *e;
+	lval *f;
+	lval *err;
+} lsort_ctx;
+
+typedef int (*lsort_less)(lsort_item *x, lsort_item *y, lsort_ctx *c);
+
+static int lsort_less_num(lsort_item *x, lsort_item *y, lsort_ctx *c) {
+	return lval_num_cmp(x->v, y->v) < 0;
+}
+
+static int lsort_less_str(lsort_item *x, lsort_item *y, lsort_ctx *c) {
+	if (x->key != y->key) { return x->key < y->key; }
+	size_t n = x->v->slen < y->v->slen ? x->v->slen : y->v->slen;
+	int r = memcmp(lval_sdata(x->v), lval_sdata(y->v), n);
+	return r ? r < 0 : x->v->slen < y->v->slen;
+}
+
+/* user comparator: (f x y) is true if x goes before y */
+static int lsort_less_fn(lsort_item *x, lsort_item *y, lsort_ctx *c) {
+	if (c->err) { return 0; }
+	lval *r = lval_apply2(c->e, c->f, lval_copy(x->v), lval_copy(y->v));
+	if (r->type == LVAL_BOOL) {
+		int b = r->b;
+		lval_del(r);
+		return b;
+	}
+	if (r->type == LVAL_ERR) {
+		c->err = r;
+	} else {
+		c->err = lval_err("Function 'sort-by' comparator returned %s, "
+				  "expected %s", ltype_name(r->type),
+				  ltype_name(LVAL_BOOL));
+		lval_del(r);
+	}
+	return 0;
+}
+
+/* stable merge sort of a[0..n), tmp has room for n items */
+static void lsort_merge(lsort_item *a, lsort_item *tmp, long n,
+			lsort_less less, lsort_ctx *c) {
+	if (n <= 16) {
+		for (long i = 1; i < n; i++) {
+			lsort_item x = a[i];
+			long j = i;
+			while (j > 0 && less(&x, &a[j - 1], c)) {
+				a[j] = a[j - 1];
+				j--;
+			}
+			a[j] = x;
+		}
+		return;
+	}
+
+	long h = n / 2;
+	lsort_merge(a, tmp, h, less, c);
+	lsort_merge(a + h, tmp, n - h, less, c);
+
+	/* already in order? */
+	if (!less(&a[h], &a[h - 1], c)) { return; }
+
+	memcpy(tmp, a, sizeof(lsort_item) * h);
+	long i = 0, j = h, k = 0;
+	while (i < h && j < n) {
+		a[k++] = less(&a[j], &tmp[i], c) ? a[j++] : tmp[i++];
+	}
+	while (i < h) { a[k++] = tmp[i++]; }
+}
+
+/* LSD radix sort on the keys, one pass per byte that is not the same
+ * in all keys */
+static void lsort_radix(lsort_item *a, lsort_item *tmp, long n) {
+	uint64_t all_or = 0, all_and = ~0ULL;
+	for (long i = 0; i < n; i++) {
+		all_or |= a[i].key;
+		all_and &= a[i].key;
+	}
+
+	for (int shift = 0; shift < 64; shift += 8) {
+		if ((((all_or ^ all_and) >> shift) & 0xff) == 0) { continue; }
+
+		long count[257] = { 0 };
+		for (long i = 0; i < n; i++) {
+			count[((a[i].key >> shift) & 0xff) + 1]++;
+		}
+		for (int b = 0; b < 256; b++) {
+			count[b + 1] += count[b];
+		}
+		for (long i = 0; i < n; i++) {
+			tmp[count[(a[i].key >> shift) & 0xff]++] = a[i];
+		}
+		memcpy(a, tmp, sizeof(lsort_item) * n);
+	}
+}
+
+/* big endian first bytes of a string, so keys order like the text */
+static uint64_t lsort_str_key(lval *v) {
+	const unsigned char *p = (const unsigned char *)lval_sdata(v);
+	uint64_t k = 0;
+	for (size_t i = 0; i < 8; i++) {
+		k = (k << 8) | (i < v->slen ? p[i] : 0);
+	}
+	return k;
+}
+
+/* Sort the list q in place, by f if given. Returns an error or NULL. */
+static lval * lval_sort(lenv *e, lval *q, lval *f) {
+	long n = q->count;
+	if (n < 2) { return NULL; }
+
+	int nums = 1, fixnums = 1, strs = 1;
+	for (long i = 0; i < n; i++) {
+		lval_type t = q->cell[i]->type;
+		if (t != LVAL_NUM) { fixnums = 0; }
+		if (t != LVAL_NUM && t != LVAL_BIG && t != LVAL_FLOAT) { nums = 0; }
+		if (t != LVAL_STR) { strs = 0; }
+	}
+	if (!f && !nums && !strs) {
+		return lval_err("Function 'sort' can only sort numbers or strings! "
+				"Use sort-by for other values");
+	}
+
+	lsort_item *a = malloc(sizeof(lsort_item) * n);
+	lsort_item *tmp = malloc(sizeof(lsort_item) * n);
+	for (long i = 0; i < n; i++) {
+		lval *v = q->cell[i];
+		a[i].v = v;
+		a[i].key = 0;
+		if (!f && fixnums) { a[i].key = (uint64_t)v->num ^ (1ULL << 63); }
+		if (!f && strs) { a[i].key = lsort_str_key(v); }
+	}
+
+	lsort_ctx c = { e, f, NULL };
+	if (f) {
+		lsort_merge(a, tmp, n, lsort_less_fn, &c);
+	} else if (fixnums) {
+		lsort_radix(a, tmp, n);
+	} else {
+		lsort_merge(a, tmp, n, strs ? lsort_less_str : lsort_less_num, &c);
+	}
+
+	/* after an error the order is still a permutation */
+	for (long i = 0; i < n; i++) {
+		q->cell[i] = a[i].v;
+	}
+	free(a);
+	free(tmp);
+	return c.err;
+}
+
+/* (sort l) sorts numbers or strings into ascending order */
+static lval * builtin_sort(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "sort");
+	LASSERT_QEXPR_AT(a, 0, "sort");
+
+	lval *q = lval_take(a, 0);
+	lval *err = lval_sort(e, q, NULL);
+	if (err) {
+		lval_del(q);
+		return err;
+	}
+	return q;
+}
+
+/* (sort-by f l) sorts with the predicate f, (f x y) is true if x
+ * belongs before y, so (sort-by > l) sorts descending */
+static lval * builtin_sort_by(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "sort-by");
+	LASSERT_TYPE_AT(a, 0, LVAL_FUN, "sort-by");
+	LASSERT_QEXPR_AT(a, 1, "sort-by");
+
+	lval *f = lval_pop(a, 0);
+	lval *q = lval_take(a, 0);
+	lval *err = lval_sort(e, q, f);
+	lval_del(f);
+	if (err) {
+		lval_del(q);
+		return err;
+	}
+	return q;
+}
+
+static lval * builtin_add(lenv *e, lval *a) {
+	return builtin_op(e, a, "+");
+}
+
+static lval * builtin_sub(lenv *e, lval *a) {
+	return builtin_op(e, a, "-");
+}
+
+static lval * builtin_mul(lenv *e, lval *a) {
+	return builtin_op(e, a, "*");
+}
+
+static lval * builtin_div(lenv *e, lval *a) {
+	return builtin_op(e, a, "/");
+}
+
+static lval * builtin_mod(lenv *e, lval *a) {
+	return builtin_op(e, a, "%");
+}
+
+static lval * builtin_pow(lenv *e, lval *a) {
+	return builtin_op(e, a, "^");
+}
+
+static lval * builtin_var(lenv *e, lval *a, char *func) {
+	LASSERT_QEXPR_AT(a, 0, func);
+
+	lval *syms = a->cell[0];
+	for (int i = 0; i < syms->count; i++) {
+		LASSERT(a, syms->cell[i]->type == LVAL_SYM,
+			"Function '%s' cannot define non-symbol. Got %s, expected %s.",
+			func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+	}
+	LASSERT(a, syms->count == a->count - 1,
+		"Function '%s' passed too many arguments for symbols. "
+		"Got %i, expected %i.", func, syms->count, a->count - 1);
+
+	for (int i = 0; i < syms->count; i++) {
+		/* If "def" define in globally. If "put" define locally. */
+		if (strcmp(func, "def") == 0) {
+			lenv_def(e, syms->cell[i], a->cell[i + 1]);
+		}
+
+		if (strcmp(func, "=") == 0) {
+			lenv_put(e, syms->cell[i], a->cell[i + 1]);
+		}
+	}
+
+	lval_del(a);
+	return lval_sexpr();
+}
+
+static lval * builtin_lambda(lenv *e, lval *a) {
+	/* Check two arguments, each of which are Q-Expressions */
+	LASSERT_COUNT(a, 2, "\\");
+	LASSERT_QEXPR_AT(a, 0, "\\");
+	LASSERT_QEXPR_AT(a, 1, "\\");
+
+	/* Check if first Q-Expression contains only symbols */
+	for (int i = 0; i < a->cell[0]->count; i++) {
+		LASSERT(a, a->cell[0]->cell[i]->type == LVAL_SYM,
+			"Cannot define non-symbol. Got %s, expected %s.",
+			ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
 	}
 
 	/* Pop first two elements and pass them to lval_lambda */
@@ -980,6 +3247,83 @@ static lval * builtin_if(lenv *e, lval *a) {
 	return x;
 }
 
+/* (loop {i 0 acc 1} {body}) binds the symbols in a new frame and
+ * evaluates body in it. If body evaluates to (recur x y) the symbols are
+ * rebound to x and y in the same frame and body runs again, any other
+ * value is the result of the loop. Iterating needs neither a new
+ * environment nor C stack. */
+static lval * builtin_loop(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "loop");
+	LASSERT_QEXPR_AT(a, 0, "loop");
+	LASSERT_QEXPR_AT(a, 1, "loop");
+
+	lval *b = a->cell[0];
+	LASSERT(a, b->count % 2 == 0,
+		"Function 'loop' passed an odd number of binding elements!");
+	for (int i = 0; i < b->count; i += 2) {
+		LASSERT(a, b->cell[i]->type == LVAL_SYM,
+			"Function 'loop' cannot bind non-symbol! "
+			"Got %s, expected %s",
+			ltype_name(b->cell[i]->type), ltype_name(LVAL_SYM));
+		for (int j = 0; j < i; j += 2) {
+			LASSERT(a, strcmp(b->cell[i]->sym, b->cell[j]->sym) != 0,
+				"Function 'loop' binds '%s' twice!", b->cell[i]->sym);
+		}
+	}
+	int n = b->count / 2;
+
+	/* initial values may refer to the ones before them */
+	lenv *f = lenv_new();
+	f->par = e;
+	for (int i = 0; i < n; i++) {
+		lval *x = lval_no_recur(lval_eval(f, lval_copy(b->cell[2 * i + 1])));
+		if (x->type == LVAL_ERR) {
+			lenv_del(f);
+			lval_del(a);
+			return x;
+		}
+		lenv_put(f, b->cell[2 * i], x);
+		lval_del(x);
+	}
+
+	lval *body = lval_pop(a, 1);
+	lval_del(a);
+
+	lval *x;
+	for (;;) {
+		lval *s = lval_copy(body);
+		s->type = LVAL_SEXPR;
+		x = lval_eval(f, s);
+		if (x->type != LVAL_RECUR) { break; }
+
+		if (x->count != n) {
+			lval *err = lval_err("Function 'recur' passed %i arguments, "
+					     "loop binds %i", x->count, n);
+			lval_del(x);
+			x = err;
+			break;
+		}
+
+		/* the bindings are the first n entries of the frame */
+		for (int i = 0; i < n; i++) {
+			lval_del(f->vals[i]);
+			f->vals[i] = x->cell[i];
+		}
+		x->count = 0;
+		lval_del(x);
+	}
+
+	lval_del(body);
+	lenv_del(f);
+	return x;
+}
+
+/* (recur x y) jumps back to the enclosing loop */
+static lval * builtin_recur(lenv *e, lval *a) {
+	a->type = LVAL_RECUR;
+	return a;
+}
+
 static lval * builtin_or(lenv *e, lval *a) {
 	LASSERT_COUNT(a, 2, "||");
 	LASSERT_BOOL_AT(a, 0, "||");
@@ -1034,12 +3378,12 @@ static lval * builtin_load(lenv *e, lval *a) {
 
 	/* Parse file given by string name */
 	mpc_result_t r;
-	if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
+	if (mpc_parse_contents(lval_cstr(a->cell[0]), Lispy, &r)) {
 		lval *expr = lval_read(r.output);
 		mpc_ast_delete(r.output);
 
 		while(expr->count) {
-			lval *x = lval_eval(e, lval_pop(expr, 0));
+			lval *x = lval_no_recur(lval_eval(e, lval_pop(expr, 0)));
 			if (x->type == LVAL_ERR) {
 				lval_println(x);
 			}
@@ -1078,87 +3422,6962 @@ static lval * builtin_error(lenv *e, lval *a) {
 	LASSERT_COUNT(a, 1, "error");
 	LASSERT_STR_AT(a, 0, "error");
 
-	lval *err = lval_err(a->cell[0]->str);
+	lval *err = lval_err(lval_cstr(a->cell[0]));
 
 	lval_del(a);
 	return err;
 }
 
 
-static void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
-	lval *k = lval_sym(name);
-	lval *v = lval_fun(func);
-	lenv_put(e, k, v);
-	lval_del(k);
-	lval_del(v);
+/* Numeric vectors
+ *
+ * A vector is a packed array of int64 or double. The kernels below
+ * come in a baseline version (plain loops, SSE2 on x86-64) and an AVX2
+ * version which is selected at runtime if the CPU supports it.
+ * Integer vectors use wrapping 64 bit arithmetic. */
+
+static int lvec_avx2 = 0;
+
+static void lvec_init(void) {
+#ifdef LVEC_X86
+	__builtin_cpu_init();
+	lvec_avx2 = __builtin_cpu_supports("avx2");
+#endif
 }
 
-static void lenv_add_builtin_bool(lenv *e, char *sym, boolean val) {
-	lval *v = lval_bool(val);
-	lval *k = lval_sym(sym);
-	lenv_put(e, k, v);
-	lval_del(k);
-	lval_del(v);
+enum { LVEC_ADD, LVEC_SUB, LVEC_MUL, LVEC_DIV,
+       LVEC_EQ, LVEC_LT, LVEC_GT, LVEC_LE, LVEC_GE };
+
+#ifdef LVEC_X86
+LVEC_AVX2 static double lvec_sum_f64_avx2(const double *a, long n) {
+	__m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+	long i = 0;
+	for (; i + 8 <= n; i += 8) {
+		s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+		s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+	}
+	double t[4];
+	_mm256_storeu_pd(t, _mm256_add_pd(s0, s1));
+	double s = (t[0] + t[1]) + (t[2] + t[3]);
+	for (; i < n; i++) { s += a[i]; }
+	return s;
 }
 
-static void lenv_add_builtins(lenv *e) {
-	/* list functions */
-	lenv_add_builtin(e, "list", builtin_list);
-	lenv_add_builtin(e, "head", builtin_head);
-	lenv_add_builtin(e, "tail", builtin_tail);
-	lenv_add_builtin(e, "eval", builtin_eval);
-	lenv_add_builtin(e, "join", builtin_join);
-	lenv_add_builtin(e, "cons", builtin_cons);
-	lenv_add_builtin(e, "len", builtin_len);
+LVEC_AVX2 static int lvec_sum_i64_avx2(const int64_t *a, long n, int64_t *r) {
+	__m256i s = _mm256_setzero_si256();
+	__m256i o = _mm256_setzero_si256();
+	long i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i t = _mm256_add_epi64(s, x);
+		/* a lane overflowed if the sign of the sum differs from both */
+		o = _mm256_or_si256(o, _mm256_and_si256(_mm256_xor_si256(t, s),
+							 _mm256_xor_si256(t, x)));
+		s = t;
+	}
+	if (_mm256_movemask_pd(_mm256_castsi256_pd(o))) { return 0; }
+
+	int64_t t[4];
+	_mm256_storeu_si256((__m256i *)t, s);
+	int overflow = __builtin_add_overflow(t[0], t[1], r);
+	overflow |= __builtin_add_overflow(*r, t[2], r);
+	overflow |= __builtin_add_overflow(*r, t[3], r);
+	for (; i < n; i++) { overflow |= __builtin_add_overflow(*r, a[i], r); }
+	return !overflow;
+}
 
-	/* mathematical functions */
-	lenv_add_builtin(e, "+", builtin_add);
-	lenv_add_builtin(e, "-", builtin_sub);
-	lenv_add_builtin(e, "*", builtin_mul);
-	lenv_add_builtin(e, "/", builtin_div);
+LVEC_AVX2 static double lvec_dot_f64_avx2(const double *a, const double *b, long n) {
+	__m256d s = _mm256_setzero_pd();
+	long i = 0;
+	for (; i + 4 <= n; i += 4) {
+		s = _mm256_add_pd(s, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+						   _mm256_loadu_pd(b + i)));
+	}
+	double t[4];
+	_mm256_storeu_pd(t, s);
+	double r = (t[0] + t[1]) + (t[2] + t[3]);
+	for (; i < n; i++) { r += a[i] * b[i]; }
+	return r;
+}
 
-	lenv_add_builtin(e, "def", builtin_def);
-	lenv_add_builtin(e, "=", builtin_put);
-	lenv_add_builtin(e, "\\", builtin_lambda);
+/* min if max is zero, otherwise max */
+LVEC_AVX2 static double lvec_minmax_f64_avx2(const double *a, long n, int max) {
+	__m256d m = _mm256_set1_pd(a[0]);
+	long i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256d x = _mm256_loadu_pd(a + i);
+		m = max ? _mm256_max_pd(m, x) : _mm256_min_pd(m, x);
+	}
+	double t[4];
+	_mm256_storeu_pd(t, m);
+	double r = t[0];
+	for (int j = 1; j < 4; j++) {
+		r = max ? (t[j] > r ? t[j] : r) : (t[j] < r ? t[j] : r);
+	}
+	for (; i < n; i++) {
+		r = max ? (a[i] > r ? a[i] : r) : (a[i] < r ? a[i] : r);
+	}
+	return r;
+}
 
-	lenv_add_builtin(e, "if", builtin_if);
-	lenv_add_builtin(e, "==", builtin_eq);
-	lenv_add_builtin(e, "!=", builtin_ne);
-	lenv_add_builtin(e, ">",  builtin_gt);
-	lenv_add_builtin(e, "<",  builtin_lt);
-	lenv_add_builtin(e, ">=", builtin_ge);
-	lenv_add_builtin(e, "<=", builtin_le);
+LVEC_AVX2 static int64_t lvec_minmax_i64_avx2(const int64_t *a, long n, int max) {
+	__m256i m = _mm256_set1_epi64x(a[0]);
+	long i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i gt = _mm256_cmpgt_epi64(x, m);
+		m = max ? _mm256_blendv_epi8(m, x, gt) : _mm256_blendv_epi8(x, m, gt);
+	}
+	int64_t t[4];
+	_mm256_storeu_si256((__m256i *)t, m);
+	int64_t r = t[0];
+	for (int j = 1; j < 4; j++) {
+		r = max ? (t[j] > r ? t[j] : r) : (t[j] < r ? t[j] : r);
+	}
+	for (; i < n; i++) {
+		r = max ? (a[i] > r ? a[i] : r) : (a[i] < r ? a[i] : r);
+	}
+	return r;
+}
 
-	lenv_add_builtin(e, "||", builtin_or);
-	lenv_add_builtin(e, "&&", builtin_and);
-	lenv_add_builtin(e, "!",  builtin_not);
+/* r = a op b, b is broadcast if bscalar is set. Returns the number of
+ * elements handled, the caller finishes the tail. */
+LVEC_AVX2 static long lvec_binop_f64_avx2(int op, double *r, const double *a,
+					  const double *b, int bscalar, long n) {
+	__m256d bs = _mm256_set1_pd(b[0]);
+	__m256d one = _mm256_castsi256_pd(_mm256_set1_epi64x(1));
+	long i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256d x = _mm256_loadu_pd(a + i);
+		__m256d y = bscalar ? bs : _mm256_loadu_pd(b + i);
+		__m256d z;
+		switch (op) {
+		case LVEC_ADD: z = _mm256_add_pd(x, y); break;
+		case LVEC_SUB: z = _mm256_sub_pd(x, y); break;
+		case LVEC_MUL: z = _mm256_mul_pd(x, y); break;
+		case LVEC_DIV: z = _mm256_div_pd(x, y); break;
+		/* comparisons store int64 0 or 1 */
+		case LVEC_EQ: z = _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_EQ_OQ), one); break;
+		case LVEC_LT: z = _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_LT_OQ), one); break;
+		case LVEC_GT: z = _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_GT_OQ), one); break;
+		case LVEC_LE: z = _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_LE_OQ), one); break;
+		default:      z = _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_GE_OQ), one); break;
+		}
+		_mm256_storeu_pd(r + i, z);
+	}
+	return i;
+}
 
-	lenv_add_builtin(e, "load", builtin_load);
-	lenv_add_builtin(e, "print", builtin_print);
-	lenv_add_builtin(e, "error", builtin_error);
+LVEC_AVX2 static long lvec_binop_i64_avx2(int op, int64_t *r, const int64_t *a,
+					  const int64_t *b, int bscalar, long n) {
+	__m256i bs = _mm256_set1_epi64x(b[0]);
+	__m256i one = _mm256_set1_epi64x(1);
+	long i = 0;
+	if (op == LVEC_MUL || op == LVEC_DIV) { return 0; }
+	for (; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i y = bscalar ? bs : _mm256_loadu_si256((const __m256i *)(b + i));
+		__m256i z;
+		switch (op) {
+		case LVEC_ADD: z = _mm256_add_epi64(x, y); break;
+		case LVEC_SUB: z = _mm256_sub_epi64(x, y); break;
+		case LVEC_EQ: z = _mm256_cmpeq_epi64(x, y); break;
+		case LVEC_LT: z = _mm256_cmpgt_epi64(y, x); break;
+		case LVEC_GT: z = _mm256_cmpgt_epi64(x, y); break;
+		case LVEC_LE: z = _mm256_xor_si256(_mm256_cmpgt_epi64(x, y),
+						   _mm256_set1_epi64x(-1)); break;
+		default:      z = _mm256_xor_si256(_mm256_cmpgt_epi64(y, x),
+						   _mm256_set1_epi64x(-1)); break;
+		}
+		if (op >= LVEC_EQ) { z = _mm256_and_si256(z, one); }
+		_mm256_storeu_si256((__m256i *)(r + i), z);
+	}
+	return i;
+}
+#endif
+
+static double lvec_sum_f64(const double *a, long n) {
+#ifdef LVEC_X86
+	if (lvec_avx2) { return lvec_sum_f64_avx2(a, n); }
+	__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+	long i = 0;
+	for (; i + 4 <= n; i += 4) {
+		s0 = _mm_add_pd(s0, _mm_loadu_pd(a + i));
+		s1 = _mm_add_pd(s1, _mm_loadu_pd(a + i + 2));
+	}
+	double t[2];
+	_mm_storeu_pd(t, _mm_add_pd(s0, s1));
+	double s = t[0] + t[1];
+#else
+	double s = 0.0;
+	long i = 0;
+#endif
+	for (; i < n; i++) { s += a[i]; }
+	return s;
+}
 
-	lenv_add_builtin_bool(e, "t", 1);
-	lenv_add_builtin_bool(e, "false", 0);
+/* Sum of a[0..n) into r, returns 0 if a partial sum overflowed */
+static int lvec_sum_i64(const int64_t *a, long n, int64_t *r) {
+	long i = 0;
+	int overflow = 0;
+	*r = 0;
+#ifdef LVEC_X86
+	if (lvec_avx2) { return lvec_sum_i64_avx2(a, n, r); }
+	__m128i s = _mm_setzero_si128();
+	__m128i o = _mm_setzero_si128();
+	for (; i + 2 <= n; i += 2) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i t = _mm_add_epi64(s, x);
+		o = _mm_or_si128(o, _mm_and_si128(_mm_xor_si128(t, s), _mm_xor_si128(t, x)));
+		s = t;
+	}
+	if (_mm_movemask_pd(_mm_castsi128_pd(o))) { return 0; }
+	int64_t t[2];
+	_mm_storeu_si128((__m128i *)t, s);
+	overflow = __builtin_add_overflow(t[0], t[1], r);
+#endif
+	for (; i < n; i++) { overflow |= __builtin_add_overflow(*r, a[i], r); }
+	return !overflow;
 }
 
+/* Add a[0..n) to the sum lo + carry * 2^64, lo wraps around */
+static void lvec_sum_i64_carry(const int64_t *a, long n, int64_t *lo, long *carry) {
+	for (long i = 0; i < n; i++) {
+		if (__builtin_add_overflow(*lo, a[i], lo)) { *carry += a[i] < 0 ? -1 : 1; }
+	}
+}
 
-int main(int argc, char** argv) {
+static double lvec_dot_f64(const double *a, const double *b, long n) {
+	long i = 0;
+	double r = 0.0;
+#ifdef LVEC_X86
+	if (lvec_avx2) { return lvec_dot_f64_avx2(a, b, n); }
+	__m128d s = _mm_setzero_pd();
+	for (; i + 2 <= n; i += 2) {
+		s = _mm_add_pd(s, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+	}
+	double t[2];
+	_mm_storeu_pd(t, s);
+	r = t[0] + t[1];
+#endif
+	for (; i < n; i++) { r += a[i] * b[i]; }
+	return r;
+}
 
-	/* Create some parsers */
-	Number   = mpc_new("number");
-	Symbol   = mpc_new("symbol");
-	String   = mpc_new("string");
-	Comment  = mpc_new("comment");
-	Sexpr    = mpc_new("sexpr");
-	Qexpr    = mpc_new("qexpr");
-	Expr     = mpc_new("expr");
-	Lispy    = mpc_new("lispy");
+/* Dot product into r, returns 0 if it overflowed */
+static int lvec_dot_i64(const int64_t *a, const int64_t *b, long n, int64_t *r) {
+	int overflow = 0;
+	int64_t p;
+	*r = 0;
+	for (long i = 0; i < n; i++) {
+		overflow |= __builtin_mul_overflow(a[i], b[i], &p);
+		overflow |= __builtin_add_overflow(*r, p, r);
+	}
+	return !overflow;
+}
 
-	/* Define them with the following language */
+static double lvec_minmax_f64(const double *a, long n, int max) {
+	long i = 0;
+	double r = a[0];
+#ifdef LVEC_X86
+	if (lvec_avx2) { return lvec_minmax_f64_avx2(a, n, max); }
+	__m128d m = _mm_set1_pd(a[0]);
+	for (; i + 2 <= n; i += 2) {
+		__m128d x = _mm_loadu_pd(a + i);
+		m = max ? _mm_max_pd(m, x) : _mm_min_pd(m, x);
+	}
+	double t[2];
+	_mm_storeu_pd(t, m);
+	r = max ? (t[0] > t[1] ? t[0] : t[1]) : (t[0] < t[1] ? t[0] : t[1]);
+#endif
+	for (; i < n; i++) {
+		r = max ? (a[i] > r ? a[i] : r) : (a[i] < r ? a[i] : r);
+	}
+	return r;
+}
+
+static int64_t lvec_minmax_i64(const int64_t *a, long n, int max) {
+#ifdef LVEC_X86
+	if (lvec_avx2) { return lvec_minmax_i64_avx2(a, n, max); }
+#endif
+	int64_t r = a[0];
+	for (long i = 1; i < n; i++) {
+		r = max ? (a[i] > r ? a[i] : r) : (a[i] < r ? a[i] : r);
+	}
+	return r;
+}
+
+static void lvec_binop_f64(int op, double *r, const double *a,
+			   const double *b, int bscalar, long n) {
+	long i = 0;
+#ifdef LVEC_X86
+	if (lvec_avx2) { i = lvec_binop_f64_avx2(op, r, a, b, bscalar, n); }
+#endif
+	int64_t *m = (int64_t *)r;
+	for (; i < n; i++) {
+		double x = a[i], y = bscalar ? b[0] : b[i];
+		switch (op) {
+		case LVEC_ADD: r[i] = x + y; break;
+		case LVEC_SUB: r[i] = x - y; break;
+		case LVEC_MUL: r[i] = x * y; break;
+		case LVEC_DIV: r[i] = x / y; break;
+		case LVEC_EQ: m[i] = x == y; break;
+		case LVEC_LT: m[i] = x < y; break;
+		case LVEC_GT: m[i] = x > y; break;
+		case LVEC_LE: m[i] = x <= y; break;
+		case LVEC_GE: m[i] = x >= y; break;
+		}
+	}
+}
+
+/* returns 0 on division by zero */
+static int lvec_binop_i64(int op, int64_t *r, const int64_t *a,
+			  const int64_t *b, int bscalar, long n) {
+	long i = 0;
+#ifdef LVEC_X86
+	if (lvec_avx2) { i = lvec_binop_i64_avx2(op, r, a, b, bscalar, n); }
+#endif
+	for (; i < n; i++) {
+		int64_t x = a[i], y = bscalar ? b[0] : b[i];
+		switch (op) {
+		case LVEC_ADD: r[i] = (int64_t)((uint64_t)x + (uint64_t)y); break;
+		case LVEC_SUB: r[i] = (int64_t)((uint64_t)x - (uint64_t)y); break;
+		case LVEC_MUL: r[i] = (int64_t)((uint64_t)x * (uint64_t)y); break;
+		case LVEC_DIV:
+			if (y == 0) { return 0; }
+			r[i] = (x == INT64_MIN && y == -1) ? x : x / y;
+			break;
+		case LVEC_EQ: r[i] = x == y; break;
+		case LVEC_LT: r[i] = x < y; break;
+		case LVEC_GT: r[i] = x > y; break;
+		case LVEC_LE: r[i] = x <= y; break;
+		case LVEC_GE: r[i] = x >= y; break;
+		}
+	}
+	return 1;
+}
+
+
+static lbuf * lbuf_new(size_t size) {
+	lbuf *b = malloc(sizeof(lbuf));
+	b->refs = 1;
+	b->kind = LBUF_HEAP;
+	b->size = size;
+	b->data = malloc(size ? size : 1);
+	return b;
+}
+
+/* Map a whole file. Returns NULL and sets errno on failure. */
+static lbuf * lbuf_map(const char *path, int cow) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) { return NULL; }
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	/* empty files cannot be mapped */
+	if (st.st_size == 0) {
+		close(fd);
+		return lbuf_new(0);
+	}
+
+	void *p = mmap(NULL, st.st_size, cow ? PROT_READ | PROT_WRITE : PROT_READ,
+		       cow ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) { return NULL; }
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+	lbuf *b = malloc(sizeof(lbuf));
+	b->refs = 1;
+	b->kind = cow ? LBUF_MAP_COW : LBUF_MAP_RO;
+	b->size = st.st_size;
+	b->data = p;
+	return b;
+}
+
+static void lbuf_release(lbuf *b) {
+	if (--b->refs > 0) { return; }
+	if (b->kind == LBUF_HEAP) {
+		free(b->data);
+	} else {
+		munmap(b->data, b->size);
+	}
+	free(b);
+}
+
+/* Streaming hints for mapped buffers: pages of the range that was just
+ * consumed are dropped, the next range is requested ahead of time.
+ * Only read only mappings are dropped, a private copy would lose its
+ * changes. */
+static void lbuf_stream(lbuf *b, const void *done_from, const void *done_to,
+			const void *next_to) {
+	if (b->kind == LBUF_HEAP) { return; }
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t lo = ((uintptr_t)done_from + page - 1) & ~(page - 1);
+	uintptr_t hi = (uintptr_t)done_to & ~(page - 1);
+	if (b->kind == LBUF_MAP_RO && hi > lo) {
+		madvise((void *)lo, hi - lo, MADV_DONTNEED);
+	}
+	if ((uintptr_t)next_to > hi) {
+		madvise((void *)hi, (uintptr_t)next_to - hi, MADV_WILLNEED);
+	}
+}
+
+static lval * lval_vec(lvec_type t, long n) {
+	lval *v = malloc(sizeof(lval));
+	v->type = LVAL_VEC;
+	v->vtype = t;
+	v->vlen = n;
+	v->vbuf = lbuf_new(8 * n);
+	v->vdata = v->vbuf->data;
+	return v;
+}
+
+/* Convert an int vector to a float vector, the storage may be shared
+ * so the result always gets a new buffer */
+static void lvec_to_float(lval *v) {
+	if (v->vtype == LVEC_FLOAT) { return; }
+	lbuf *b = lbuf_new(8 * v->vlen);
+	int64_t *x = v->vdata;
+	double *d = (double *)b->data;
+	for (long i = 0; i < v->vlen; i++) { d[i] = (double)x[i]; }
+	lbuf_release(v->vbuf);
+	v->vbuf = b;
+	v->vdata = b->data;
+	v->vtype = LVEC_FLOAT;
+}
+
+static lval * builtin_vec(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "vec");
+	LASSERT_QEXPR_AT(a, 0, "vec");
+
+	lval *q = a->cell[0];
+	int fl = 0;
+	for (int i = 0; i < q->count; i++) {
+		LASSERT(a, q->cell[i]->type == LVAL_NUM || q->cell[i]->type == LVAL_FLOAT,
+			"Function 'vec' passed {} with incorrect element %i! "
+			"Got %s, expected %s", i + 1,
+			ltype_name(q->cell[i]->type), ltype_name(LVAL_NUM));
+		if (q->cell[i]->type == LVAL_FLOAT) { fl = 1; }
+	}
+
+	lval *v = lval_vec(fl ? LVEC_FLOAT : LVEC_INT, q->count);
+	for (int i = 0; i < q->count; i++) {
+		if (fl) {
+			((double *)v->vdata)[i] = lval_to_double(q->cell[i]);
+		} else {
+			((int64_t *)v->vdata)[i] = q->cell[i]->num;
+		}
+	}
+
+	lval_del(a);
+	return v;
+}
+
+static lval * lvec_ref(lval *v, long i) {
+	if (v->vtype == LVEC_FLOAT) {
+		return lval_float(((double *)v->vdata)[i]);
+	}
+	return lval_num(((int64_t *)v->vdata)[i]);
+}
+
+static lval * builtin_vec_list(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "vec->list");
+	LASSERT_VEC_AT(a, 0, "vec->list");
+
+	lval *v = a->cell[0];
+	lval *q = lval_qexpr();
+	q->count = v->vlen;
+	q->cell = malloc(sizeof(lval *) * v->vlen);
+	for (long i = 0; i < v->vlen; i++) {
+		q->cell[i] = lvec_ref(v, i);
+	}
+
+	lval_del(a);
+	return q;
+}
+
+/* Reductions walk vectors in chunks of this many elements so that
+ * mapped files are streamed through memory instead of being resident
+ * as a whole. */
+#define LVEC_CHUNK (1L << 19)
+
+/* Prepare the chunk starting at element i, returns its length. The
+ * previous chunk is released and the one after this is prefetched. */
+static long lvec_stream(lval *v, long i) {
+	long n = v->vlen - i < LVEC_CHUNK ? v->vlen - i : LVEC_CHUNK;
+	long ahead = v->vlen - i - n < LVEC_CHUNK ? v->vlen - i - n : LVEC_CHUNK;
+	int64_t *p = v->vdata;
+	if (i == 0) {
+		lbuf_stream(v->vbuf, p, p, p + n + ahead);
+	} else {
+		lbuf_stream(v->vbuf, p + i - LVEC_CHUNK, p + i, p + i + n + ahead);
+	}
+	return n;
+}
+
+static lval * builtin_vlen(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "vlen");
+	LASSERT_VEC_AT(a, 0, "vlen");
+
+	lval *x = lval_num(a->cell[0]->vlen);
+	lval_del(a);
+	return x;
+}
+
+static lval * builtin_vref(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "vref");
+	LASSERT_VEC_AT(a, 0, "vref");
+	LASSERT_NUM_AT(a, 1, "vref");
+
+	long i = a->cell[1]->num;
+	LASSERT(a, i >= 0 && i < a->cell[0]->vlen,
+		"Function 'vref' passed index out of range! "
+		"Got %li, expected 0 to %li", i, a->cell[0]->vlen - 1);
+
+	lval *x = lvec_ref(a->cell[0], i);
+	lval_del(a);
+	return x;
+}
+
+/* (vslice v start end) is a view of elements start..end-1 sharing the
+ * storage of v */
+static lval * builtin_vslice(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 3, "vslice");
+	LASSERT_VEC_AT(a, 0, "vslice");
+	LASSERT_NUM_AT(a, 1, "vslice");
+	LASSERT_NUM_AT(a, 2, "vslice");
+
+	lval *v = a->cell[0];
+	long from = a->cell[1]->num;
+	long to = a->cell[2]->num;
+	LASSERT(a, 0 <= from && from <= to && to <= v->vlen,
+		"Function 'vslice' passed invalid range! "
+		"Got %li to %li, expected 0 to %li", from, to, v->vlen);
+
+	v = lval_pop(a, 0);
+	v->vdata = (int64_t *)v->vdata + from;
+	v->vlen = to - from;
+	lval_del(a);
+	return v;
+}
+
+/* (vset v i x) writes into the storage if nobody else shares it,
+ * otherwise into a fresh copy */
+static lval * builtin_vset(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 3, "vset");
+	LASSERT_VEC_AT(a, 0, "vset");
+	LASSERT_NUM_AT(a, 1, "vset");
+	LASSERT(a, a->cell[2]->type == LVAL_NUM || a->cell[2]->type == LVAL_FLOAT,
+		"Function 'vset' passed incorrect type for argument 3! "
+		"Got %s, expected %s",
+		ltype_name(a->cell[2]->type), ltype_name(LVAL_NUM));
+
+	long i = a->cell[1]->num;
+	LASSERT(a, i >= 0 && i < a->cell[0]->vlen,
+		"Function 'vset' passed index out of range! "
+		"Got %li, expected 0 to %li", i, a->cell[0]->vlen - 1);
+
+	lval *v = lval_pop(a, 0);
+	lval *x = a->cell[1];
+	if (x->type == LVAL_FLOAT && v->vtype == LVEC_INT) {
+		lvec_to_float(v);
+	}
+
+	if (v->vbuf->refs > 1 || v->vbuf->kind == LBUF_MAP_RO) {
+		lbuf *b = lbuf_new(8 * v->vlen);
+		memcpy(b->data, v->vdata, 8 * v->vlen);
+		lbuf_release(v->vbuf);
+		v->vbuf = b;
+		v->vdata = b->data;
+	}
+
+	if (v->vtype == LVEC_FLOAT) {
+		((double *)v->vdata)[i] = lval_to_double(x);
+	} else {
+		((int64_t *)v->vdata)[i] = x->num;
+	}
+
+	lval_del(a);
+	return v;
+}
+
+/* (mmap-open "file" "i64"|"f64" ["cow"]) maps a file of native endian
+ * 64 bit numbers as a vector. Without "cow" the mapping is read only,
+ * with it changes stay private to the process. */
+static lval * builtin_mmap_open(lenv *e, lval *a) {
+	LASSERT(a, a->count == 2 || a->count == 3,
+		"Function 'mmap-open' passed incorrect number of arguments! "
+		"Got %i, expected 2 or 3", a->count);
+	LASSERT_STR_AT(a, 0, "mmap-open");
+	LASSERT_STR_AT(a, 1, "mmap-open");
+	if (a->count == 3) {
+		LASSERT_STR_AT(a, 2, "mmap-open");
+		LASSERT(a, strcmp(lval_cstr(a->cell[2]), "cow") == 0,
+			"Function 'mmap-open' passed unknown mode '%s'!",
+			lval_cstr(a->cell[2]));
+	}
+
+	char *path = lval_cstr(a->cell[0]);
+	char *t = lval_cstr(a->cell[1]);
+	LASSERT(a, strcmp(t, "i64") == 0 || strcmp(t, "f64") == 0,
+		"Function 'mmap-open' passed unknown element type '%s'! "
+		"Expected i64 or f64", t);
+
+	lbuf *b = lbuf_map(path, a->count == 3);
+	LASSERT(a, b != NULL, "Could not map '%s': %s", path, strerror(errno));
+	if (b->size % 8 != 0) {
+		lval *err = lval_err("File '%s' is not a multiple of 8 bytes!",
+				     path);
+		lbuf_release(b);
+		lval_del(a);
+		return err;
+	}
+
+	lval *v = malloc(sizeof(lval));
+	v->type = LVAL_VEC;
+	v->vtype = strcmp(t, "f64") == 0 ? LVEC_FLOAT : LVEC_INT;
+	v->vlen = b->size / 8;
+	v->vbuf = b;
+	v->vdata = b->data;
+
+	lval_del(a);
+	return v;
+}
+
+static lval * builtin_vsum(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "vsum");
+	LASSERT_VEC_AT(a, 0, "vsum");
+
+	lval *v = a->cell[0];
+	double fs = 0.0;
+	int64_t is = 0, s;
+	long carry = 0;
+	for (long i = 0; i < v->vlen; i += LVEC_CHUNK) {
+		long n = lvec_stream(v, i);
+		if (v->vtype == LVEC_FLOAT) {
+			fs += lvec_sum_f64((double *)v->vdata + i, n);
+		} else if (!lvec_sum_i64((int64_t *)v->vdata + i, n, &s)) {
+			/* redo the chunk one element at a time */
+			lvec_sum_i64_carry((int64_t *)v->vdata + i, n, &is, &carry);
+		} else if (__builtin_add_overflow(is, s, &is)) {
+			carry += s < 0 ? -1 : 1;
+		}
+	}
+	int flt = v->vtype == LVEC_FLOAT;
+	lval_del(a);
+
+	if (flt) { return lval_float(fs); }
+	if (carry == 0) { return lval_num(is); }
+
+	/* the sum does not fit, carry * 2^64 + is as a bignum */
+	lval *x = lval_arith(lval_num(carry), lval_num(1L << 32), "*");
+	x = lval_arith(x, lval_num(1L << 32), "*");
+	return lval_arith(x, lval_num(is), "+");
+}
+
+static lval * builtin_vminmax(lenv *e, lval *a, char *fn) {
+	LASSERT_COUNT(a, 1, fn);
+	LASSERT_VEC_AT(a, 0, fn);
+	LASSERT(a, a->cell[0]->vlen > 0, "Function '%s' passed empty vector!", fn);
+
+	lval *v = a->cell[0];
+	int max = strcmp(fn, "vmax") == 0;
+	double fr = 0.0;
+	int64_t ir = 0;
+	for (long i = 0; i < v->vlen; i += LVEC_CHUNK) {
+		long n = lvec_stream(v, i);
+		if (v->vtype == LVEC_FLOAT) {
+			double c = lvec_minmax_f64((double *)v->vdata + i, n, max);
+			if (i == 0 || (max ? c > fr : c < fr)) { fr = c; }
+		} else {
+			int64_t c = lvec_minmax_i64((int64_t *)v->vdata + i, n, max);
+			if (i == 0 || (max ? c > ir : c < ir)) { ir = c; }
+		}
+	}
+
+	lval *x = v->vtype == LVEC_FLOAT ? lval_float(fr) : lval_num(ir);
+	lval_del(a);
+	return x;
+}
+
+static lval * builtin_vmin(lenv *e, lval *a) {
+	return builtin_vminmax(e, a, "vmin");
+}
+
+static lval * builtin_vmax(lenv *e, lval *a) {
+	return builtin_vminmax(e, a, "vmax");
+}
+
+static lval * builtin_vdot(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "vdot");
+	LASSERT_VEC_AT(a, 0, "vdot");
+	LASSERT_VEC_AT(a, 1, "vdot");
+
+	lval *x = a->cell[0];
+	lval *y = a->cell[1];
+	LASSERT(a, x->vlen == y->vlen,
+		"Function 'vdot' passed vectors of different length! "
+		"Got %li and %li", x->vlen, y->vlen);
+
+	if (x->vtype != y->vtype) {
+		lvec_to_float(x);
+		lvec_to_float(y);
+	}
+
+	double fr = 0.0;
+	int64_t ir = 0, s;
+	int overflow = 0;
+	for (long i = 0; i < x->vlen && !overflow; i += LVEC_CHUNK) {
+		long n = lvec_stream(x, i);
+		lvec_stream(y, i);
+		if (x->vtype == LVEC_FLOAT) {
+			fr += lvec_dot_f64((double *)x->vdata + i, (double *)y->vdata + i, n);
+		} else {
+			overflow = !lvec_dot_i64((int64_t *)x->vdata + i,
+						 (int64_t *)y->vdata + i, n, &s)
+				|| __builtin_add_overflow(ir, s, &ir);
+		}
+	}
+
+	lval *r;
+	if (x->vtype == LVEC_FLOAT) {
+		r = lval_float(fr);
+	} else if (!overflow) {
+		r = lval_num(ir);
+	} else {
+		/* start over with the bignum arithmetic of the operators */
+		int64_t *xs = x->vdata, *ys = y->vdata;
+		r = lval_num(0);
+		for (long i = 0; i < x->vlen; i++) {
+			r = lval_arith(r, lval_arith(lval_num(xs[i]), lval_num(ys[i]), "*"), "+");
+		}
+	}
+	lval_del(a);
+	return r;
+}
+
+/* Elementwise operation of a vector with a vector of the same length or
+ * with a scalar. Mixed int/float operands are computed as floats,
+ * comparisons yield int vectors of 0 and 1. */
+static lval * builtin_vop(lenv *e, lval *a, char *fn, int op) {
+	LASSERT_COUNT(a, 2, fn);
+	LASSERT_VEC_AT(a, 0, fn);
+	LASSERT(a, a->cell[1]->type == LVAL_VEC || a->cell[1]->type == LVAL_NUM
+		|| a->cell[1]->type == LVAL_FLOAT,
+		"Function '%s' passed incorrect type for argument 2! "
+		"Got %s, expected %s", fn,
+		ltype_name(a->cell[1]->type), ltype_name(LVAL_VEC));
+
+	lval *x = a->cell[0];
+	lval *y = a->cell[1];
+
+	/* turn a scalar into a one element vector */
+	if (y->type != LVAL_VEC) {
+		lval *s = lval_vec(y->type == LVAL_FLOAT ? LVEC_FLOAT : LVEC_INT, 1);
+		if (y->type == LVAL_FLOAT) {
+			((double *)s->vdata)[0] = y->fnum;
+		} else {
+			((int64_t *)s->vdata)[0] = y->num;
+		}
+		lval_del(y);
+		a->cell[1] = y = s;
+	} else {
+		LASSERT(a, x->vlen == y->vlen,
+			"Function '%s' passed vectors of different length! "
+			"Got %li and %li", fn, x->vlen, y->vlen);
+	}
+	int bscalar = y->vlen == 1 && x->vlen != 1;
+
+	lval *r;
+	if (x->vtype == LVEC_INT && y->vtype == LVEC_INT) {
+		r = lval_vec(LVEC_INT, x->vlen);
+		if (!lvec_binop_i64(op, r->vdata, x->vdata, y->vdata, bscalar, x->vlen)) {
+			lval_del(r);
+			r = lval_err("Division by zero!");
+		}
+	} else {
+		lvec_to_float(x);
+		lvec_to_float(y);
+		r = lval_vec(op >= LVEC_EQ ? LVEC_INT : LVEC_FLOAT, x->vlen);
+		lvec_binop_f64(op, r->vdata, x->vdata, y->vdata, bscalar, x->vlen);
+	}
+
+	lval_del(a);
+	return r;
+}
+
+static lval * builtin_vadd(lenv *e, lval *a) {
+	return builtin_vop(e, a, "v+", LVEC_ADD);
+}
+
+static lval * builtin_vsub(lenv *e, lval *a) {
+	return builtin_vop(e, a, "v-", LVEC_SUB);
+}
+
+static lval * builtin_vmul(lenv *e, lval *a) {
+	return builtin_vop(e, a, "v*", LVEC_MUL);
+}
+
+static lval * builtin_vdiv(lenv *e, lval *a) {
+	return builtin_vop(e, a, "v/", LVEC_DIV);
+}
+
+static lval * builtin_veq(lenv *e, lval *a) {
+	return builtin_vop(e, a, "v==", LVEC_EQ);
+}
+
+static lval * builtin_vlt(lenv *e, lval *a) {
+	return builtin_vop(e, a, "v<", LVEC_LT);
+}
+
+static lval * builtin_vgt(lenv *e, lval *a) {
+	return builtin_vop(e, a, "v>", LVEC_GT);
+}
+
+static lval * builtin_vle(lenv *e, lval *a) {
+	return builtin_vop(e, a, "v<=", LVEC_LE);
+}
+
+static lval * builtin_vge(lenv *e, lval *a) {
+	return builtin_vop(e, a, "v>=", LVEC_GE);
+}
+
+
+/* Matrices
+ *
+ * A matrix is a row major block of doubles. It shares the reference
+ * counted storage of vectors: vdata holds mrows * mcols elements and
+ * vlen is their count, so elementwise operations reuse the vector
+ * kernels. */
+
+#define LMAT_BLOCK_I 64
+#define LMAT_BLOCK_K 128
+#define LMAT_BLOCK_J 256
+
+#ifdef LVEC_X86
+LVEC_AVX2 static void lvec_axpy_f64_avx2(double *c, double x, const double *b, long n) {
+	__m256d xs = _mm256_set1_pd(x);
+	long i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256d c0 = _mm256_loadu_pd(c + i);
+		__m256d c1 = _mm256_loadu_pd(c + i + 4);
+		c0 = _mm256_add_pd(c0, _mm256_mul_pd(xs, _mm256_loadu_pd(b + i)));
+		c1 = _mm256_add_pd(c1, _mm256_mul_pd(xs, _mm256_loadu_pd(b + i + 4)));
+		_mm256_storeu_pd(c + i, c0);
+		_mm256_storeu_pd(c + i + 4, c1);
+	}
+	for (; i < n; i++) { c[i] += x * b[i]; }
+}
+#endif
+
+/* c += x * b */
+static void lvec_axpy_f64(double *c, double x, const double *b, long n) {
+	long i = 0;
+#ifdef LVEC_X86
+	if (lvec_avx2) {
+		lvec_axpy_f64_avx2(c, x, b, n);
+		return;
+	}
+	__m128d xs = _mm_set1_pd(x);
+	for (; i + 2 <= n; i += 2) {
+		__m128d cv = _mm_loadu_pd(c + i);
+		cv = _mm_add_pd(cv, _mm_mul_pd(xs, _mm_loadu_pd(b + i)));
+		_mm_storeu_pd(c + i, cv);
+	}
+#endif
+	for (; i < n; i++) { c[i] += x * b[i]; }
+}
+
+/* c (m x n) = a (m x k) * b (k x n). The loops are tiled so that a
+ * block of b stays in cache while it is applied to a block of rows. */
+static void lmat_mul(double *c, const double *a, const double *b,
+		     long m, long k, long n) {
+	memset(c, 0, sizeof(double) * m * n);
+	for (long jj = 0; jj < n; jj += LMAT_BLOCK_J) {
+		long nj = n - jj < LMAT_BLOCK_J ? n - jj : LMAT_BLOCK_J;
+		for (long kk = 0; kk < k; kk += LMAT_BLOCK_K) {
+			long nk = k - kk < LMAT_BLOCK_K ? k - kk : LMAT_BLOCK_K;
+			for (long ii = 0; ii < m; ii += LMAT_BLOCK_I) {
+				long ni = m - ii < LMAT_BLOCK_I ? m - ii : LMAT_BLOCK_I;
+				for (long i = ii; i < ii + ni; i++) {
+					for (long p = kk; p < kk + nk; p++) {
+						lvec_axpy_f64(c + i * n + jj, a[i * k + p],
+							      b + p * n + jj, nj);
+					}
+				}
+			}
+		}
+	}
+}
+
+static lval * lval_mat(long rows, long cols) {
+	lval *v = lval_vec(LVEC_FLOAT, rows * cols);
+	v->type = LVAL_MAT;
+	v->mrows = rows;
+	v->mcols = cols;
+	return v;
+}
+
+static double * lmat_data(lval *m) {
+	return m->vdata;
+}
+
+/* (mat {{1 2} {3 4}}) builds a matrix from a list of rows */
+static lval * builtin_mat(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "mat");
+	LASSERT_QEXPR_AT(a, 0, "mat");
+
+	lval *q = a->cell[0];
+	LASSERT(a, q->count > 0, "Function 'mat' passed {}!");
+	for (int i = 0; i < q->count; i++) {
+		LASSERT(a, q->cell[i]->type == LVAL_QEXPR,
+			"Function 'mat' passed incorrect row %i! Got %s, expected %s",
+			i + 1, ltype_name(q->cell[i]->type), ltype_name(LVAL_QEXPR));
+		LASSERT(a, q->cell[i]->count == q->cell[0]->count,
+			"Function 'mat' passed rows of different length! "
+			"Got %i and %i", q->cell[0]->count, q->cell[i]->count);
+		for (int j = 0; j < q->cell[i]->count; j++) {
+			lval *x = q->cell[i]->cell[j];
+			LASSERT(a, x->type == LVAL_NUM || x->type == LVAL_FLOAT,
+				"Function 'mat' passed incorrect element! "
+				"Got %s, expected %s",
+				ltype_name(x->type), ltype_name(LVAL_NUM));
+		}
+	}
+
+	long rows = q->count, cols = q->cell[0]->count;
+	lval *m = lval_mat(rows, cols);
+	double *d = lmat_data(m);
+	for (long i = 0; i < rows; i++) {
+		for (long j = 0; j < cols; j++) {
+			d[i * cols + j] = lval_to_double(q->cell[i]->cell[j]);
+		}
+	}
+
+	lval_del(a);
+	return m;
+}
+
+static lval * builtin_mat_fill(lenv *e, lval *a, char *fn) {
+	LASSERT_COUNT(a, 2, fn);
+	LASSERT_NUM_AT(a, 0, fn);
+	LASSERT_NUM_AT(a, 1, fn);
+	LASSERT(a, a->cell[0]->num > 0 && a->cell[1]->num > 0,
+		"Function '%s' passed invalid dimensions! Got %li x %li",
+		fn, a->cell[0]->num, a->cell[1]->num);
+
+	long rows = a->cell[0]->num, cols = a->cell[1]->num;
+	lval *m = lval_mat(rows, cols);
+	double *d = lmat_data(m);
+	memset(d, 0, sizeof(double) * rows * cols);
+	if (strcmp(fn, "mat-ident") == 0) {
+		for (long i = 0; i < rows && i < cols; i++) {
+			d[i * cols + i] = 1.0;
+		}
+	}
+
+	lval_del(a);
+	return m;
+}
+
+static lval * builtin_mat_zeros(lenv *e, lval *a) {
+	return builtin_mat_fill(e, a, "mat-zeros");
+}
+
+static lval * builtin_mat_ident(lenv *e, lval *a) {
+	return builtin_mat_fill(e, a, "mat-ident");
+}
+
+static lval * builtin_mat_list(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "mat->list");
+	LASSERT_MAT_AT(a, 0, "mat->list");
+
+	lval *m = a->cell[0];
+	double *d = lmat_data(m);
+	lval *q = lval_qexpr();
+	for (long i = 0; i < m->mrows; i++) {
+		lval *row = lval_qexpr();
+		for (long j = 0; j < m->mcols; j++) {
+			lval_add(row, lval_float(d[i * m->mcols + j]));
+		}
+		lval_add(q, row);
+	}
+
+	lval_del(a);
+	return q;
+}
+
+static lval * builtin_mat_dims(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "mat-dims");
+	LASSERT_MAT_AT(a, 0, "mat-dims");
+
+	lval *q = lval_qexpr();
+	lval_add(q, lval_num(a->cell[0]->mrows));
+	lval_add(q, lval_num(a->cell[0]->mcols));
+	lval_del(a);
+	return q;
+}
+
+static lval * builtin_mat_ref(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 3, "mat-ref");
+	LASSERT_MAT_AT(a, 0, "mat-ref");
+	LASSERT_NUM_AT(a, 1, "mat-ref");
+	LASSERT_NUM_AT(a, 2, "mat-ref");
+
+	lval *m = a->cell[0];
+	long i = a->cell[1]->num, j = a->cell[2]->num;
+	LASSERT(a, i >= 0 && i < m->mrows && j >= 0 && j < m->mcols,
+		"Function 'mat-ref' passed index out of range! "
+		"Got (%li %li), matrix is %li x %li", i, j, m->mrows, m->mcols);
+
+	lval *x = lval_float(lmat_data(m)[i * m->mcols + j]);
+	lval_del(a);
+	return x;
+}
+
+/* transpose in square tiles so that reads and writes both stay within
+ * a few cache lines */
+static lval * builtin_transpose(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "transpose");
+	LASSERT_MAT_AT(a, 0, "transpose");
+
+	lval *m = a->cell[0];
+	long rows = m->mrows, cols = m->mcols;
+	lval *t = lval_mat(cols, rows);
+	double *s = lmat_data(m), *d = lmat_data(t);
+	for (long ii = 0; ii < rows; ii += 32) {
+		for (long jj = 0; jj < cols; jj += 32) {
+			for (long i = ii; i < ii + 32 && i < rows; i++) {
+				for (long j = jj; j < jj + 32 && j < cols; j++) {
+					d[j * rows + i] = s[i * cols + j];
+				}
+			}
+		}
+	}
+
+	lval_del(a);
+	return t;
+}
+
+/* Elementwise operation with a matrix of the same shape or a scalar */
+static lval * builtin_mat_op(lenv *e, lval *a, char *fn, int op) {
+	LASSERT_COUNT(a, 2, fn);
+	LASSERT_MAT_AT(a, 0, fn);
+	LASSERT(a, a->cell[1]->type == LVAL_MAT || a->cell[1]->type == LVAL_NUM
+		|| a->cell[1]->type == LVAL_FLOAT,
+		"Function '%s' passed incorrect type for argument 2! "
+		"Got %s, expected %s", fn,
+		ltype_name(a->cell[1]->type), ltype_name(LVAL_MAT));
+
+	lval *x = a->cell[0];
+	lval *y = a->cell[1];
+	double s;
+	const double *b = &s;
+	int bscalar = 1;
+	if (y->type == LVAL_MAT) {
+		LASSERT(a, x->mrows == y->mrows && x->mcols == y->mcols,
+			"Function '%s' passed matrices of different shape! "
+			"Got %li x %li and %li x %li", fn,
+			x->mrows, x->mcols, y->mrows, y->mcols);
+		b = lmat_data(y);
+		bscalar = 0;
+	} else {
+		s = lval_to_double(y);
+	}
+
+	lval *r = lval_mat(x->mrows, x->mcols);
+	lvec_binop_f64(op, lmat_data(r), lmat_data(x), b, bscalar, x->vlen);
+
+	lval_del(a);
+	return r;
+}
+
+static lval * builtin_mat_add(lenv *e, lval *a) {
+	return builtin_mat_op(e, a, "mat+", LVEC_ADD);
+}
+
+static lval * builtin_mat_sub(lenv *e, lval *a) {
+	return builtin_mat_op(e, a, "mat-", LVEC_SUB);
+}
+
+static lval * builtin_mat_mul(lenv *e, lval *a) {
+	return builtin_mat_op(e, a, "mat*", LVEC_MUL);
+}
+
+static lval * builtin_mat_div(lenv *e, lval *a) {
+	return builtin_mat_op(e, a, "mat/", LVEC_DIV);
+}
+
+static lval * builtin_matmul(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "matmul");
+	LASSERT_MAT_AT(a, 0, "matmul");
+	LASSERT_MAT_AT(a, 1, "matmul");
+
+	lval *x = a->cell[0];
+	lval *y = a->cell[1];
+	LASSERT(a, x->mcols == y->mrows,
+		"Function 'matmul' passed incompatible matrices! "
+		"Got %li x %li and %li x %li",
+		x->mrows, x->mcols, y->mrows, y->mcols);
+
+	lval *r = lval_mat(x->mrows, y->mcols);
+	lmat_mul(lmat_data(r), lmat_data(x), lmat_data(y),
+		 x->mrows, x->mcols, y->mcols);
+
+	lval_del(a);
+	return r;
+}
+
+/* (time {expr}) evaluates expr and returns the processor time it took
+ * in seconds, for benchmarks */
+static lval * builtin_time(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "time");
+	LASSERT_QEXPR_AT(a, 0, "time");
+
+	clock_t start = clock();
+	lval *x = builtin_eval(e, a);
+	double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	if (x->type == LVAL_ERR) { return x; }
+	lval_del(x);
+	return lval_float(secs);
+}
+
+
+/* String builtins */
+
+static lval * builtin_str_cat(lenv *e, lval *a) {
+	for (int i = 0; i < a->count; i++) {
+		LASSERT_STR_AT(a, i, "str-cat");
+	}
+
+	lval *x = a->count ? lval_pop(a, 0) : lval_str("");
+	while (a->count) {
+		x = lval_str_cat(x, lval_pop(a, 0));
+	}
+
+	lval_del(a);
+	return x;
+}
+
+static lval * builtin_str_len(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "str-len");
+	LASSERT_STR_AT(a, 0, "str-len");
+
+	lval *x = lval_num(a->cell[0]->slen);
+	lval_del(a);
+	return x;
+}
+
+/* (substr s start end) is the part from start up to excluding end */
+static lval * builtin_substr(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 3, "substr");
+	LASSERT_STR_AT(a, 0, "substr");
+	LASSERT_NUM_AT(a, 1, "substr");
+	LASSERT_NUM_AT(a, 2, "substr");
+
+	long len = a->cell[0]->slen;
+	long from = a->cell[1]->num;
+	long to = a->cell[2]->num;
+	LASSERT(a, 0 <= from && from <= to && to <= len,
+		"Function 'substr' passed invalid range! "
+		"Got %li to %li, expected 0 to %li", from, to, len);
+
+	/* the result is a slice sharing the storage */
+	lval *x = lval_pop(a, 0);
+	lval_sdata(x);
+	x->soff += from;
+	x->slen = to - from;
+
+	lval_del(a);
+	return x;
+}
+
+static lval * builtin_str_list(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "str->list");
+	LASSERT_STR_AT(a, 0, "str->list");
+
+	lval *v = a->cell[0];
+	char *s = lval_sdata(v);
+	lval *q = lval_qexpr();
+	q->count = v->slen;
+	q->cell = malloc(sizeof(lval *) * v->slen);
+	for (size_t i = 0; i < v->slen; i++) {
+		/* single characters are interned, at most 256 of them exist */
+		q->cell[i] = lval_str_lstr(lstr_intern(s + i, 1, lstr_hash_bytes(s + i, 1)));
+	}
+
+	lval_del(a);
+	return q;
+}
+
+/* (list->str {"a" "b"}) joins a list of strings in one pass */
+static lval * builtin_list_str(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "list->str");
+	LASSERT_QEXPR_AT(a, 0, "list->str");
+
+	lval *q = a->cell[0];
+	size_t len = 0;
+	for (int i = 0; i < q->count; i++) {
+		LASSERT(a, q->cell[i]->type == LVAL_STR,
+			"Function 'list->str' passed incorrect element %i! "
+			"Got %s, expected %s", i + 1,
+			ltype_name(q->cell[i]->type), ltype_name(LVAL_STR));
+		len += q->cell[i]->slen;
+	}
+
+	lstr *s = lstr_new(len);
+	char *p = s->data;
+	for (int i = 0; i < q->count; i++) {
+		lval *x = q->cell[i];
+		if (x->rope) {
+			lrope_write(x->rope, p);
+		} else {
+			memcpy(p, x->str->data + x->soff, x->slen);
+		}
+		p += x->slen;
+	}
+
+	lval_del(a);
+	return lval_str_lstr(s);
+}
+
+/* (num->str x) formats a number like the printer does,
+ * (num->str x digits) gives a fixed number of decimals */
+static lval * builtin_num_str(lenv *e, lval *a) {
+	LASSERT(a, a->count == 1 || a->count == 2,
+		"Function 'num->str' passed incorrect number of arguments! "
+		"Got %i, expected 1 or 2", a->count);
+	LASSERT_NUMERIC_AT(a, 0, "num->str");
+	if (a->count == 2) {
+		LASSERT_NUM_AT(a, 1, "num->str");
+		LASSERT(a, a->cell[1]->num >= 0 && a->cell[1]->num <= 100,
+			"Function 'num->str' passed invalid precision %li!",
+			a->cell[1]->num);
+	}
+
+	lval *x = a->cell[0];
+	char *s;
+	if (a->count == 2) {
+		int prec = a->cell[1]->num;
+		s = malloc(prec + 330);
+		sprintf(s, "%.*f", prec, lval_to_double(x));
+	} else if (x->type == LVAL_BIG) {
+		s = lbig_to_str(&x->big);
+	} else if (x->type == LVAL_FLOAT) {
+		s = malloc(32);
+		lfloat_format(x->fnum, s);
+	} else {
+		s = malloc(24);
+		sprintf(s, "%li", x->num);
+	}
+
+	lval *r = lval_str(s);
+	free(s);
+	lval_del(a);
+	return r;
+}
+
+/* (str->num s) reads an integer or float, errors on anything else */
+static lval * builtin_str_num(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "str->num");
+	LASSERT_STR_AT(a, 0, "str->num");
+
+	/* only what the reader reads as a number */
+	char *s = lval_cstr(a->cell[0]);
+	size_t n = lnum_syntax(s);
+	lval *x = n && s[n] == '\0' ? lval_num_from_str(s)
+		: lval_err("Function 'str->num' passed invalid number \"%s\"!", s);
+
+	lval_del(a);
+	return x;
+}
+
+
+/* String search
+ *
+ * Substring search compares the first and the last byte of the pattern
+ * against a whole block of candidate positions at once and only
+ * verifies positions where both match. Single bytes are found with
+ * memchr, which is vectorized by the C library. */
+
+#ifdef LVEC_X86
+LVEC_AVX2 static long lstr_search_avx2(const char *h, size_t n,
+				       const char *p, size_t m) {
+	__m256i first = _mm256_set1_epi8(p[0]);
+	__m256i last = _mm256_set1_epi8(p[m - 1]);
+	size_t i = 0;
+	for (; i + m - 1 + 32 <= n; i += 32) {
+		__m256i bf = _mm256_loadu_si256((const __m256i *)(h + i));
+		__m256i bl = _mm256_loadu_si256((const __m256i *)(h + i + m - 1));
+		uint32_t mask = _mm256_movemask_epi8(
+			_mm256_and_si256(_mm256_cmpeq_epi8(bf, first),
+					 _mm256_cmpeq_epi8(bl, last)));
+		while (mask) {
+			int bit = __builtin_ctz(mask);
+			if (memcmp(h + i + bit + 1, p + 1, m - 2) == 0) {
+				return i + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+	for (; i + m <= n; i++) {
+		if (h[i] == p[0] && memcmp(h + i, p, m) == 0) { return i; }
+	}
+	return -1;
+}
+#endif
+
+/* Position of the first occurrence of p (m bytes) in h (n bytes) */
+static long lstr_search(const char *h, size_t n, const char *p, size_t m) {
+	if (m == 0) { return 0; }
+	if (m > n) { return -1; }
+	if (m == 1) {
+		const char *r = memchr(h, p[0], n);
+		return r ? r - h : -1;
+	}
+
+	size_t i = 0;
+#ifdef LVEC_X86
+	if (lvec_avx2) { return lstr_search_avx2(h, n, p, m); }
+	__m128i first = _mm_set1_epi8(p[0]);
+	__m128i last = _mm_set1_epi8(p[m - 1]);
+	for (; i + m - 1 + 16 <= n; i += 16) {
+		__m128i bf = _mm_loadu_si128((const __m128i *)(h + i));
+		__m128i bl = _mm_loadu_si128((const __m128i *)(h + i + m - 1));
+		unsigned mask = _mm_movemask_epi8(
+			_mm_and_si128(_mm_cmpeq_epi8(bf, first),
+				      _mm_cmpeq_epi8(bl, last)));
+		while (mask) {
+			int bit = __builtin_ctz(mask);
+			if (memcmp(h + i + bit + 1, p + 1, m - 2) == 0) {
+				return i + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for (; i + m <= n; i++) {
+		if (h[i] == p[0] && memcmp(h + i, p, m) == 0) { return i; }
+	}
+	return -1;
+}
+
+/* (str-find s pat [start]) is the index of the first occurrence of pat
+ * at or after start, or -1 */
+static lval * builtin_str_find(lenv *e, lval *a) {
+	LASSERT(a, a->count == 2 || a->count == 3,
+		"Function 'str-find' passed incorrect number of arguments! "
+		"Got %i, expected 2 or 3", a->count);
+	LASSERT_STR_AT(a, 0, "str-find");
+	LASSERT_STR_AT(a, 1, "str-find");
+
+	lval *s = a->cell[0];
+	long start = 0;
+	if (a->count == 3) {
+		LASSERT_NUM_AT(a, 2, "str-find");
+		start = a->cell[2]->num;
+		LASSERT(a, start >= 0 && start <= (long)s->slen,
+			"Function 'str-find' passed invalid start %li!", start);
+	}
+
+	long r = lstr_search(lval_sdata(s) + start, s->slen - start,
+			     lval_sdata(a->cell[1]), a->cell[1]->slen);
+
+	lval_del(a);
+	return lval_num(r < 0 ? -1 : r + start);
+}
+
+/* (str-count s pat) counts non overlapping occurrences */
+static lval * builtin_str_count(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "str-count");
+	LASSERT_STR_AT(a, 0, "str-count");
+	LASSERT_STR_AT(a, 1, "str-count");
+	LASSERT(a, a->cell[1]->slen > 0, "Function 'str-count' passed \"\"!");
+
+	const char *h = lval_sdata(a->cell[0]);
+	const char *p = lval_sdata(a->cell[1]);
+	size_t n = a->cell[0]->slen, m = a->cell[1]->slen;
+
+	long count = 0;
+	size_t i = 0;
+	long r;
+	while ((r = lstr_search(h + i, n - i, p, m)) >= 0) {
+		count++;
+		i += r + m;
+	}
+
+	lval_del(a);
+	return lval_num(count);
+}
+
+/* (str-split s delim) splits at every occurrence of delim. The fields
+ * are slices sharing the storage of s, so nothing is copied. */
+static lval * builtin_str_split(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "str-split");
+	LASSERT_STR_AT(a, 0, "str-split");
+	LASSERT_STR_AT(a, 1, "str-split");
+	LASSERT(a, a->cell[1]->slen > 0, "Function 'str-split' passed \"\"!");
+
+	lval *s = a->cell[0];
+	const char *h = lval_sdata(s);
+	const char *p = lval_sdata(a->cell[1]);
+	size_t n = s->slen, m = a->cell[1]->slen;
+
+	lval *q = lval_qexpr();
+	size_t i = 0;
+	for (;;) {
+		long r = lstr_search(h + i, n - i, p, m);
+		size_t end = r < 0 ? n : i + r;
+
+		lval *f = lval_str_lstr(s->str);
+		s->str->refs++;
+		f->soff = s->soff + i;
+		f->slen = end - i;
+		lval_add(q, f);
+
+		if (r < 0) { break; }
+		i = end + m;
+	}
+
+	lval_del(a);
+	return q;
+}
+
+/* (str-replace s pat rep) replaces every occurrence of pat */
+static lval * builtin_str_replace(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 3, "str-replace");
+	LASSERT_STR_AT(a, 0, "str-replace");
+	LASSERT_STR_AT(a, 1, "str-replace");
+	LASSERT_STR_AT(a, 2, "str-replace");
+	LASSERT(a, a->cell[1]->slen > 0, "Function 'str-replace' passed \"\"!");
+
+	const char *h = lval_sdata(a->cell[0]);
+	const char *p = lval_sdata(a->cell[1]);
+	const char *rp = lval_sdata(a->cell[2]);
+	size_t n = a->cell[0]->slen, m = a->cell[1]->slen, k = a->cell[2]->slen;
+
+	/* count first so the result is allocated once */
+	size_t count = 0, i = 0;
+	long r;
+	while ((r = lstr_search(h + i, n - i, p, m)) >= 0) {
+		count++;
+		i += r + m;
+	}
+	if (count == 0) {
+		return lval_take(a, 0);
+	}
+
+	lstr *out = lstr_new(n - count * m + count * k);
+	char *o = out->data;
+	i = 0;
+	while ((r = lstr_search(h + i, n - i, p, m)) >= 0) {
+		memcpy(o, h + i, r);
+		o += r;
+		memcpy(o, rp, k);
+		o += k;
+		i += r + m;
+	}
+	memcpy(o, h + i, n - i);
+
+	lval_del(a);
+	return lval_str_lstr(out);
+}
+
+
+/* Persistent hash maps
+ *
+ * A map is a hash array mapped trie: every node uses 5 bits of the key
+ * hash to select one of 32 slots and stores only the used slots, a
+ * bitmap tells which. Nodes and key/value leaves are reference counted
+ * and never modified once shared, an update copies the path from the
+ * root to the changed slot and shares everything else. Keys whose 64
+ * hash bits are exhausted end up in a collision node searched linearly.
+ */
+
+#define LHAMT_BITS 5
+#define LHAMT_MASK 31
+
+static lhnode * lhnode_new(int n) {
+	lhnode *h = malloc(sizeof(lhnode) + sizeof(lhslot) * n);
+	h->refs = 1;
+	h->bitmap = 0;
+	h->collision = 0;
+	h->n = n;
+	return h;
+}
+
+static lhleaf * lhleaf_new(uint64_t hash, lval *k, lval *v) {
+	lhleaf *l = malloc(sizeof(lhleaf));
+	l->refs = 1;
+	l->hash = hash;
+	l->key = k;
+	l->val = v;
+	return l;
+}
+
+static void lhnode_release(lhnode *h);
+
+static void lhslot_release(lhslot *s) {
+	if (s->node) {
+		lhnode_release(s->node);
+	} else if (--s->leaf->refs == 0) {
+		lval_del(s->leaf->key);
+		lval_del(s->leaf->val);
+		free(s->leaf);
+	}
+}
+
+static void lhslot_retain(lhslot *s) {
+	if (s->node) {
+		s->node->refs++;
+	} else {
+		s->leaf->refs++;
+	}
+}
+
+static void lhnode_release(lhnode *h) {
+	if (--h->refs > 0) { return; }
+	for (int i = 0; i < h->n; i++) {
+		lhslot_release(&h->slots[i]);
+	}
+	free(h);
+}
+
+/* Copy of h with room for n slots, slots are shared */
+static lhnode * lhnode_clone(lhnode *h, int n) {
+	lhnode *c = lhnode_new(n);
+	c->bitmap = h->bitmap;
+	c->collision = h->collision;
+	int m = h->n < n ? h->n : n;
+	for (int i = 0; i < m; i++) {
+		c->slots[i] = h->slots[i];
+		lhslot_retain(&c->slots[i]);
+	}
+	return c;
+}
+
+static int lhnode_pos(lhnode *h, uint32_t bit) {
+	return __builtin_popcount(h->bitmap & (bit - 1));
+}
+
+static lhleaf * lhamt_get(lhnode *h, uint64_t hash, lval *k) {
+	for (int shift = 0; h; shift += LHAMT_BITS) {
+		if (h->collision) {
+			for (int i = 0; i < h->n; i++) {
+				if (lval_eq(h->slots[i].leaf->key, k)) {
+					return h->slots[i].leaf;
+				}
+			}
+			return NULL;
+		}
+
+		uint32_t bit = 1u << ((hash >> shift) & LHAMT_MASK);
+		if (!(h->bitmap & bit)) { return NULL; }
+		lhslot *s = &h->slots[lhnode_pos(h, bit)];
+		if (!s->node) {
+			return s->leaf->hash == hash && lval_eq(s->leaf->key, k)
+				? s->leaf : NULL;
+		}
+		h = s->node;
+	}
+	return NULL;
+}
+
+/* Does every key of x occur in y with an equal value? */
+static int lhamt_within(lhnode *x, lhnode *y) {
+	if (x == y || !x) { return 1; }
+	for (int i = 0; i < x->n; i++) {
+		if (x->slots[i].node) {
+			if (!lhamt_within(x->slots[i].node, y)) { return 0; }
+		} else {
+			lhleaf *l = x->slots[i].leaf;
+			lhleaf *m = lhamt_get(y, l->hash, l->key);
+			if (!m || !lval_eq(l->val, m->val)) { return 0; }
+		}
+	}
+	return 1;
+}
+
+/* Node holding the two leaves a and b which differ below shift */
+static lhnode * lhamt_pair(lhleaf *a, lhleaf *b, int shift) {
+	if (shift >= 64) {
+		lhnode *h = lhnode_new(2);
+		h->collision = 1;
+		h->slots[0] = (lhslot){ a, NULL };
+		h->slots[1] = (lhslot){ b, NULL };
+		return h;
+	}
+
+	uint32_t ia = (a->hash >> shift) & LHAMT_MASK;
+	uint32_t ib = (b->hash >> shift) & LHAMT_MASK;
+	if (ia == ib) {
+		lhnode *h = lhnode_new(1);
+		h->bitmap = 1u << ia;
+		h->slots[0] = (lhslot){ NULL, lhamt_pair(a, b, shift + LHAMT_BITS) };
+		return h;
+	}
+
+	lhnode *h = lhnode_new(2);
+	h->bitmap = (1u << ia) | (1u << ib);
+	h->slots[ia < ib ? 0 : 1] = (lhslot){ a, NULL };
+	h->slots[ia < ib ? 1 : 0] = (lhslot){ b, NULL };
+	return h;
+}
+
+/* New version of h with leaf l inserted or replacing an equal key.
+ * Takes the reference of l, *added is set if the map grew. */
+static lhnode * lhamt_put(lhnode *h, lhleaf *l, int shift, int *added) {
+	if (h->collision) {
+		for (int i = 0; i < h->n; i++) {
+			if (lval_eq(h->slots[i].leaf->key, l->key)) {
+				lhnode *c = lhnode_clone(h, h->n);
+				lhslot_release(&c->slots[i]);
+				c->slots[i] = (lhslot){ l, NULL };
+				return c;
+			}
+		}
+		lhnode *c = lhnode_clone(h, h->n + 1);
+		c->slots[h->n] = (lhslot){ l, NULL };
+		*added = 1;
+		return c;
+	}
+
+	uint32_t bit = 1u << ((l->hash >> shift) & LHAMT_MASK);
+	int pos = lhnode_pos(h, bit);
+
+	if (!(h->bitmap & bit)) {
+		/* free slot: insert the leaf */
+		lhnode *c = lhnode_new(h->n + 1);
+		c->bitmap = h->bitmap | bit;
+		for (int i = 0, j = 0; i < c->n; i++) {
+			if (i == pos) {
+				c->slots[i] = (lhslot){ l, NULL };
+			} else {
+				c->slots[i] = h->slots[j++];
+				lhslot_retain(&c->slots[i]);
+			}
+		}
+		*added = 1;
+		return c;
+	}
+
+	lhnode *c = lhnode_clone(h, h->n);
+	lhslot *s = &c->slots[pos];
+	if (s->node) {
+		lhnode *sub = lhamt_put(s->node, l, shift + LHAMT_BITS, added);
+		lhnode_release(s->node);
+		s->node = sub;
+	} else if (s->leaf->hash == l->hash && lval_eq(s->leaf->key, l->key)) {
+		lhslot_release(s);
+		s->leaf = l;
+	} else {
+		/* two different keys in one slot: push both one level down */
+		lhleaf *old = s->leaf;
+		s->leaf = NULL;
+		s->node = lhamt_pair(old, l, shift + LHAMT_BITS);
+		*added = 1;
+	}
+	return c;
+}
+
+/* New version of h without key k, NULL if the result is empty.
+ * *removed is set if the key was found, otherwise h itself is returned
+ * with an extra reference. */
+static lhnode * lhamt_del(lhnode *h, uint64_t hash, lval *k, int shift,
+			  int *removed) {
+	int pos = -1;
+	lhnode *sub = NULL;
+
+	if (h->collision) {
+		for (int i = 0; i < h->n; i++) {
+			if (lval_eq(h->slots[i].leaf->key, k)) { pos = i; }
+		}
+	} else {
+		uint32_t bit = 1u << ((hash >> shift) & LHAMT_MASK);
+		if (h->bitmap & bit) {
+			pos = lhnode_pos(h, bit);
+			lhslot *s = &h->slots[pos];
+			if (s->node) {
+				sub = lhamt_del(s->node, hash, k, shift + LHAMT_BITS, removed);
+				if (!*removed) {
+					lhnode_release(sub);
+					pos = -1;
+				}
+			} else if (s->leaf->hash != hash || !lval_eq(s->leaf->key, k)) {
+				pos = -1;
+			}
+		}
+	}
+
+	if (pos < 0) {
+		h->refs++;
+		return h;
+	}
+	*removed = 1;
+
+	/* a sub node shrunk to a single leaf is pulled up */
+	if (sub && sub->n == 1 && !sub->slots[0].node) {
+		lhleaf *l = sub->slots[0].leaf;
+		l->refs++;
+		lhnode_release(sub);
+		lhnode *c = lhnode_clone(h, h->n);
+		lhslot_release(&c->slots[pos]);
+		c->slots[pos] = (lhslot){ l, NULL };
+		return c;
+	}
+	if (sub) {
+		lhnode *c = lhnode_clone(h, h->n);
+		lhslot_release(&c->slots[pos]);
+		c->slots[pos].node = sub;
+		return c;
+	}
+
+	/* drop the slot */
+	if (h->n == 1) { return NULL; }
+	lhnode *c = lhnode_new(h->n - 1);
+	c->collision = h->collision;
+	c->bitmap = h->collision ? 0 : h->bitmap & ~(1u << ((hash >> shift) & LHAMT_MASK));
+	for (int i = 0, j = 0; i < h->n; i++) {
+		if (i == pos) { continue; }
+		c->slots[j] = h->slots[i];
+		lhslot_retain(&c->slots[j]);
+		j++;
+	}
+	return c;
+}
+
+/* Call f on every leaf in hash order */
+static void lhamt_each(lhnode *h, void (*f)(lhleaf *, void *), void *ctx) {
+	if (!h) { return; }
+	for (int i = 0; i < h->n; i++) {
+		if (h->slots[i].node) {
+			lhamt_each(h->slots[i].node, f, ctx);
+		} else {
+			f(h->slots[i].leaf, ctx);
+		}
+	}
+}
+
+static lval * lval_map(lhnode *root, long count) {
+	lval *v = malloc(sizeof(lval));
+	v->type = LVAL_MAP;
+	v->hroot = root;
+	v->hcount = count;
+	return v;
+}
+
+/* Insert into map m in place of its root, consumes k and v */
+static void lval_map_put(lval *m, lval *k, lval *v) {
+	int added = 0;
+	lhleaf *l = lhleaf_new(lval_hash(k), k, v);
+	lhnode *root = m->hroot ? m->hroot : lhnode_new(0);
+	lhnode *r = lhamt_put(root, l, 0, &added);
+	lhnode_release(root);
+	m->hroot = r;
+	m->hcount += added;
+}
+
+static void lhamt_collect_key(lhleaf *l, void *q) {
+	lval_add(q, lval_copy(l->key));
+}
+
+static void lhamt_collect_val(lhleaf *l, void *q) {
+	lval_add(q, lval_copy(l->val));
+}
+
+static void lhamt_collect_pair(lhleaf *l, void *q) {
+	lval *p = lval_qexpr();
+	lval_add(p, lval_copy(l->key));
+	lval_add(p, lval_copy(l->val));
+	lval_add(q, p);
+}
+
+/* (map-from {{k v} ...}) builds a map from a list of pairs */
+static lval * builtin_map_from(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "map-from");
+	LASSERT_QEXPR_AT(a, 0, "map-from");
+
+	lval *q = a->cell[0];
+	for (int i = 0; i < q->count; i++) {
+		LASSERT(a, q->cell[i]->type == LVAL_QEXPR && q->cell[i]->count == 2,
+			"Function 'map-from' passed invalid pair %i! "
+			"Expected {key value}", i + 1);
+	}
+
+	lval *m = lval_map(NULL, 0);
+	while (q->count) {
+		lval *p = lval_thaw(lval_pop(q, 0));
+		lval *k = lval_pop(p, 0);
+		lval_map_put(m, k, lval_take(p, 0));
+	}
+
+	lval_del(a);
+	return m;
+}
+
+/* (map-get m k [default]) */
+static lval * builtin_map_get(lenv *e, lval *a) {
+	LASSERT(a, a->count == 2 || a->count == 3,
+		"Function 'map-get' passed incorrect number of arguments! "
+		"Got %i, expected 2 or 3", a->count);
+	LASSERT_MAP_AT(a, 0, "map-get");
+
+	lval *k = a->cell[1];
+	lhleaf *l = lhamt_get(a->cell[0]->hroot, lval_hash(k), k);
+	lval *x;
+	if (l) {
+		x = lval_copy(l->val);
+	} else if (a->count == 3) {
+		x = lval_pop(a, 2);
+	} else {
+		x = lval_err("Key not found in map!");
+	}
+
+	lval_del(a);
+	return x;
+}
+
+static lval * builtin_map_has(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "map-has");
+	LASSERT_MAP_AT(a, 0, "map-has");
+
+	lval *k = a->cell[1];
+	lval *x = lval_bool(lhamt_get(a->cell[0]->hroot, lval_hash(k), k) != NULL);
+	lval_del(a);
+	return x;
+}
+
+static lval * builtin_map_put(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 3, "map-put");
+	LASSERT_MAP_AT(a, 0, "map-put");
+
+	lval *m = lval_pop(a, 0);
+	lval *k = lval_pop(a, 0);
+	lval_map_put(m, k, lval_take(a, 0));
+	return m;
+}
+
+static lval * builtin_map_del(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "map-del");
+	LASSERT_MAP_AT(a, 0, "map-del");
+
+	lval *m = lval_pop(a, 0);
+	if (m->hroot) {
+		int removed = 0;
+		lval *k = a->cell[0];
+		lhnode *r = lhamt_del(m->hroot, lval_hash(k), k, 0, &removed);
+		lhnode_release(m->hroot);
+		m->hroot = r;
+		m->hcount -= removed;
+	}
+
+	lval_del(a);
+	return m;
+}
+
+static lval * builtin_map_count(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "map-count");
+	LASSERT_MAP_AT(a, 0, "map-count");
+
+	lval *x = lval_num(a->cell[0]->hcount);
+	lval_del(a);
+	return x;
+}
+
+static lval * builtin_map_collect(lenv *e, lval *a, char *fn,
+				  void (*f)(lhleaf *, void *)) {
+	LASSERT_COUNT(a, 1, fn);
+	LASSERT_MAP_AT(a, 0, fn);
+
+	lval *q = lval_qexpr();
+	lhamt_each(a->cell[0]->hroot, f, q);
+	lval_del(a);
+	return q;
+}
+
+static lval * builtin_map_keys(lenv *e, lval *a) {
+	return builtin_map_collect(e, a, "map-keys", lhamt_collect_key);
+}
+
+static lval * builtin_map_vals(lenv *e, lval *a) {
+	return builtin_map_collect(e, a, "map-vals", lhamt_collect_val);
+}
+
+static lval * builtin_map_list(lenv *e, lval *a) {
+	return builtin_map_collect(e, a, "map->list", lhamt_collect_pair);
+}
+
+
+/* Memoization
+ *
+ * (memo f) wraps f with a cache from argument lists to results, keyed on
+ * the structural hash of the arguments. The cache holds at most cap
+ * entries and drops the least recently used one when full. Copies of
+ * the wrapper share the cache, so a recursive function defined as
+ * (def {fib} (memo fib)) finds its own earlier results. */
+
+#define LMEMO_CAP 4096
+
+static lval * lval_memo(lval *fn, long cap) {
+	lmemo *m = calloc(1, sizeof(lmemo));
+	m->refs = 1;
+	m->fn = fn;
+	m->cap = cap;
+
+	lval *v = malloc(sizeof(lval));
+	v->type = LVAL_FUN;
+	v->builtin = NULL;
+	v->memo = m;
+	return v;
+}
+
+static size_t lmemo_slot(lmemo *m, uint64_t h, lval *args) {
+	size_t mask = m->size - 1;
+	size_t i = h & mask;
+	while (m->slots[i]) {
+		lmemo_entry *x = m->slots[i];
+		if (x->hash == h && lval_eq(x->args, args)) { break; }
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+static void lmemo_grow(lmemo *m) {
+	lmemo_entry **old = m->slots;
+	size_t n = m->size;
+	m->size = n ? n * 2 : 16;
+	m->slots = calloc(m->size, sizeof(lmemo_entry *));
+	for (size_t i = 0; i < n; i++) {
+		if (old[i]) {
+			m->slots[lmemo_slot(m, old[i]->hash, old[i]->args)] = old[i];
+		}
+	}
+	free(old);
+}
+
+static void lmemo_unlink(lmemo *m, lmemo_entry *x) {
+	if (x->prev) { x->prev->next = x->next; } else { m->head = x->next; }
+	if (x->next) { x->next->prev = x->prev; } else { m->tail = x->prev; }
+}
+
+static void lmemo_push(lmemo *m, lmemo_entry *x) {
+	x->prev = NULL;
+	x->next = m->head;
+	if (m->head) { m->head->prev = x; } else { m->tail = x; }
+	m->head = x;
+}
+
+static void lmemo_entry_del(lmemo_entry *x) {
+	lval_del(x->args);
+	lval_del(x->val);
+	free(x);
+}
+
+/* drop the least recently used entry */
+static void lmemo_evict(lmemo *m) {
+	lmemo_entry *x = m->tail;
+	size_t mask = m->size - 1;
+	size_t i = lmemo_slot(m, x->hash, x->args);
+	m->slots[i] = NULL;
+
+	/* shift following entries of the probe sequence back */
+	for (size_t j = (i + 1) & mask; m->slots[j]; j = (j + 1) & mask) {
+		lmemo_entry *t = m->slots[j];
+		m->slots[j] = NULL;
+		m->slots[lmemo_slot(m, t->hash, t->args)] = t;
+	}
+
+	lmemo_unlink(m, x);
+	lmemo_entry_del(x);
+	m->count--;
+}
+
+static void lmemo_release(lmemo *m) {
+	if (--m->refs > 0) { return; }
+	while (m->head) {
+		lmemo_entry *x = m->head;
+		m->head = x->next;
+		lmemo_entry_del(x);
+	}
+	free(m->slots);
+	lval_del(m->fn);
+	free(m);
+}
+
+static lval * lmemo_call(lenv *e, lval *f, lval *a) {
+	lmemo *m = f->memo;
+	uint64_t h = lval_hash(a);
+
+	if (m->count) {
+		lmemo_entry *x = m->slots[lmemo_slot(m, h, a)];
+		if (x) {
+			m->hits++;
+			lmemo_unlink(m, x);
+			lmemo_push(m, x);
+			lval_del(a);
+			return lval_copy(x->val);
+		}
+	}
+	m->misses++;
+
+	/* calling a lambda consumes its formals, so call a copy */
+	lval *args = lval_copy(a);
+	lval *fn = lval_copy(m->fn);
+	lval *r = lval_no_recur(lval_call(e, fn, a));
+	lval_del(fn);
+
+	if (r->type == LVAL_ERR || m->cap == 0) {
+		lval_del(args);
+		return r;
+	}
+
+	/* a recursive call may have filled in the same entry already */
+	if (m->count && m->slots[lmemo_slot(m, h, args)]) {
+		lval_del(args);
+		return r;
+	}
+
+	if (m->count == m->cap) { lmemo_evict(m); }
+	if (2 * (m->count + 1) > m->size) { lmemo_grow(m); }
+	size_t i = lmemo_slot(m, h, args);
+
+	lmemo_entry *x = malloc(sizeof(lmemo_entry));
+	x->hash = h;
+	x->args = args;
+	x->val = lval_copy(r);
+	m->slots[i] = x;
+	lmemo_push(m, x);
+	m->count++;
+	return r;
+}
+
+/* (memo f [size]) */
+static lval * builtin_memo(lenv *e, lval *a) {
+	LASSERT(a, a->count == 1 || a->count == 2,
+		"Function 'memo' passed incorrect number of arguments! "
+		"Got %i, expected 1 or 2", a->count);
+	LASSERT_TYPE_AT(a, 0, LVAL_FUN, "memo");
+
+	long cap = LMEMO_CAP;
+	if (a->count == 2) {
+		LASSERT_NUM_AT(a, 1, "memo");
+		cap = a->cell[1]->num;
+		LASSERT(a, cap >= 0,
+			"Function 'memo' passed negative cache size %li!", cap);
+	}
+
+	lval *f = lval_pop(a, 0);
+	lval_del(a);
+	return lval_memo(f, cap);
+}
+
+/* (memo-stats f) is {hits misses entries} */
+static lval * builtin_memo_stats(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "memo-stats");
+	LASSERT(a, a->cell[0]->type == LVAL_FUN && a->cell[0]->memo,
+		"Function 'memo-stats' passed a function that is not memoized!");
+
+	lmemo *m = a->cell[0]->memo;
+	lval *q = lval_qexpr();
+	lval_add(q, lval_num(m->hits));
+	lval_add(q, lval_num(m->misses));
+	lval_add(q, lval_num(m->count));
+	lval_del(a);
+	return q;
+}
+
+
+/* Lazy sequences
+ *
+ * A lazy sequence is an immutable recipe: a range, an iterated function
+ * or a map, filter or take stage over another sequence. Elements are
+ * produced one at a time by a cursor, so a pipeline only ever holds the
+ * element it is working on. realize collects the elements into a list
+ * and keeps it in the recipe, copies of the sequence share the result. */
+
+enum { LLAZY_RANGE, LLAZY_ITERATE, LLAZY_MAP, LLAZY_FILTER,
+       LLAZY_TAKE_WHILE, LLAZY_TAKE };
+
+static lval * lval_lazy(int kind, lval *f, lval *src) {
+	llazy *z = calloc(1, sizeof(llazy));
+	z->refs = 1;
+	z->kind = kind;
+	z->f = f;
+	z->src = src;
+
+	lval *v = malloc(sizeof(lval));
+	v->type = LVAL_LAZY;
+	v->lazy = z;
+	return v;
+}
+
+static void llazy_release(llazy *z) {
+	if (--z->refs > 0) { return; }
+	if (z->f) { lval_del(z->f); }
+	if (z->x) { lval_del(z->x); }
+	if (z->src) { lval_del(z->src); }
+	if (z->realized) { lval_del(z->realized); }
+	free(z);
+}
+
+static int lval_is_seq(lval *v) {
+	return v->type == LVAL_QEXPR || v->type == LVAL_VEC || v->type == LVAL_LAZY;
+}
+
+/* Position in a list, vector or lazy sequence */
+typedef struct lcursor lcursor;
+struct lcursor {
+	lval *seq;
+	long i;
+	int done;
+	int steal;
+	lval *state;
+	lcursor *src;
+};
+
+/* Number of elements of a range, its span does not always fit into a
+ * long */
+static unsigned long llazy_range_len(llazy *z) {
+	if (z->step > 0 && z->end > z->start) {
+		return ((unsigned long)z->end - z->start - 1) / z->step + 1;
+	}
+	if (z->step < 0 && z->start > z->end) {
+		return ((unsigned long)z->start - z->end - 1) / -(unsigned long)z->step + 1;
+	}
+	return 0;
+}
+
+/* The cursor borrows seq, which must outlive it */
+static lcursor * lcursor_new(lval *seq) {
+	lcursor *c = calloc(1, sizeof(lcursor));
+	if (seq->type == LVAL_LAZY && seq->lazy->realized) {
+		seq = seq->lazy->realized;
+	}
+	c->seq = seq;
+	if (seq->type == LVAL_LAZY && seq->lazy->src) {
+		c->src = lcursor_new(seq->lazy->src);
+	}
+	return c;
+}
+
+static void lcursor_del(lcursor *c) {
+	if (c->steal) {
+		lval *s = c->seq;
+		memmove(&s->cell[0], &s->cell[c->i], sizeof(lval *) * (s->count - c->i));
+		s->count -= c->i;
+	}
+	if (c->src) { lcursor_del(c->src); }
+	if (c->state) { lval_del(c->state); }
+	free(c);
+}
+
+/* The next element, NULL at the end or an error. Once it returned NULL
+ * or an error the cursor must not be advanced again. */
+static lval * lcursor_next(lenv *e, lcursor *c) {
+	lval *s = c->seq;
+	if (s->type == LVAL_QEXPR) {
+		if (c->i >= s->count) { return NULL; }
+		/* the owner of an unshared list can move the elements out */
+		return c->steal ? s->cell[c->i++] : lval_copy(s->cell[c->i++]);
+	}
+	if (s->type == LVAL_VEC) {
+		return c->i < s->vlen ? lvec_ref(s, c->i++) : NULL;
+	}
+
+	llazy *z = s->lazy;
+	lval *x, *r;
+	switch (z->kind) {
+	case LLAZY_RANGE:
+		if ((unsigned long)c->i >= llazy_range_len(z)) { return NULL; }
+		return lval_num((unsigned long)z->start + (unsigned long)c->i++ * z->step);
+
+	case LLAZY_ITERATE:
+		/* x, (f x), (f (f x)), ... */
+		x = c->state ? lval_apply(e, z->f, lval_add(lval_sexpr(), c->state))
+			: lval_copy(z->x);
+		c->state = NULL;
+		if (x->type == LVAL_ERR) { return x; }
+		c->state = lval_copy(x);
+		return x;
+
+	case LLAZY_MAP:
+		x = lcursor_next(e, c->src);
+		if (!x || x->type == LVAL_ERR) { return x; }
+		return lval_apply(e, z->f, lval_add(lval_sexpr(), x));
+
+	case LLAZY_TAKE:
+		if (c->i++ >= z->end) { return NULL; }
+		return lcursor_next(e, c->src);
+
+	case LLAZY_FILTER:
+	case LLAZY_TAKE_WHILE:
+		if (c->done) { return NULL; }
+		while ((x = lcursor_next(e, c->src)) && x->type != LVAL_ERR) {
+			r = lval_apply(e, z->f, lval_add(lval_sexpr(), lval_copy(x)));
+			if (r->type != LVAL_BOOL) {
+				lval_del(x);
+				if (r->type == LVAL_ERR) { return r; }
+				x = lval_err("Lazy sequence predicate returned %s, "
+					     "expected %s", ltype_name(r->type),
+					     ltype_name(LVAL_BOOL));
+				lval_del(r);
+				return x;
+			}
+			boolean b = r->b;
+			lval_del(r);
+			if (b) { return x; }
+			lval_del(x);
+			if (z->kind == LLAZY_TAKE_WHILE) {
+				c->done = 1;
+				return NULL;
+			}
+		}
+		return x;
+	}
+	return NULL;
+}
+
+#define LASSERT_SEQ_AT(arg, pos, fn) \
+	LASSERT(arg, lval_is_seq(arg->cell[pos]),\
+		"Function '%s' passed incorrect type for argument %i! "\
+		"Got %s, expected a sequence",\
+		fn, pos + 1, ltype_name(arg->cell[pos]->type))
+
+/* (lazy-range end), (lazy-range start end) or (lazy-range start end step) */
+static lval * builtin_lazy_range(lenv *e, lval *a) {
+	LASSERT(a, a->count >= 1 && a->count <= 3,
+		"Function 'lazy-range' passed incorrect number of arguments! "
+		"Got %i, expected 1 to 3", a->count);
+	for (int i = 0; i < a->count; i++) {
+		LASSERT_NUM_AT(a, i, "lazy-range");
+	}
+
+	long step = a->count > 2 ? a->cell[2]->num : 1;
+	LASSERT(a, step != 0, "Function 'lazy-range' passed a step of zero!");
+
+	lval *v = lval_lazy(LLAZY_RANGE, NULL, NULL);
+	v->lazy->start = a->count > 1 ? a->cell[0]->num : 0;
+	v->lazy->end = a->count > 1 ? a->cell[1]->num : a->cell[0]->num;
+	v->lazy->step = step;
+
+	lval_del(a);
+	return v;
+}
+
+/* (lazy-iterate f x) is the infinite sequence x, (f x), (f (f x)), ... */
+static lval * builtin_lazy_iterate(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "lazy-iterate");
+	LASSERT_TYPE_AT(a, 0, LVAL_FUN, "lazy-iterate");
+
+	lval *f = lval_pop(a, 0);
+	lval *v = lval_lazy(LLAZY_ITERATE, f, NULL);
+	v->lazy->x = lval_take(a, 0);
+	return v;
+}
+
+/* a lazy stage applying f to the sequence in the second argument */
+static lval * builtin_lazy_stage(lenv *e, lval *a, char *fn, int kind) {
+	LASSERT_COUNT(a, 2, fn);
+	LASSERT_TYPE_AT(a, 0, LVAL_FUN, fn);
+	LASSERT_SEQ_AT(a, 1, fn);
+
+	lval *f = lval_pop(a, 0);
+	return lval_lazy(kind, f, lval_take(a, 0));
+}
+
+static lval * builtin_lazy_map(lenv *e, lval *a) {
+	return builtin_lazy_stage(e, a, "lazy-map", LLAZY_MAP);
+}
+
+static lval * builtin_lazy_filter(lenv *e, lval *a) {
+	return builtin_lazy_stage(e, a, "lazy-filter", LLAZY_FILTER);
+}
+
+static lval * builtin_take_while(lenv *e, lval *a) {
+	return builtin_lazy_stage(e, a, "take-while", LLAZY_TAKE_WHILE);
+}
+
+static lval * builtin_lazy_take(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "lazy-take");
+	LASSERT_NUM_AT(a, 0, "lazy-take");
+	LASSERT_SEQ_AT(a, 1, "lazy-take");
+
+	long n = a->cell[0]->num;
+	lval *v = lval_lazy(LLAZY_TAKE, NULL, lval_take(a, 1));
+	v->lazy->end = n;
+	return v;
+}
+
+/* (realize s) is the list of all elements of s. The list is stored in
+ * the sequence, so its elements are only computed once. */
+static lval * builtin_realize(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "realize");
+	LASSERT_SEQ_AT(a, 0, "realize");
+
+	lval *s = a->cell[0];
+	if (s->type == LVAL_QEXPR) { return lval_take(a, 0); }
+	if (s->type == LVAL_LAZY && s->lazy->realized) {
+		lval *x = lval_copy(s->lazy->realized);
+		lval_del(a);
+		return x;
+	}
+
+	lval *q = lval_qexpr();
+	lcursor *c = lcursor_new(s);
+	lval *x;
+	while ((x = lcursor_next(e, c))) {
+		if (x->type == LVAL_ERR) {
+			lcursor_del(c);
+			lval_del(q);
+			lval_del(a);
+			return x;
+		}
+		lval_add(q, x);
+	}
+	lcursor_del(c);
+
+	if (s->type == LVAL_LAZY) {
+		s->lazy->realized = lval_copy(q);
+	}
+	lval_del(a);
+	return q;
+}
+
+
+/* Transducers
+ *
+ * (xform {map f} {filter p} {take n} {take-while p}) describes a chain
+ * of stages. It is a plain list of stages whose arguments are
+ * evaluated, so transducers compose with join. transduce runs the
+ * stages and a reducing function over any sequence in a single pass,
+ * each element flows through all stages before the next one is read
+ * and no intermediate lists are built. */
+
+enum { LXF_MAP, LXF_FILTER, LXF_TAKE, LXF_TAKE_WHILE };
+
+typedef struct {
+	int kind;
+	lval *f;
+	long n;
+} lxf_stage;
+
+/* Decode the stages of xf into st, returns an error or NULL */
+static lval * lxf_parse(lval *xf, lxf_stage *st) {
+	for (int i = 0; i < xf->count; i++) {
+		lval *s = xf->cell[i];
+		if (s->type != LVAL_QEXPR || s->count != 2 || s->cell[0]->type != LVAL_SYM) {
+			return lval_err("Transducer stage %i is not of the form {stage arg}!", i + 1);
+		}
+
+		char *name = s->cell[0]->sym;
+		lval *arg = s->cell[1];
+		if (strcmp(name, "map") == 0) { st[i].kind = LXF_MAP; }
+		else if (strcmp(name, "filter") == 0) { st[i].kind = LXF_FILTER; }
+		else if (strcmp(name, "take") == 0) { st[i].kind = LXF_TAKE; }
+		else if (strcmp(name, "take-while") == 0) { st[i].kind = LXF_TAKE_WHILE; }
+		else { return lval_err("Unknown transducer stage '%s'!", name); }
+
+		lval_type t = st[i].kind == LXF_TAKE ? LVAL_NUM : LVAL_FUN;
+		if (arg->type != t) {
+			return lval_err("Transducer stage '%s' passed %s, expected %s",
+					name, ltype_name(arg->type), ltype_name(t));
+		}
+		st[i].f = arg;
+		st[i].n = arg->type == LVAL_NUM ? arg->num : 0;
+	}
+	return NULL;
+}
+
+/* Reduce the elements of seq that pass the stages into acc with rf, or
+ * append them to the list acc if rf is NULL. Consumes acc, the elements
+ * of an unshared list seq are moved out. */
+static lval * lval_transduce(lenv *e, lxf_stage *st, int n, lval *seq,
+			     lval *rf, lval *acc) {
+	int stop = 0;
+	for (int i = 0; i < n; i++) {
+		if (st[i].kind == LXF_TAKE && st[i].n <= 0) { stop = 1; }
+	}
+
+	lcursor *c = lcursor_new(seq);
+	c->steal = seq->type == LVAL_QEXPR && !seq->consed;
+
+	lval *x, *r;
+	while (!stop && (x = lcursor_next(e, c))) {
+		for (int i = 0; i < n && x && x->type != LVAL_ERR; i++) {
+			switch (st[i].kind) {
+			case LXF_MAP:
+				x = lval_apply(e, st[i].f, lval_add(lval_sexpr(), x));
+				break;
+			case LXF_TAKE:
+				if (--st[i].n == 0) { stop = 1; }
+				break;
+			case LXF_FILTER:
+			case LXF_TAKE_WHILE:
+				r = lval_apply(e, st[i].f, lval_add(lval_sexpr(), lval_copy(x)));
+				if (r->type == LVAL_BOOL && r->b) {
+					lval_del(r);
+					break;
+				}
+				lval_del(x);
+				if (r->type == LVAL_BOOL) {
+					x = NULL;
+					if (st[i].kind == LXF_TAKE_WHILE) { stop = 1; }
+					lval_del(r);
+				} else if (r->type == LVAL_ERR) {
+					x = r;
+				} else {
+					x = lval_err("Transducer predicate returned %s, expected %s",
+						     ltype_name(r->type), ltype_name(LVAL_BOOL));
+					lval_del(r);
+				}
+				break;
+			}
+		}
+
+		if (!x) { continue; }
+		if (x->type == LVAL_ERR) {
+			lval_del(acc);
+			acc = x;
+			break;
+		}
+		acc = rf ? lval_apply2(e, rf, acc, x) : lval_add(acc, x);
+		if (acc->type == LVAL_ERR) { break; }
+	}
+
+	lcursor_del(c);
+	return acc;
+}
+
+/* (xform {stage arg} ...) evaluates the argument of every stage */
+static lval * builtin_xform(lenv *e, lval *a) {
+	for (int i = 0; i < a->count; i++) {
+		lval *s = a->cell[i];
+		LASSERT(a, s->type == LVAL_QEXPR && s->count == 2,
+			"Function 'xform' passed invalid stage %i! "
+			"Expected {stage arg}", i + 1);
+		s->cell[1] = lval_eval(e, s->cell[1]);
+		if (s->cell[1]->type == LVAL_ERR) {
+			lval *err = lval_pop(s, 1);
+			lval_del(a);
+			return err;
+		}
+	}
+
+	lxf_stage *st = malloc(sizeof(lxf_stage) * a->count);
+	lval *err = lxf_parse(a, st);
+	free(st);
+	if (err) {
+		lval_del(a);
+		return err;
+	}
+
+	a->type = LVAL_QEXPR;
+	return a;
+}
+
+/* (transduce xf f init seq) folds f over the elements of seq passed
+ * through the stages of xf */
+static lval * builtin_transduce(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 4, "transduce");
+	LASSERT_QEXPR_AT(a, 0, "transduce");
+	LASSERT_TYPE_AT(a, 1, LVAL_FUN, "transduce");
+	LASSERT_SEQ_AT(a, 3, "transduce");
+
+	lval *xf = a->cell[0];
+	lxf_stage *st = malloc(sizeof(lxf_stage) * xf->count);
+	lval *x = lxf_parse(xf, st);
+	if (!x) {
+		lval *acc = lval_pop(a, 2);
+		x = lval_transduce(e, st, xf->count, a->cell[2], a->cell[1], acc);
+	}
+
+	free(st);
+	lval_del(a);
+	return x;
+}
+
+/* (into xf seq) is the list of the elements of seq passing through xf */
+static lval * builtin_into(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "into");
+	LASSERT_QEXPR_AT(a, 0, "into");
+	LASSERT_SEQ_AT(a, 1, "into");
+
+	lval *xf = a->cell[0];
+	lxf_stage *st = malloc(sizeof(lxf_stage) * xf->count);
+	lval *x = lxf_parse(xf, st);
+	if (!x) {
+		x = lval_transduce(e, st, xf->count, a->cell[1], NULL, lval_qexpr());
+	}
+
+	free(st);
+	lval_del(a);
+	return x;
+}
+
+
+/* Tables
+ *
+ * A table stores its data column wise: every column is a contiguous
+ * array of int64_t, double or interned lstr pointers, so equal strings
+ * are equal pointers. Tables are immutable and share their columns, a
+ * filter only builds a selection vector of the rows that remain. */
+
+enum { LCOL_INT, LCOL_FLOAT, LCOL_STR };
+
+static lcol * lcol_new(const char *name, int type, long len) {
+	lcol *c = malloc(sizeof(lcol));
+	c->refs = 1;
+	c->type = type;
+	c->name = malloc(strlen(name) + 1);
+	strcpy(c->name, name);
+	c->len = len;
+	c->data = calloc(len ? len : 1, 8);
+	return c;
+}
+
+static void lcol_release(lcol *c) {
+	if (--c->refs > 0) { return; }
+	if (c->type == LCOL_STR) {
+		lstr **s = c->data;
+		for (long i = 0; i < c->len; i++) { lstr_release(s[i]); }
+	}
+	free(c->name);
+	free(c->data);
+	free(c);
+}
+
+static ltable * ltable_new(int ncols, long nrows) {
+	ltable *t = malloc(sizeof(ltable));
+	t->refs = 1;
+	t->nrows = nrows;
+	t->ncols = ncols;
+	t->cols = calloc(ncols ? ncols : 1, sizeof(lcol *));
+	t->sel = NULL;
+	return t;
+}
+
+static void ltable_release(ltable *t) {
+	if (--t->refs > 0) { return; }
+	for (int i = 0; i < t->ncols; i++) { lcol_release(t->cols[i]); }
+	if (t->sel) { lbuf_release(t->sel); }
+	free(t->cols);
+	free(t);
+}
+
+static lval * lval_table(ltable *t) {
+	lval *v = malloc(sizeof(lval));
+	v->type = LVAL_TABLE;
+	v->tbl = t;
+	return v;
+}
+
+/* position of row r in the columns */
+static int64_t ltable_row(ltable *t, long r) {
+	return t->sel ? ((int64_t *)t->sel->data)[r] : r;
+}
+
+static int ltable_find(ltable *t, const char *name) {
+	for (int i = 0; i < t->ncols; i++) {
+		if (strcmp(t->cols[i]->name, name) == 0) { return i; }
+	}
+	return -1;
+}
+
+/* the interned storage of the text of a string value */
+static lstr * lval_intern(lval *v) {
+	if (v->str && v->str->interned && v->soff == 0 && v->slen == v->str->len) {
+		v->str->refs++;
+		return v->str;
+	}
+	char *p = lval_sdata(v);
+	return lstr_intern(p, v->slen, lstr_hash_bytes(p, v->slen));
+}
+
+static int lstr_cmp(lstr *x, lstr *y) {
+	if (x == y) { return 0; }
+	size_t n = x->len < y->len ? x->len : y->len;
+	int r = memcmp(x->data, y->data, n);
+	if (r) { return r; }
+	return (x->len > y->len) - (x->len < y->len);
+}
+
+static lval * lcol_get(lcol *c, int64_t i) {
+	switch (c->type) {
+	case LCOL_INT: return lval_num(((int64_t *)c->data)[i]);
+	case LCOL_FLOAT: return lval_float(((double *)c->data)[i]);
+	}
+	lstr *s = ((lstr **)c->data)[i];
+	s->refs++;
+	return lval_str_lstr(s);
+}
+
+/* new column holding the rows idx[0..n) of c */
+static lcol * lcol_gather(lcol *c, const char *name, int64_t *idx, long n) {
+	lcol *r = lcol_new(name, c->type, n);
+	int64_t *src = c->data, *dst = r->data;
+	for (long k = 0; k < n; k++) {
+		dst[k] = src[idx[k]];
+	}
+	if (c->type == LCOL_STR) {
+		for (long k = 0; k < n; k++) { ((lstr **)r->data)[k]->refs++; }
+	}
+	return r;
+}
+
+static uint64_t lcol_hash(lcol *c, int64_t i) {
+	if (c->type == LCOL_STR) { return lstr_hash(((lstr **)c->data)[i]); }
+	uint64_t h = ((uint64_t *)c->data)[i];
+	if (c->type == LCOL_FLOAT && ((double *)c->data)[i] == 0) { h = 0; }
+	return lhash_mix(h);
+}
+
+static int lcol_eq(lcol *x, int64_t i, lcol *y, int64_t j) {
+	switch (x->type) {
+	case LCOL_INT: return ((int64_t *)x->data)[i] == ((int64_t *)y->data)[j];
+	case LCOL_FLOAT: return ((double *)x->data)[i] == ((double *)y->data)[j];
+	}
+	return ((lstr **)x->data)[i] == ((lstr **)y->data)[j];
+}
+
+static int ltable_eq(ltable *x, ltable *y) {
+	if (x == y) { return 1; }
+	if (x->ncols != y->ncols || x->nrows != y->nrows) { return 0; }
+	for (int j = 0; j < x->ncols; j++) {
+		lcol *a = x->cols[j], *b = y->cols[j];
+		if (a->type != b->type || strcmp(a->name, b->name) != 0) { return 0; }
+		for (long r = 0; r < x->nrows; r++) {
+			if (!lcol_eq(a, ltable_row(x, r), b, ltable_row(y, r))) { return 0; }
+		}
+	}
+	return 1;
+}
+
+static void lval_print_table(lval *v) {
+	ltable *t = v->tbl;
+	printf("#table{{");
+	for (int j = 0; j < t->ncols; j++) {
+		if (j) { putchar(' '); }
+		lval *n = lval_str(t->cols[j]->name);
+		lval_print(n);
+		lval_del(n);
+	}
+	putchar('}');
+	for (long r = 0; r < t->nrows; r++) {
+		printf(" {");
+		for (int j = 0; j < t->ncols; j++) {
+			if (j) { putchar(' '); }
+			lval *x = lcol_get(t->cols[j], ltable_row(t, r));
+			lval_print(x);
+			lval_del(x);
+		}
+		putchar('}');
+	}
+	putchar('}');
+}
+
+/* Hash index over the distinct values of a key column. Groups are
+ * numbered in order of first appearance, first[g] is a row of group g. */
+typedef struct {
+	lcol *col;
+	size_t size;
+	long *slots;
+	long ngroups;
+	long cap;
+	int64_t *first;
+} lkeyidx;
+
+static long lkeyidx_slot(lkeyidx *x, lcol *c, int64_t i) {
+	size_t mask = x->size - 1;
+	size_t p = lcol_hash(c, i) & mask;
+	while (x->slots[p] && !lcol_eq(x->col, x->first[x->slots[p] - 1], c, i)) {
+		p = (p + 1) & mask;
+	}
+	return p;
+}
+
+static void lkeyidx_grow(lkeyidx *x) {
+	free(x->slots);
+	x->size = x->size ? x->size * 2 : 64;
+	x->slots = calloc(x->size, sizeof(long));
+	for (long g = 0; g < x->ngroups; g++) {
+		x->slots[lkeyidx_slot(x, x->col, x->first[g])] = g + 1;
+	}
+}
+
+/* group of the value in row i of c, a new group is made for a new
+ * value if insert is set, otherwise it is -1 */
+static long lkeyidx_find(lkeyidx *x, lcol *c, int64_t i, int insert) {
+	if (insert && 2 * (x->ngroups + 1) > (long)x->size) { lkeyidx_grow(x); }
+	if (x->size == 0) { return -1; }
+
+	long p = lkeyidx_slot(x, c, i);
+	if (x->slots[p]) { return x->slots[p] - 1; }
+	if (!insert) { return -1; }
+
+	if (x->ngroups == x->cap) {
+		x->cap = x->cap ? x->cap * 2 : 64;
+		x->first = realloc(x->first, sizeof(int64_t) * x->cap);
+	}
+	x->first[x->ngroups] = i;
+	x->slots[p] = ++x->ngroups;
+	return x->ngroups - 1;
+}
+
+static void lkeyidx_free(lkeyidx *x) {
+	free(x->slots);
+	free(x->first);
+}
+
+#define LASSERT_TABLE_AT(arg, pos, fn) \
+	LASSERT_TYPE_AT(arg, pos, LVAL_TABLE, fn)
+
+/* declares ci as the index of the column named by argument pos */
+#define LASSERT_COLUMN(arg, t, pos, fn, ci) \
+	LASSERT_STR_AT(arg, pos, fn); \
+	int ci = ltable_find(t, lval_cstr(arg->cell[pos])); \
+	LASSERT(arg, ci >= 0, "Function '%s' passed unknown column \"%s\"!", \
+		fn, lval_cstr(arg->cell[pos]))
+
+/* (table {"name" "age"} {{"bob" 31} {"ann" 25}}) builds a table from
+ * rows, the types of the columns are those of the first row */
+static lval * builtin_table(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "table");
+	LASSERT_QEXPR_AT(a, 0, "table");
+	LASSERT_QEXPR_AT(a, 1, "table");
+
+	lval *names = a->cell[0];
+	lval *rows = a->cell[1];
+	int ncols = names->count;
+	for (int j = 0; j < ncols; j++) {
+		LASSERT(a, names->cell[j]->type == LVAL_STR,
+			"Function 'table' column name %i is not a string!", j + 1);
+		for (int k = 0; k < j; k++) {
+			LASSERT(a, !lval_eq(names->cell[j], names->cell[k]),
+				"Function 'table' passed column \"%s\" twice!",
+				lval_cstr(names->cell[j]));
+		}
+	}
+
+	for (int i = 0; i < rows->count; i++) {
+		lval *r = rows->cell[i];
+		LASSERT(a, r->type == LVAL_QEXPR && r->count == ncols,
+			"Function 'table' row %i does not have %i fields!", i + 1, ncols);
+	}
+
+	int types[ncols ? ncols : 1];
+	for (int j = 0; j < ncols; j++) {
+		lval_type t = rows->count ? rows->cell[0]->cell[j]->type : LVAL_NUM;
+		types[j] = t == LVAL_FLOAT ? LCOL_FLOAT : t == LVAL_STR ? LCOL_STR : LCOL_INT;
+	}
+	for (int i = 0; i < rows->count; i++) {
+		lval *r = rows->cell[i];
+		for (int j = 0; j < ncols; j++) {
+			lval_type t = r->cell[j]->type;
+			LASSERT(a, types[j] == LCOL_INT ? t == LVAL_NUM
+				: types[j] == LCOL_FLOAT ? t == LVAL_FLOAT || t == LVAL_NUM
+				: t == LVAL_STR,
+				"Function 'table' row %i has %s in column \"%s\"!",
+				i + 1, ltype_name(t), lval_cstr(names->cell[j]));
+		}
+	}
+
+	ltable *t = ltable_new(ncols, rows->count);
+	for (int j = 0; j < ncols; j++) {
+		lcol *c = lcol_new(lval_cstr(names->cell[j]), types[j], rows->count);
+		for (int i = 0; i < rows->count; i++) {
+			lval *x = rows->cell[i]->cell[j];
+			switch (c->type) {
+			case LCOL_INT: ((int64_t *)c->data)[i] = x->num; break;
+			case LCOL_FLOAT: ((double *)c->data)[i] = lval_to_double(x); break;
+			case LCOL_STR: ((lstr **)c->data)[i] = lval_intern(x); break;
+			}
+		}
+		t->cols[j] = c;
+	}
+
+	lval_del(a);
+	return lval_table(t);
+}
+
+static lval * builtin_tbl_count(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "tbl-count");
+	LASSERT_TABLE_AT(a, 0, "tbl-count");
+
+	lval *x = lval_num(a->cell[0]->tbl->nrows);
+	lval_del(a);
+	return x;
+}
+
+static lval * builtin_tbl_cols(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "tbl-cols");
+	LASSERT_TABLE_AT(a, 0, "tbl-cols");
+
+	ltable *t = a->cell[0]->tbl;
+	lval *q = lval_qexpr();
+	for (int j = 0; j < t->ncols; j++) {
+		lval_add(q, lval_str(t->cols[j]->name));
+	}
+	lval_del(a);
+	return q;
+}
+
+/* (tbl-col t "age") is a vector for numeric columns and a list of
+ * strings otherwise */
+static lval * builtin_tbl_col(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "tbl-col");
+	LASSERT_TABLE_AT(a, 0, "tbl-col");
+	ltable *t = a->cell[0]->tbl;
+	LASSERT_COLUMN(a, t, 1, "tbl-col", ci);
+
+	lcol *c = t->cols[ci];
+	lval *x;
+	if (c->type == LCOL_STR) {
+		x = lval_qexpr();
+		for (long r = 0; r < t->nrows; r++) {
+			lval_add(x, lcol_get(c, ltable_row(t, r)));
+		}
+	} else {
+		x = lval_vec(c->type == LCOL_INT ? LVEC_INT : LVEC_FLOAT, t->nrows);
+		int64_t *src = c->data, *dst = x->vdata;
+		for (long r = 0; r < t->nrows; r++) {
+			dst[r] = src[ltable_row(t, r)];
+		}
+	}
+
+	lval_del(a);
+	return x;
+}
+
+static lval * builtin_tbl_rows(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "tbl-rows");
+	LASSERT_TABLE_AT(a, 0, "tbl-rows");
+
+	ltable *t = a->cell[0]->tbl;
+	lval *q = lval_qexpr();
+	for (long r = 0; r < t->nrows; r++) {
+		int64_t i = ltable_row(t, r);
+		lval *row = lval_qexpr();
+		for (int j = 0; j < t->ncols; j++) {
+			lval_add(row, lcol_get(t->cols[j], i));
+		}
+		lval_add(q, row);
+	}
+	lval_del(a);
+	return q;
+}
+
+/* (tbl-select t {"name" "age"}) keeps the named columns */
+static lval * builtin_tbl_select(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "tbl-select");
+	LASSERT_TABLE_AT(a, 0, "tbl-select");
+	LASSERT_QEXPR_AT(a, 1, "tbl-select");
+
+	ltable *t = a->cell[0]->tbl;
+	lval *names = a->cell[1];
+	int idx[names->count ? names->count : 1];
+	for (int j = 0; j < names->count; j++) {
+		lval *n = names->cell[j];
+		LASSERT(a, n->type == LVAL_STR,
+			"Function 'tbl-select' column name %i is not a string!", j + 1);
+		idx[j] = ltable_find(t, lval_cstr(n));
+		LASSERT(a, idx[j] >= 0, "Function 'tbl-select' passed unknown column \"%s\"!",
+			lval_cstr(n));
+	}
+
+	ltable *r = ltable_new(names->count, t->nrows);
+	for (int j = 0; j < names->count; j++) {
+		r->cols[j] = t->cols[idx[j]];
+		r->cols[j]->refs++;
+	}
+	if (t->sel) {
+		r->sel = t->sel;
+		r->sel->refs++;
+	}
+
+	lval_del(a);
+	return lval_table(r);
+}
+
+/* (tbl-where t "age" ">" 30) keeps the rows where the comparison
+ * holds. The result shares the columns and only has a new selection
+ * vector, the scan itself is branch free. */
+static lval * builtin_tbl_where(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 4, "tbl-where");
+	LASSERT_TABLE_AT(a, 0, "tbl-where");
+	ltable *t = a->cell[0]->tbl;
+	LASSERT_COLUMN(a, t, 1, "tbl-where", ci);
+	LASSERT_STR_AT(a, 2, "tbl-where");
+
+	/* bit c + 1 of the mask says whether a three way comparison
+	 * result c keeps the row */
+	static const char *ops[] = { "==", "!=", "<", ">", "<=", ">=" };
+	static const int masks[] = { 2, 5, 1, 4, 3, 6 };
+	char *op = lval_cstr(a->cell[2]);
+	int mask = 0;
+	for (int k = 0; k < 6; k++) {
+		if (strcmp(op, ops[k]) == 0) { mask = masks[k]; }
+	}
+	LASSERT(a, mask, "Function 'tbl-where' passed unknown comparison \"%s\"!", op);
+
+	lcol *c = t->cols[ci];
+	lval *v = a->cell[3];
+	if (c->type == LCOL_STR) {
+		LASSERT_STR_AT(a, 3, "tbl-where");
+	} else {
+		LASSERT_NUMERIC_AT(a, 3, "tbl-where");
+	}
+
+	lbuf *sel = lbuf_new(sizeof(int64_t) * t->nrows);
+	int64_t *out = (int64_t *)sel->data;
+	long k = 0;
+	if (c->type == LCOL_INT && v->type == LVAL_NUM) {
+		int64_t *d = c->data, y = v->num;
+		for (long r = 0; r < t->nrows; r++) {
+			int64_t i = ltable_row(t, r);
+			int cmp = (d[i] > y) - (d[i] < y);
+			out[k] = i;
+			k += (mask >> (cmp + 1)) & 1;
+		}
+	} else if (c->type != LCOL_STR) {
+		double y = lval_to_double(v);
+		for (long r = 0; r < t->nrows; r++) {
+			int64_t i = ltable_row(t, r);
+			double x = c->type == LCOL_INT ? (double)((int64_t *)c->data)[i]
+				: ((double *)c->data)[i];
+			int cmp = (x > y) - (x < y);
+			out[k] = i;
+			k += (mask >> (cmp + 1)) & 1;
+		}
+	} else {
+		lstr **d = c->data;
+		lstr *y = lval_intern(v);
+		for (long r = 0; r < t->nrows; r++) {
+			int64_t i = ltable_row(t, r);
+			int cmp = lstr_cmp(d[i], y);
+			cmp = (cmp > 0) - (cmp < 0);
+			out[k] = i;
+			k += (mask >> (cmp + 1)) & 1;
+		}
+		lstr_release(y);
+	}
+
+	ltable *r = ltable_new(t->ncols, k);
+	for (int j = 0; j < t->ncols; j++) {
+		r->cols[j] = t->cols[j];
+		r->cols[j]->refs++;
+	}
+	r->sel = sel;
+
+	lval_del(a);
+	return lval_table(r);
+}
+
+enum { LAGG_COUNT, LAGG_SUM, LAGG_MIN, LAGG_MAX };
+
+/* (tbl-group t "key" {{"count"} {"sum" "score"} {"max" "age"}}) has a
+ * row per distinct key with the aggregates in columns named count,
+ * sum_score, max_age. Rows are grouped with a hash index on the key,
+ * then every aggregate is one pass over its column. */
+static lval * builtin_tbl_group(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 3, "tbl-group");
+	LASSERT_TABLE_AT(a, 0, "tbl-group");
+	ltable *t = a->cell[0]->tbl;
+	LASSERT_COLUMN(a, t, 1, "tbl-group", ki);
+	LASSERT_QEXPR_AT(a, 2, "tbl-group");
+
+	static const char *names[] = { "count", "sum", "min", "max" };
+	lval *aggs = a->cell[2];
+	int n = aggs->count;
+	int kinds[n ? n : 1], cols[n ? n : 1];
+	for (int j = 0; j < n; j++) {
+		lval *g = aggs->cell[j];
+		LASSERT(a, g->type == LVAL_QEXPR && g->count >= 1 && g->count <= 2
+			&& g->cell[0]->type == LVAL_STR
+			&& (g->count == 1 || g->cell[1]->type == LVAL_STR),
+			"Function 'tbl-group' aggregate %i is not of the form "
+			"{\"count\"} or {\"sum\" \"column\"}!", j + 1);
+		kinds[j] = -1;
+		for (int k = 0; k < 4; k++) {
+			if (strcmp(lval_cstr(g->cell[0]), names[k]) == 0) { kinds[j] = k; }
+		}
+		LASSERT(a, kinds[j] >= 0, "Function 'tbl-group' passed unknown aggregate \"%s\"!",
+			lval_cstr(g->cell[0]));
+		LASSERT(a, (kinds[j] == LAGG_COUNT) == (g->count == 1),
+			"Function 'tbl-group' aggregate \"%s\" needs %s!", names[kinds[j]],
+			kinds[j] == LAGG_COUNT ? "no column" : "a column");
+		cols[j] = -1;
+		if (g->count == 2) {
+			cols[j] = ltable_find(t, lval_cstr(g->cell[1]));
+			LASSERT(a, cols[j] >= 0, "Function 'tbl-group' passed unknown column \"%s\"!",
+				lval_cstr(g->cell[1]));
+			LASSERT(a, t->cols[cols[j]]->type != LCOL_STR,
+				"Function 'tbl-group' cannot aggregate string column \"%s\"!",
+				lval_cstr(g->cell[1]));
+		}
+	}
+
+	/* group of every row */
+	lcol *key = t->cols[ki];
+	lkeyidx x = { key, 0, NULL, 0, 0, NULL };
+	long *gid = malloc(sizeof(long) * (t->nrows ? t->nrows : 1));
+	for (long r = 0; r < t->nrows; r++) {
+		gid[r] = lkeyidx_find(&x, key, ltable_row(t, r), 1);
+	}
+	long ng = x.ngroups;
+
+	ltable *res = ltable_new(n + 1, ng);
+	res->cols[0] = lcol_gather(key, key->name, x.first, ng);
+	for (int j = 0; j < n; j++) {
+		lcol *src = cols[j] >= 0 ? t->cols[cols[j]] : NULL;
+		char name[256];
+		if (src) {
+			snprintf(name, sizeof(name), "%s_%s", names[kinds[j]], src->name);
+		} else {
+			snprintf(name, sizeof(name), "%s", names[kinds[j]]);
+		}
+
+		int type = src ? src->type : LCOL_INT;
+		lcol *c = lcol_new(name, type, ng);
+		int64_t *ci = c->data;
+		double *cf = c->data;
+		int overflow = 0;
+
+		if (kinds[j] == LAGG_MIN || kinds[j] == LAGG_MAX) {
+			/* start from the first row of each group */
+			for (long g = 0; g < ng; g++) {
+				ci[g] = ((int64_t *)src->data)[x.first[g]];
+			}
+		}
+
+		for (long r = 0; r < t->nrows; r++) {
+			int64_t i = ltable_row(t, r);
+			long g = gid[r];
+			if (kinds[j] == LAGG_COUNT) {
+				ci[g]++;
+			} else if (type == LCOL_INT) {
+				int64_t v = ((int64_t *)src->data)[i];
+				switch (kinds[j]) {
+				case LAGG_SUM: overflow |= __builtin_add_overflow(ci[g], v, &ci[g]); break;
+				case LAGG_MIN: if (v < ci[g]) { ci[g] = v; } break;
+				case LAGG_MAX: if (v > ci[g]) { ci[g] = v; } break;
+				}
+			} else {
+				double v = ((double *)src->data)[i];
+				switch (kinds[j]) {
+				case LAGG_SUM: cf[g] += v; break;
+				case LAGG_MIN: if (v < cf[g]) { cf[g] = v; } break;
+				case LAGG_MAX: if (v > cf[g]) { cf[g] = v; } break;
+				}
+			}
+		}
+
+		/* columns hold fixnums only */
+		if (overflow) {
+			lval *err = lval_err("Function 'tbl-group' sum of column \"%s\" overflows!",
+					     src->name);
+			lcol_release(c);
+			res->ncols = j + 1;
+			ltable_release(res);
+			free(gid);
+			lkeyidx_free(&x);
+			lval_del(a);
+			return err;
+		}
+		res->cols[j + 1] = c;
+	}
+
+	free(gid);
+	lkeyidx_free(&x);
+	lval_del(a);
+	return lval_table(res);
+}
+
+/* (tbl-join l r "key") is the inner join on the column key of both
+ * tables. A hash index is built on r and probed with the rows of l, the
+ * result has the columns of l followed by the other columns of r. */
+static lval * builtin_tbl_join(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 3, "tbl-join");
+	LASSERT_TABLE_AT(a, 0, "tbl-join");
+	LASSERT_TABLE_AT(a, 1, "tbl-join");
+	ltable *l = a->cell[0]->tbl;
+	ltable *r = a->cell[1]->tbl;
+	LASSERT_COLUMN(a, l, 2, "tbl-join", lk);
+	int rk = ltable_find(r, lval_cstr(a->cell[2]));
+	LASSERT(a, rk >= 0, "Function 'tbl-join' passed unknown column \"%s\"!",
+		lval_cstr(a->cell[2]));
+	LASSERT(a, l->cols[lk]->type == r->cols[rk]->type,
+		"Function 'tbl-join' key columns have different types!");
+	for (int j = 0; j < r->ncols; j++) {
+		LASSERT(a, j == rk || ltable_find(l, r->cols[j]->name) < 0,
+			"Function 'tbl-join' column \"%s\" is in both tables!",
+			r->cols[j]->name);
+	}
+
+	/* rows of r with equal keys are chained through next */
+	lcol *rkey = r->cols[rk];
+	lkeyidx x = { rkey, 0, NULL, 0, 0, NULL };
+	long *next = malloc(sizeof(long) * (r->nrows ? r->nrows : 1));
+	for (long k = 0; k < r->nrows; k++) {
+		next[k] = lkeyidx_find(&x, rkey, ltable_row(r, k), 1);
+	}
+	long *head = malloc(sizeof(long) * (x.ngroups ? x.ngroups : 1));
+	for (long g = 0; g < x.ngroups; g++) { head[g] = -1; }
+	for (long k = r->nrows - 1; k >= 0; k--) {
+		long g = next[k];
+		next[k] = head[g];
+		head[g] = k;
+	}
+
+	long n = 0, cap = 64;
+	int64_t *li = malloc(sizeof(int64_t) * cap);
+	int64_t *ri = malloc(sizeof(int64_t) * cap);
+	lcol *lkey = l->cols[lk];
+	for (long k = 0; k < l->nrows; k++) {
+		int64_t i = ltable_row(l, k);
+		long g = lkeyidx_find(&x, lkey, i, 0);
+		for (long m = g >= 0 ? head[g] : -1; m >= 0; m = next[m]) {
+			if (n == cap) {
+				cap *= 2;
+				li = realloc(li, sizeof(int64_t) * cap);
+				ri = realloc(ri, sizeof(int64_t) * cap);
+			}
+			li[n] = i;
+			ri[n] = ltable_row(r, m);
+			n++;
+		}
+	}
+
+	ltable *res = ltable_new(l->ncols + r->ncols - 1, n);
+	int j = 0;
+	for (int k = 0; k < l->ncols; k++) {
+		res->cols[j++] = lcol_gather(l->cols[k], l->cols[k]->name, li, n);
+	}
+	for (int k = 0; k < r->ncols; k++) {
+		if (k == rk) { continue; }
+		res->cols[j++] = lcol_gather(r->cols[k], r->cols[k]->name, ri, n);
+	}
+
+	free(li);
+	free(ri);
+	free(head);
+	free(next);
+	lkeyidx_free(&x);
+	lval_del(a);
+	return lval_table(res);
+}
+
+
+/* Priority queues
+ *
+ * A priority queue is a 4-ary implicit heap in one array: the children
+ * of item i are 4i+1 to 4i+4, which keeps a sift down within one or two
+ * cache lines per level and makes the heap half as deep as a binary
+ * one. Without a comparator items are numbers or lists starting with a
+ * number and the smallest number comes first. With a comparator (f x y)
+ * is true if x comes before y. Queues are handles: pushing and popping
+ * modifies the queue shared by all copies of it. */
+
+#define LPQ_ARITY 4
+
+static lval * lval_pq(lval *cmp) {
+	lpq *q = calloc(1, sizeof(lpq));
+	q->refs = 1;
+	q->cmp = cmp;
+
+	lval *v = malloc(sizeof(lval));
+	v->type = LVAL_PQ;
+	v->pq = q;
+	return v;
+}
+
+static void lpq_release(lpq *q) {
+	if (--q->refs > 0) { return; }
+	for (long i = 0; i < q->n; i++) { lval_del(q->items[i].v); }
+	if (q->cmp) { lval_del(q->cmp); }
+	free(q->items);
+	free(q);
+}
+
+/* the number an item is ordered by, NULL if it has none */
+static lval * lpq_key(lval *v) {
+	if (lval_is_num(v)) { return v; }
+	if (v->type == LVAL_QEXPR && v->count > 0 && lval_is_num(v->cell[0])) {
+		return v->cell[0];
+	}
+	return NULL;
+}
+
+/* does x come before y? The first comparator error is kept in *err. */
+static int lpq_less(lenv *e, lpq *q, lpq_item *x, lpq_item *y, lval **err) {
+	if (!q->cmp) { return lval_num_cmp(x->key, y->key) < 0; }
+	if (*err) { return 0; }
+
+	lval *r = lval_apply2(e, q->cmp, lval_copy(x->v), lval_copy(y->v));
+	if (r->type == LVAL_BOOL) {
+		int b = r->b;
+		lval_del(r);
+		return b;
+	}
+	if (r->type == LVAL_ERR) {
+		*err = r;
+	} else {
+		*err = lval_err("Priority queue comparator returned %s, expected %s",
+				ltype_name(r->type), ltype_name(LVAL_BOOL));
+		lval_del(r);
+	}
+	return 0;
+}
+
+/* The sifts find the new place of the item before anything moves, so
+ * after a comparator error the heap is as it was */
+static void lpq_sift_up(lenv *e, lpq *q, long i, lval **err) {
+	lpq_item x = q->items[i];
+	long t = i;
+	while (t > 0 && lpq_less(e, q, &x, &q->items[(t - 1) / LPQ_ARITY], err)) {
+		t = (t - 1) / LPQ_ARITY;
+	}
+	if (*err) { return; }
+
+	for (; i > t; i = (i - 1) / LPQ_ARITY) {
+		q->items[i] = q->items[(i - 1) / LPQ_ARITY];
+	}
+	q->items[t] = x;
+}
+
+static void lpq_sift_down(lenv *e, lpq *q, long i, lval **err) {
+	lpq_item x = q->items[i];
+
+	/* a 4-ary heap of 2^63 items is 32 levels deep */
+	long path[64];
+	int d = 0;
+	for (long t = i;;) {
+		long c = LPQ_ARITY * t + 1;
+		if (c >= q->n) { break; }
+
+		/* smallest child */
+		long end = c + LPQ_ARITY < q->n ? c + LPQ_ARITY : q->n;
+		long m = c;
+		for (long k = c + 1; k < end; k++) {
+			if (lpq_less(e, q, &q->items[k], &q->items[m], err)) { m = k; }
+		}
+		if (!lpq_less(e, q, &q->items[m], &x, err)) { break; }
+		path[d++] = t = m;
+	}
+	if (*err) { return; }
+
+	for (int k = 0; k < d; k++) {
+		q->items[i] = q->items[path[k]];
+		i = path[k];
+	}
+	q->items[i] = x;
+}
+
+static void lpq_reserve(lpq *q, long n) {
+	if (n <= q->cap) { return; }
+	q->cap = q->cap * 2 > n ? q->cap * 2 : n;
+	q->items = realloc(q->items, sizeof(lpq_item) * q->cap);
+}
+
+#define LASSERT_PQ_AT(arg, pos, fn) \
+	LASSERT_TYPE_AT(arg, pos, LVAL_PQ, fn)
+
+/* (heapify l [f]) is a priority queue of the elements of l, built
+ * bottom up in linear time */
+static lval * builtin_heapify(lenv *e, lval *a) {
+	LASSERT(a, a->count == 1 || a->count == 2,
+		"Function 'heapify' passed incorrect number of arguments! "
+		"Got %i, expected 1 or 2", a->count);
+	LASSERT_QEXPR_AT(a, 0, "heapify");
+	if (a->count == 2) { LASSERT_TYPE_AT(a, 1, LVAL_FUN, "heapify"); }
+
+	lval *l = a->cell[0];
+	if (a->count == 1) {
+		for (int i = 0; i < l->count; i++) {
+			LASSERT(a, lpq_key(l->cell[i]),
+				"Function 'heapify' element %i has no numeric priority!", i + 1);
+		}
+	}
+
+	lval *v = lval_pq(a->count == 2 ? lval_pop(a, 1) : NULL);
+	lpq *q = v->pq;
+	lpq_reserve(q, l->count);
+	for (int i = 0; i < l->count; i++) {
+		q->items[i].v = l->cell[i];
+		q->items[i].key = q->cmp ? NULL : lpq_key(l->cell[i]);
+	}
+	q->n = l->count;
+	l->count = 0;
+
+	lval *err = NULL;
+	for (long i = (q->n - 2) / LPQ_ARITY; q->n > 1 && i >= 0; i--) {
+		lpq_sift_down(e, q, i, &err);
+	}
+
+	lval_del(a);
+	if (err) {
+		lval_del(v);
+		return err;
+	}
+	return v;
+}
+
+/* (pq-push q x) adds x to q and returns q */
+static lval * builtin_pq_push(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "pq-push");
+	LASSERT_PQ_AT(a, 0, "pq-push");
+
+	lpq *q = a->cell[0]->pq;
+	lval *key = lpq_key(a->cell[1]);
+	LASSERT(a, q->cmp || key, "Function 'pq-push' passed %s without a numeric priority!",
+		ltype_name(a->cell[1]->type));
+
+	lpq_reserve(q, q->n + 1);
+	q->items[q->n].key = q->cmp ? NULL : key;
+	q->items[q->n].v = lval_pop(a, 1);
+	q->n++;
+
+	lval *err = NULL;
+	lpq_sift_up(e, q, q->n - 1, &err);
+	if (err) {
+		/* the item is still last, take it out again */
+		lval_del(q->items[--q->n].v);
+		lval_del(a);
+		return err;
+	}
+	return lval_take(a, 0);
+}
+
+/* (pq-pop q) removes and returns the first item */
+static lval * builtin_pq_pop(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "pq-pop");
+	LASSERT_PQ_AT(a, 0, "pq-pop");
+
+	lpq *q = a->cell[0]->pq;
+	LASSERT(a, q->n > 0, "Function 'pq-pop' passed an empty queue!");
+
+	lpq_item top = q->items[0];
+	q->items[0] = q->items[--q->n];
+
+	lval *err = NULL;
+	if (q->n > 1) { lpq_sift_down(e, q, 0, &err); }
+	if (err) {
+		/* the last item is still in place, put the first one back */
+		q->items[0] = top;
+		q->n++;
+		lval_del(a);
+		return err;
+	}
+	lval_del(a);
+	return top.v;
+}
+
+static lval * builtin_pq_peek(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "pq-peek");
+	LASSERT_PQ_AT(a, 0, "pq-peek");
+
+	lpq *q = a->cell[0]->pq;
+	LASSERT(a, q->n > 0, "Function 'pq-peek' passed an empty queue!");
+
+	lval *x = lval_copy(q->items[0].v);
+	lval_del(a);
+	return x;
+}
+
+static lval * builtin_pq_size(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "pq-size");
+	LASSERT_PQ_AT(a, 0, "pq-size");
+
+	lval *x = lval_num(a->cell[0]->pq->n);
+	lval_del(a);
+	return x;
+}
+
+
+/* Sorted maps
+ *
+ * A sorted map is a B+tree with up to 16 entries per node. The key
+ * prefixes of a node fill two cache lines and are searched by counting
+ * the ones below the wanted key, full keys are only compared on equal
+ * prefixes. Keys are all numbers or all strings. Like maps they are
+ * persistent: nodes are shared between copies and copied before they
+ * are modified. Deleting merges a node with a neighbour when both fit
+ * in one, it does not otherwise rebalance. */
+
+#define LBT_DEPTH 32
+
+enum { LBT_NONE, LBT_NUM, LBT_STR };
+
+static lval * lval_sorted(void) {
+	lval *v = malloc(sizeof(lval));
+	v->type = LVAL_SORTED;
+	v->broot = NULL;
+	v->bcount = 0;
+	v->bkind = LBT_NONE;
+	v->bmap = 0;
+	return v;
+}
+
+static lbtnode * lbtnode_new(int leaf) {
+	void *p = NULL;
+	/* the prefixes start on a cache line */
+	if (posix_memalign(&p, 64, sizeof(lbtnode)) != 0) { abort(); }
+	lbtnode *x = p;
+	x->refs = 1;
+	x->leaf = leaf;
+	x->n = 0;
+	return x;
+}
+
+static void lbtnode_release(lbtnode *x) {
+	if (--x->refs > 0) { return; }
+	for (int i = 0; i < x->n; i++) {
+		lval_del(x->keys[i]);
+		if (!x->leaf) {
+			lbtnode_release(x->sub[i].kid);
+		} else if (x->sub[i].val) {
+			lval_del(x->sub[i].val);
+		}
+	}
+	free(x);
+}
+
+static int lbt_kind(lval *k) {
+	if (lval_is_num(k)) { return LBT_NUM; }
+	if (k->type == LVAL_STR) { return LBT_STR; }
+	return LBT_NONE;
+}
+
+/* prefixes order like the keys, equal prefixes need a full compare */
+static uint64_t lbt_prefix(int kind, lval *k) {
+	if (kind == LBT_STR) { return lsort_str_key(k); }
+
+	/* flip the bits of a double so they order as unsigned integers */
+	double d = lval_to_double(k);
+	uint64_t u;
+	if (d == 0) { d = 0.0; }
+	memcpy(&u, &d, sizeof(u));
+	return (u >> 63) ? ~u : u | (1ULL << 63);
+}
+
+static int lbt_cmp(int kind, lval *x, lval *y) {
+	if (kind == LBT_NUM) { return lval_num_cmp(x, y); }
+	size_t n = x->slen < y->slen ? x->slen : y->slen;
+	int r = memcmp(lval_sdata(x), lval_sdata(y), n);
+	return r ? r : (x->slen > y->slen) - (x->slen < y->slen);
+}
+
+/* index of the first key of x that is not less than k */
+static int lbt_rank(int kind, lbtnode *x, uint64_t p, lval *k) {
+	int i = 0;
+	for (int j = 0; j < x->n; j++) { i += x->pre[j] < p; }
+	while (i < x->n && x->pre[i] == p && lbt_cmp(kind, x->keys[i], k) < 0) {
+		i++;
+	}
+	return i;
+}
+
+static int lbt_same(int kind, lbtnode *x, int i, uint64_t p, lval *k) {
+	return i < x->n && x->pre[i] == p && lbt_cmp(kind, x->keys[i], k) == 0;
+}
+
+/* the child of inner node x whose keys k belongs between */
+static int lbt_child(int kind, lbtnode *x, uint64_t p, lval *k) {
+	int i = lbt_rank(kind, x, p, k);
+	if (lbt_same(kind, x, i, p, k)) { return i; }
+	return i > 0 ? i - 1 : 0;
+}
+
+/* x if it is not shared, otherwise a private copy of it */
+static lbtnode * lbt_own(lbtnode *x) {
+	if (x->refs == 1) { return x; }
+
+	lbtnode *y = lbtnode_new(x->leaf);
+	y->n = x->n;
+	memcpy(y->pre, x->pre, sizeof(uint64_t) * x->n);
+	for (int i = 0; i < x->n; i++) {
+		y->keys[i] = lval_copy(x->keys[i]);
+		if (!x->leaf) {
+			y->sub[i].kid = x->sub[i].kid;
+			y->sub[i].kid->refs++;
+		} else {
+			y->sub[i].val = x->sub[i].val ? lval_copy(x->sub[i].val) : NULL;
+		}
+	}
+	x->refs--;
+	return y;
+}
+
+static void lbt_insert_at(lbtnode *x, int i, uint64_t p, lval *k, lbtsub s) {
+	int m = x->n - i;
+	memmove(&x->pre[i + 1], &x->pre[i], sizeof(uint64_t) * m);
+	memmove(&x->keys[i + 1], &x->keys[i], sizeof(lval *) * m);
+	memmove(&x->sub[i + 1], &x->sub[i], sizeof(lbtsub) * m);
+	x->pre[i] = p;
+	x->keys[i] = k;
+	x->sub[i] = s;
+	x->n++;
+}
+
+/* drops entry i of x, the caller owns its key and value */
+static void lbt_remove_at(lbtnode *x, int i) {
+	int m = x->n - i - 1;
+	memmove(&x->pre[i], &x->pre[i + 1], sizeof(uint64_t) * m);
+	memmove(&x->keys[i], &x->keys[i + 1], sizeof(lval *) * m);
+	memmove(&x->sub[i], &x->sub[i + 1], sizeof(lbtsub) * m);
+	x->n--;
+}
+
+/* Insert at i, splitting x in two halves if it is full. Returns the
+ * new right half or NULL. */
+static lbtnode * lbt_place(lbtnode *x, int i, uint64_t p, lval *k, lbtsub s) {
+	if (x->n < LBT_ORDER) {
+		lbt_insert_at(x, i, p, k, s);
+		return NULL;
+	}
+
+	lbtnode *r = lbtnode_new(x->leaf);
+	int h = x->n / 2;
+	r->n = x->n - h;
+	memcpy(r->pre, &x->pre[h], sizeof(uint64_t) * r->n);
+	memcpy(r->keys, &x->keys[h], sizeof(lval *) * r->n);
+	memcpy(r->sub, &x->sub[h], sizeof(lbtsub) * r->n);
+	x->n = h;
+
+	if (i <= h) {
+		lbt_insert_at(x, i, p, k, s);
+	} else {
+		lbt_insert_at(r, i - h, p, k, s);
+	}
+	return r;
+}
+
+/* Update the key of child c of x after its smallest key changed */
+static void lbt_refresh(int kind, lbtnode *x, int c) {
+	lbtnode *y = x->sub[c].kid;
+	if (x->pre[c] == y->pre[0] && lbt_cmp(kind, x->keys[c], y->keys[0]) == 0) {
+		return;
+	}
+	lval_del(x->keys[c]);
+	x->pre[c] = y->pre[0];
+	x->keys[c] = lval_copy(y->keys[0]);
+}
+
+/* Insert k v into the unshared node x, consumes k and v. Returns the
+ * new right sibling if x split, *added is set if k is a new key. */
+static lbtnode * lbt_put(int kind, lbtnode *x, uint64_t p, lval *k, lval *v,
+			 int *added) {
+	if (x->leaf) {
+		int i = lbt_rank(kind, x, p, k);
+		if (lbt_same(kind, x, i, p, k)) {
+			if (x->sub[i].val) { lval_del(x->sub[i].val); }
+			x->sub[i].val = v;
+			lval_del(k);
+			return NULL;
+		}
+		*added = 1;
+		return lbt_place(x, i, p, k, (lbtsub){ .val = v });
+	}
+
+	int c = lbt_child(kind, x, p, k);
+	lbtnode *y = x->sub[c].kid = lbt_own(x->sub[c].kid);
+	lbtnode *r = lbt_put(kind, y, p, k, v, added);
+	lbt_refresh(kind, x, c);
+	if (!r) { return NULL; }
+	return lbt_place(x, c + 1, r->pre[0], lval_copy(r->keys[0]),
+			 (lbtsub){ .kid = r });
+}
+
+/* Append child l + 1 of the unshared node x to child l */
+static void lbt_merge(lbtnode *x, int l) {
+	lbtnode *a = x->sub[l].kid = lbt_own(x->sub[l].kid);
+	lbtnode *b = x->sub[l + 1].kid;
+	for (int i = 0; i < b->n; i++) {
+		lbtsub s = b->sub[i];
+		if (!b->leaf) {
+			s.kid->refs++;
+		} else if (s.val) {
+			s.val = lval_copy(s.val);
+		}
+		lbt_insert_at(a, a->n, b->pre[i], lval_copy(b->keys[i]), s);
+	}
+	lval_del(x->keys[l + 1]);
+	lbtnode_release(b);
+	lbt_remove_at(x, l + 1);
+}
+
+/* Remove k from the unshared node x, which must contain it */
+static void lbt_del(int kind, lbtnode *x, uint64_t p, lval *k) {
+	if (x->leaf) {
+		int i = lbt_rank(kind, x, p, k);
+		lval_del(x->keys[i]);
+		if (x->sub[i].val) { lval_del(x->sub[i].val); }
+		lbt_remove_at(x, i);
+		return;
+	}
+
+	int c = lbt_child(kind, x, p, k);
+	lbtnode *y = x->sub[c].kid = lbt_own(x->sub[c].kid);
+	lbt_del(kind, y, p, k);
+	if (y->n == 0) {
+		lval_del(x->keys[c]);
+		lbtnode_release(y);
+		lbt_remove_at(x, c);
+		return;
+	}
+	lbt_refresh(kind, x, c);
+
+	/* merge child c with a neighbour if both fit in one node */
+	for (int l = c - 1; l <= c; l++) {
+		if (l < 0 || l + 1 >= x->n) { continue; }
+		if (x->sub[l].kid->n + x->sub[l + 1].kid->n > LBT_ORDER) { continue; }
+		lbt_merge(x, l);
+		break;
+	}
+}
+
+/* the leaf holding k and its index in *at, or NULL */
+static lbtnode * lbt_find(int kind, lbtnode *x, lval *k, int *at) {
+	if (!x) { return NULL; }
+	uint64_t p = lbt_prefix(kind, k);
+	while (!x->leaf) { x = x->sub[lbt_child(kind, x, p, k)].kid; }
+	int i = lbt_rank(kind, x, p, k);
+	if (!lbt_same(kind, x, i, p, k)) { return NULL; }
+	*at = i;
+	return x;
+}
+
+static lbtnode * lbt_last(lbtnode *x, int *at) {
+	while (!x->leaf) { x = x->sub[x->n - 1].kid; }
+	*at = x->n - 1;
+	return x;
+}
+
+/* the last entry less than k, or not greater than k unless strict */
+static lbtnode * lbt_floor(int kind, lbtnode *x, uint64_t p, lval *k,
+			   int strict, int *at) {
+	if (x->leaf) {
+		int i = lbt_rank(kind, x, p, k);
+		if (!strict && lbt_same(kind, x, i, p, k)) {
+			*at = i;
+			return x;
+		}
+		*at = i - 1;
+		return i > 0 ? x : NULL;
+	}
+
+	int c = lbt_child(kind, x, p, k);
+	lbtnode *r = lbt_floor(kind, x->sub[c].kid, p, k, strict, at);
+	if (r || c == 0) { return r; }
+	return lbt_last(x->sub[c - 1].kid, at);
+}
+
+/* In order iterator, the path from the root to the current entry */
+typedef struct {
+	lbtnode *node[LBT_DEPTH];
+	int pos[LBT_DEPTH];
+	int depth;
+} lbtiter;
+
+/* Move a position past the end of a node on to the next entry */
+static void lbt_settle(lbtiter *it) {
+	int d = it->depth - 1;
+	while (d >= 0 && it->pos[d] >= it->node[d]->n) {
+		if (--d >= 0) { it->pos[d]++; }
+	}
+	if (d < 0) {
+		it->depth = 0;
+		return;
+	}
+	while (!it->node[d]->leaf) {
+		lbtnode *y = it->node[d]->sub[it->pos[d]].kid;
+		d++;
+		it->node[d] = y;
+		it->pos[d] = 0;
+	}
+	it->depth = d + 1;
+}
+
+/* Start at the first entry not less than k, or at the first entry if k
+ * is NULL */
+static void lbt_seek(lbtiter *it, int kind, lbtnode *x, lval *k) {
+	uint64_t p = k ? lbt_prefix(kind, k) : 0;
+	it->depth = 0;
+	while (x) {
+		int i = 0;
+		if (k) {
+			i = x->leaf ? lbt_rank(kind, x, p, k) : lbt_child(kind, x, p, k);
+		}
+		it->node[it->depth] = x;
+		it->pos[it->depth++] = i;
+		x = x->leaf ? NULL : x->sub[i].kid;
+	}
+	if (it->depth) { lbt_settle(it); }
+}
+
+/* current leaf and index, NULL at the end */
+static lbtnode * lbt_at(lbtiter *it, int *i) {
+	if (it->depth == 0) { return NULL; }
+	*i = it->pos[it->depth - 1];
+	return it->node[it->depth - 1];
+}
+
+static void lbt_next(lbtiter *it) {
+	it->pos[it->depth - 1]++;
+	lbt_settle(it);
+}
+
+/* a set member is its key, a map entry the pair {k v} */
+static lval * lbt_entry(lbtnode *x, int i) {
+	if (!x) { return lval_qexpr(); }
+	if (!x->sub[i].val) { return lval_copy(x->keys[i]); }
+	lval *p = lval_qexpr();
+	lval_add(p, lval_copy(x->keys[i]));
+	lval_add(p, lval_copy(x->sub[i].val));
+	return p;
+}
+
+/* Insert into s in place, consumes k and v */
+static void lval_sorted_put(lval *s, lval *k, lval *v) {
+	int kind = s->bkind = lbt_kind(k);
+	s->bmap = v != NULL;
+	uint64_t p = lbt_prefix(kind, k);
+	int added = 0;
+
+	lbtnode *root = s->broot ? lbt_own(s->broot) : lbtnode_new(1);
+	lbtnode *r = lbt_put(kind, root, p, k, v, &added);
+	if (r) {
+		lbtnode *x = lbtnode_new(0);
+		lbt_insert_at(x, 0, root->pre[0], lval_copy(root->keys[0]),
+			      (lbtsub){ .kid = root });
+		lbt_insert_at(x, 1, r->pre[0], lval_copy(r->keys[0]),
+			      (lbtsub){ .kid = r });
+		root = x;
+	}
+	s->broot = root;
+	s->bcount += added;
+}
+
+static int lval_sorted_eq(lval *x, lval *y) {
+	if (x->bcount != y->bcount) { return 0; }
+
+	lbtiter a, b;
+	lbtnode *na, *nb;
+	int i, j;
+	lbt_seek(&a, x->bkind, x->broot, NULL);
+	lbt_seek(&b, y->bkind, y->broot, NULL);
+	while ((na = lbt_at(&a, &i)) && (nb = lbt_at(&b, &j))) {
+		lval *va = na->sub[i].val, *vb = nb->sub[j].val;
+		if (!lval_eq(na->keys[i], nb->keys[j]) || !va != !vb
+		    || (va && !lval_eq(va, vb))) {
+			return 0;
+		}
+		lbt_next(&a);
+		lbt_next(&b);
+	}
+	return 1;
+}
+
+static uint64_t lval_sorted_hash(lval *v) {
+	uint64_t h = v->bcount;
+	lbtiter it;
+	lbtnode *x;
+	int i;
+	for (lbt_seek(&it, v->bkind, v->broot, NULL); (x = lbt_at(&it, &i)); lbt_next(&it)) {
+		h = lhash_mix(h) + lval_hash(x->keys[i]);
+		if (x->sub[i].val) { h += 31 * lval_hash(x->sub[i].val); }
+	}
+	return h;
+}
+
+static void lval_print_sorted(lval *v) {
+	lbtiter it;
+	lbtnode *x;
+	int i, first = 1;
+	printf("#sorted{");
+	for (lbt_seek(&it, v->bkind, v->broot, NULL); (x = lbt_at(&it, &i)); lbt_next(&it)) {
+		if (!first) { putchar(' '); }
+		first = 0;
+		lval *y = lbt_entry(x, i);
+		lval_print(y);
+		lval_del(y);
+	}
+	putchar('}');
+}
+
+/* key k of argument pos must match the keys of the map at argument 0 */
+#define LASSERT_SORTED_KEY(arg, pos, fn) \
+	LASSERT(arg, lbt_kind(arg->cell[pos]) \
+		&& (arg->cell[0]->bcount == 0 \
+		    || lbt_kind(arg->cell[pos]) == arg->cell[0]->bkind), \
+		"Function '%s' passed %s key for a sorted map of %s keys!", fn, \
+		ltype_name(arg->cell[pos]->type), \
+		arg->cell[0]->bkind == LBT_STR ? "String" : "Number")
+
+/* (sorted {k ...}) is a sorted set and (sorted {{k v} ...}) a sorted
+ * map. The keys must be ascending, the tree is built bottom up in
+ * linear time. */
+static lval * builtin_sorted(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "sorted");
+	LASSERT_QEXPR_AT(a, 0, "sorted");
+
+	lval *q = a->cell[0];
+	lval *prev = NULL;
+	int kind = LBT_NONE;
+	int map = q->count && q->cell[0]->type == LVAL_QEXPR;
+	for (int i = 0; i < q->count; i++) {
+		lval *k = q->cell[i];
+		LASSERT(a, (k->type == LVAL_QEXPR) == map,
+			"Function 'sorted' passed %s at %i in a sorted %s!",
+			map ? "a set member" : "a map entry", i + 1, map ? "map" : "set");
+		if (k->type == LVAL_QEXPR) {
+			LASSERT(a, k->count == 2,
+				"Function 'sorted' passed invalid pair %i! "
+				"Expected {key value}", i + 1);
+			k = k->cell[0];
+		}
+		LASSERT(a, lbt_kind(k),
+			"Function 'sorted' passed %s key at %i, expected %s or %s!",
+			ltype_name(k->type), i + 1, ltype_name(LVAL_NUM),
+			ltype_name(LVAL_STR));
+		LASSERT(a, !prev || lbt_kind(k) == kind,
+			"Function 'sorted' passed keys of different types!");
+		LASSERT(a, !prev || lbt_cmp(kind, prev, k) < 0,
+			"Function 'sorted' passed keys out of order at %i!", i + 1);
+		kind = lbt_kind(k);
+		prev = k;
+	}
+
+	lval *s = lval_sorted();
+	s->bkind = kind;
+	s->bmap = map;
+	s->bcount = q->count;
+	if (q->count == 0) {
+		lval_del(a);
+		return s;
+	}
+
+	/* leaves, filled evenly */
+	long n = q->count;
+	long m = (n + LBT_ORDER - 1) / LBT_ORDER;
+	lbtnode **level = malloc(sizeof(lbtnode *) * m);
+	for (long j = 0; j < m; j++) {
+		lbtnode *x = level[j] = lbtnode_new(1);
+		for (long i = n * j / m; i < n * (j + 1) / m; i++) {
+			lval *k = q->cell[i], *v = NULL;
+			if (k->type == LVAL_QEXPR) {
+				lval *p = lval_thaw(k);
+				k = lval_pop(p, 0);
+				v = lval_take(p, 0);
+			}
+			lbt_insert_at(x, x->n, lbt_prefix(kind, k), k,
+				      (lbtsub){ .val = v });
+		}
+	}
+	q->count = 0;
+
+	/* each level above from the one below, in place */
+	while (m > 1) {
+		long pm = (m + LBT_ORDER - 1) / LBT_ORDER;
+		for (long j = 0; j < pm; j++) {
+			lbtnode *x = lbtnode_new(0);
+			for (long i = m * j / pm; i < m * (j + 1) / pm; i++) {
+				lbtnode *y = level[i];
+				lbt_insert_at(x, x->n, y->pre[0], lval_copy(y->keys[0]),
+					      (lbtsub){ .kid = y });
+			}
+			level[j] = x;
+		}
+		m = pm;
+	}
+	s->broot = level[0];
+
+	free(level);
+	lval_del(a);
+	return s;
+}
+
+/* (sorted-put s k [v]) adds set member k or map entry k v */
+static lval * builtin_sorted_put(lenv *e, lval *a) {
+	LASSERT(a, a->count == 2 || a->count == 3,
+		"Function 'sorted-put' passed incorrect number of arguments! "
+		"Got %i, expected 2 or 3", a->count);
+	LASSERT_SORTED_AT(a, 0, "sorted-put");
+	LASSERT_SORTED_KEY(a, 1, "sorted-put");
+	LASSERT(a, a->cell[0]->bcount == 0 || (a->count == 3) == a->cell[0]->bmap,
+		"Function 'sorted-put' passed %s for a sorted %s!",
+		a->count == 3 ? "a value" : "no value", a->cell[0]->bmap ? "map" : "set");
+
+	lval *s = lval_pop(a, 0);
+	lval *k = lval_pop(a, 0);
+	lval_sorted_put(s, k, a->count ? lval_pop(a, 0) : NULL);
+	lval_del(a);
+	return s;
+}
+
+static lval * builtin_sorted_del(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "sorted-del");
+	LASSERT_SORTED_AT(a, 0, "sorted-del");
+	LASSERT_SORTED_KEY(a, 1, "sorted-del");
+
+	lval *s = lval_pop(a, 0);
+	lval *k = a->cell[0];
+	int i;
+	if (lbt_find(s->bkind, s->broot, k, &i)) {
+		lbtnode *root = s->broot = lbt_own(s->broot);
+		lbt_del(s->bkind, root, lbt_prefix(s->bkind, k), k);
+		s->bcount--;
+
+		/* drop roots with one child */
+		while (!root->leaf && root->n == 1) {
+			s->broot = root->sub[0].kid;
+			s->broot->refs++;
+			lbtnode_release(root);
+			root = s->broot;
+		}
+		if (root->n == 0) {
+			lbtnode_release(root);
+			s->broot = NULL;
+		}
+	}
+
+	lval_del(a);
+	return s;
+}
+
+/* (sorted-get s k [default]) is the value of k, or k for a set */
+static lval * builtin_sorted_get(lenv *e, lval *a) {
+	LASSERT(a, a->count == 2 || a->count == 3,
+		"Function 'sorted-get' passed incorrect number of arguments! "
+		"Got %i, expected 2 or 3", a->count);
+	LASSERT_SORTED_AT(a, 0, "sorted-get");
+	LASSERT_SORTED_KEY(a, 1, "sorted-get");
+
+	int i;
+	lbtnode *x = lbt_find(a->cell[0]->bkind, a->cell[0]->broot, a->cell[1], &i);
+	lval *r;
+	if (x) {
+		r = lval_copy(x->sub[i].val ? x->sub[i].val : x->keys[i]);
+	} else if (a->count == 3) {
+		r = lval_pop(a, 2);
+	} else {
+		r = lval_err("Key not found in sorted map!");
+	}
+
+	lval_del(a);
+	return r;
+}
+
+static lval * builtin_sorted_has(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "sorted-has");
+	LASSERT_SORTED_AT(a, 0, "sorted-has");
+	LASSERT_SORTED_KEY(a, 1, "sorted-has");
+
+	int i;
+	lval *r = lval_bool(lbt_find(a->cell[0]->bkind, a->cell[0]->broot,
+				     a->cell[1], &i) != NULL);
+	lval_del(a);
+	return r;
+}
+
+static lval * builtin_sorted_count(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "sorted-count");
+	LASSERT_SORTED_AT(a, 0, "sorted-count");
+
+	lval *r = lval_num(a->cell[0]->bcount);
+	lval_del(a);
+	return r;
+}
+
+/* first or last entry, {} if s is empty */
+static lval * builtin_sorted_end(lenv *e, lval *a, char *fn, int last) {
+	LASSERT_COUNT(a, 1, fn);
+	LASSERT_SORTED_AT(a, 0, fn);
+
+	lval *s = a->cell[0];
+	lbtnode *x = NULL;
+	int i = 0;
+	if (s->broot && last) {
+		x = lbt_last(s->broot, &i);
+	} else if (s->broot) {
+		lbtiter it;
+		lbt_seek(&it, s->bkind, s->broot, NULL);
+		x = lbt_at(&it, &i);
+	}
+
+	lval *r = lbt_entry(x, i);
+	lval_del(a);
+	return r;
+}
+
+static lval * builtin_sorted_first(lenv *e, lval *a) {
+	return builtin_sorted_end(e, a, "sorted-first", 0);
+}
+
+static lval * builtin_sorted_last(lenv *e, lval *a) {
+	return builtin_sorted_end(e, a, "sorted-last", 1);
+}
+
+/* Nearest entry to k, {} if there is none: below k if down, and k
+ * itself unless strict */
+static lval * builtin_sorted_near(lenv *e, lval *a, char *fn, int down,
+				  int strict) {
+	LASSERT_COUNT(a, 2, fn);
+	LASSERT_SORTED_AT(a, 0, fn);
+	LASSERT_SORTED_KEY(a, 1, fn);
+
+	lval *s = a->cell[0];
+	lval *k = a->cell[1];
+	lbtnode *x = NULL;
+	int i = 0;
+	if (s->broot && down) {
+		x = lbt_floor(s->bkind, s->broot, lbt_prefix(s->bkind, k), k, strict, &i);
+	} else if (s->broot) {
+		lbtiter it;
+		lbt_seek(&it, s->bkind, s->broot, k);
+		x = lbt_at(&it, &i);
+		if (x && strict && lbt_cmp(s->bkind, x->keys[i], k) == 0) {
+			lbt_next(&it);
+			x = lbt_at(&it, &i);
+		}
+	}
+
+	lval *r = lbt_entry(x, i);
+	lval_del(a);
+	return r;
+}
+
+static lval * builtin_sorted_floor(lenv *e, lval *a) {
+	return builtin_sorted_near(e, a, "sorted-floor", 1, 0);
+}
+
+static lval * builtin_sorted_ceil(lenv *e, lval *a) {
+	return builtin_sorted_near(e, a, "sorted-ceil", 0, 0);
+}
+
+static lval * builtin_sorted_prev(lenv *e, lval *a) {
+	return builtin_sorted_near(e, a, "sorted-prev", 1, 1);
+}
+
+static lval * builtin_sorted_next(lenv *e, lval *a) {
+	return builtin_sorted_near(e, a, "sorted-next", 0, 1);
+}
+
+/* (sorted-range s lo hi) lists the entries from lo to hi inclusive */
+static lval * builtin_sorted_range(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 3, "sorted-range");
+	LASSERT_SORTED_AT(a, 0, "sorted-range");
+	LASSERT_SORTED_KEY(a, 1, "sorted-range");
+	LASSERT_SORTED_KEY(a, 2, "sorted-range");
+
+	lval *s = a->cell[0];
+	lval *hi = a->cell[2];
+	lval *r = lval_qexpr();
+	lbtiter it;
+	lbtnode *x;
+	int i;
+	for (lbt_seek(&it, s->bkind, s->broot, a->cell[1]);
+	     (x = lbt_at(&it, &i)) && lbt_cmp(s->bkind, x->keys[i], hi) <= 0;
+	     lbt_next(&it)) {
+		lval_add(r, lbt_entry(x, i));
+	}
+
+	lval_del(a);
+	return r;
+}
+
+static lval * builtin_sorted_list(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "sorted->list");
+	LASSERT_SORTED_AT(a, 0, "sorted->list");
+
+	lval *s = a->cell[0];
+	lval *r = lval_qexpr();
+	lbtiter it;
+	lbtnode *x;
+	int i;
+	for (lbt_seek(&it, s->bkind, s->broot, NULL); (x = lbt_at(&it, &i)); lbt_next(&it)) {
+		lval_add(r, lbt_entry(x, i));
+	}
+
+	lval_del(a);
+	return r;
+}
+
+
+/* Integer sets
+ *
+ * An integer set is a roaring bitmap: the upper 48 bits of a number
+ * select a container, which holds the low 16 bits as a sorted array of
+ * up to 4096 values, a bitmap of 65536 bits or a list of runs, whichever
+ * is smallest. Bitmaps are combined a vector at a time and arrays are
+ * intersected by comparing a block of them against 8 values at once,
+ * with AVX2 if the CPU supports it. Sets are persistent, containers are
+ * shared and copied before they are modified. */
+
+#define LRC_ARRAY_MAX 4096
+#define LRC_WORDS 1024
+
+enum { LRC_ARRAY, LRC_BITMAP, LRC_RUN };
+enum { LROAR_OR, LROAR_AND, LROAR_ANDNOT };
+
+static lrcont * lrc_new(int type, int cap) {
+	lrcont *c = calloc(1, sizeof(lrcont));
+	c->refs = 1;
+	c->type = type;
+	if (type == LRC_BITMAP) {
+		c->bits = calloc(LRC_WORDS, sizeof(uint64_t));
+	} else {
+		c->cap = cap > 4 ? cap : 4;
+		c->vals = malloc(sizeof(uint16_t) * c->cap);
+	}
+	return c;
+}
+
+static void lrc_release(lrcont *c) {
+	if (--c->refs > 0) { return; }
+	free(c->vals);
+	free(c->bits);
+	free(c);
+}
+
+/* Write the values of c to out in ascending order, returns how many */
+static int lrc_values(lrcont *c, uint16_t *out) {
+	int k = 0;
+	if (c->type == LRC_ARRAY) {
+		memcpy(out, c->vals, sizeof(uint16_t) * c->n);
+		return c->n;
+	}
+	if (c->type == LRC_RUN) {
+		for (int i = 0; i < c->n; i++) {
+			int end = c->vals[2 * i] + c->vals[2 * i + 1];
+			for (int x = c->vals[2 * i]; x <= end; x++) { out[k++] = x; }
+		}
+		return k;
+	}
+	for (int w = 0; w < LRC_WORDS; w++) {
+		for (uint64_t b = c->bits[w]; b; b &= b - 1) {
+			out[k++] = w * 64 + __builtin_ctzll(b);
+		}
+	}
+	return k;
+}
+
+/* Container of the n ascending values v in its smallest form */
+static lrcont * lrc_from(const uint16_t *v, int n) {
+	int runs = 0;
+	for (int i = 0; i < n; i++) { runs += i == 0 || v[i] != v[i - 1] + 1; }
+
+	lrcont *c;
+	if (4 * runs < (n <= LRC_ARRAY_MAX ? 2 * n : 8192)) {
+		c = lrc_new(LRC_RUN, 2 * runs);
+		for (int i = 0; i < n; i++) {
+			if (i == 0 || v[i] != v[i - 1] + 1) {
+				c->vals[2 * c->n] = v[i];
+				c->vals[2 * c->n + 1] = 0;
+				c->n++;
+			} else {
+				c->vals[2 * c->n - 1]++;
+			}
+		}
+	} else if (n <= LRC_ARRAY_MAX) {
+		c = lrc_new(LRC_ARRAY, n);
+		memcpy(c->vals, v, sizeof(uint16_t) * n);
+		c->n = n;
+	} else {
+		c = lrc_new(LRC_BITMAP, 0);
+		for (int i = 0; i < n; i++) { c->bits[v[i] >> 6] |= 1ULL << (v[i] & 63); }
+	}
+	c->card = n;
+	return c;
+}
+
+/* New array or bitmap container with the values of c */
+static lrcont * lrc_convert(lrcont *c, int type) {
+	lrcont *r = lrc_new(type, c->card);
+	if (type == LRC_ARRAY) {
+		r->n = r->card = lrc_values(c, r->vals);
+		return r;
+	}
+
+	uint16_t *v = malloc(sizeof(uint16_t) * c->card);
+	r->card = lrc_values(c, v);
+	for (int i = 0; i < r->card; i++) { r->bits[v[i] >> 6] |= 1ULL << (v[i] & 63); }
+	free(v);
+	return r;
+}
+
+/* c as an array or a bitmap, a new reference */
+static lrcont * lrc_flat(lrcont *c) {
+	if (c->type != LRC_RUN) {
+		c->refs++;
+		return c;
+	}
+	return lrc_convert(c, c->card <= LRC_ARRAY_MAX ? LRC_ARRAY : LRC_BITMAP);
+}
+
+/* Bitmap c in its smallest form, consumes c */
+static lrcont * lrc_shrink(lrcont *c) {
+	/* a run starts at each set bit whose lower neighbour is clear */
+	int runs = 0;
+	uint64_t carry = 0;
+	for (int w = 0; w < LRC_WORDS; w++) {
+		uint64_t b = c->bits[w];
+		runs += __builtin_popcountll(b & ~((b << 1) | carry));
+		carry = b >> 63;
+	}
+	if (c->card > LRC_ARRAY_MAX && 4 * runs >= 8192) { return c; }
+
+	uint16_t *v = malloc(sizeof(uint16_t) * c->card);
+	lrcont *r = lrc_from(v, lrc_values(c, v));
+	free(v);
+	lrc_release(c);
+	return r;
+}
+
+static int lrc_has(lrcont *c, uint16_t x) {
+	if (c->type == LRC_BITMAP) { return (c->bits[x >> 6] >> (x & 63)) & 1; }
+
+	/* the last value or run start not above x */
+	int step = c->type == LRC_RUN ? 2 : 1;
+	int lo = 0, hi = c->n;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (c->vals[mid * step] <= x) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) { return 0; }
+	int i = (lo - 1) * step;
+	return step == 1 ? c->vals[i] == x : x - c->vals[i] <= c->vals[i + 1];
+}
+
+/* Add x to the unshared container c, returns c or its replacement */
+static lrcont * lrc_add(lrcont *c, uint16_t x) {
+	if (lrc_has(c, x)) { return c; }
+
+	/* runs are not updated in place, full arrays become bitmaps */
+	if (c->type == LRC_RUN || c->n == LRC_ARRAY_MAX) {
+		lrcont *r = lrc_convert(c, c->card < LRC_ARRAY_MAX ? LRC_ARRAY : LRC_BITMAP);
+		lrc_release(c);
+		c = r;
+	}
+
+	if (c->type == LRC_BITMAP) {
+		c->bits[x >> 6] |= 1ULL << (x & 63);
+	} else {
+		int i = 0;
+		while (i < c->n && c->vals[i] < x) { i++; }
+		if (c->n == c->cap) {
+			c->cap *= 2;
+			c->vals = realloc(c->vals, sizeof(uint16_t) * c->cap);
+		}
+		memmove(&c->vals[i + 1], &c->vals[i], sizeof(uint16_t) * (c->n - i));
+		c->vals[i] = x;
+		c->n++;
+	}
+	c->card++;
+	return c;
+}
+
+#ifdef LVEC_X86
+LVEC_AVX2_POPCNT static int lrc_bits_avx2(int op, uint64_t *r, const uint64_t *a,
+					   const uint64_t *b) {
+	int card = 0;
+	for (int i = 0; i < LRC_WORDS; i += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+		__m256i z = op == LROAR_OR ? _mm256_or_si256(x, y)
+			: op == LROAR_AND ? _mm256_and_si256(x, y)
+			: _mm256_andnot_si256(y, x);
+		_mm256_storeu_si256((__m256i *)(r + i), z);
+		card += __builtin_popcountll(r[i]) + __builtin_popcountll(r[i + 1])
+			+ __builtin_popcountll(r[i + 2]) + __builtin_popcountll(r[i + 3]);
+	}
+	return card;
+}
+
+/* Blocks of 16 values of a against 8 of b, returns the matches in out
+ * and where the scan stopped in *pi and *pj */
+LVEC_AVX2 static int lrc_inter_avx2(uint16_t *out, const uint16_t *a, int na,
+				    const uint16_t *b, int nb, int *pi, int *pj) {
+	int i = 0, j = 0, k = 0;
+	while (i + 16 <= na && j + 8 <= nb) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i m = _mm256_setzero_si256();
+		for (int t = 0; t < 8; t++) {
+			m = _mm256_or_si256(m, _mm256_cmpeq_epi16(va, _mm256_set1_epi16(b[j + t])));
+		}
+		uint32_t mask = _mm256_movemask_epi8(m) & 0x55555555;
+		for (; mask; mask &= mask - 1) { out[k++] = a[i + __builtin_ctz(mask) / 2]; }
+
+		uint16_t amax = a[i + 15], bmax = b[j + 7];
+		i += amax <= bmax ? 16 : 0;
+		j += bmax <= amax ? 8 : 0;
+	}
+	*pi = i;
+	*pj = j;
+	return k;
+}
+#endif
+
+/* r = a op b for two bitmaps, returns the number of bits set in r */
+static int lrc_bits(int op, uint64_t *r, const uint64_t *a, const uint64_t *b) {
+	int card = 0;
+	int i = 0;
+#ifdef LVEC_X86
+	if (lvec_avx2) { return lrc_bits_avx2(op, r, a, b); }
+	for (; i < LRC_WORDS; i += 2) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i z = op == LROAR_OR ? _mm_or_si128(x, y)
+			: op == LROAR_AND ? _mm_and_si128(x, y)
+			: _mm_andnot_si128(y, x);
+		_mm_storeu_si128((__m128i *)(r + i), z);
+		card += __builtin_popcountll(r[i]) + __builtin_popcountll(r[i + 1]);
+	}
+#endif
+	for (; i < LRC_WORDS; i++) {
+		r[i] = op == LROAR_OR ? a[i] | b[i] : op == LROAR_AND ? a[i] & b[i] : a[i] & ~b[i];
+		card += __builtin_popcountll(r[i]);
+	}
+	return card;
+}
+
+/* Values in both of the ascending arrays a and b. Blocks of a are
+ * compared against 8 values of b at once, then the block with the
+ * smaller last value is moved on. */
+static int lrc_inter(uint16_t *out, const uint16_t *a, int na,
+		     const uint16_t *b, int nb) {
+	int i = 0, j = 0, k = 0;
+#ifdef LVEC_X86
+	if (lvec_avx2) { k = lrc_inter_avx2(out, a, na, b, nb, &i, &j); }
+	while (i + 8 <= na && j + 8 <= nb) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i m = _mm_setzero_si128();
+		for (int t = 0; t < 8; t++) {
+			m = _mm_or_si128(m, _mm_cmpeq_epi16(va, _mm_set1_epi16(b[j + t])));
+		}
+		unsigned mask = _mm_movemask_epi8(m) & 0x5555;
+		for (; mask; mask &= mask - 1) { out[k++] = a[i + __builtin_ctz(mask) / 2]; }
+
+		uint16_t amax = a[i + 7], bmax = b[j + 7];
+		i += amax <= bmax ? 8 : 0;
+		j += bmax <= amax ? 8 : 0;
+	}
+#endif
+	while (i < na && j < nb) {
+		if (a[i] < b[j]) {
+			i++;
+		} else if (b[j] < a[i]) {
+			j++;
+		} else {
+			out[k++] = a[i++];
+			j++;
+		}
+	}
+	return k;
+}
+
+/* Union or difference of the ascending arrays a and b */
+static int lrc_merge(int op, uint16_t *out, const uint16_t *a, int na,
+		     const uint16_t *b, int nb) {
+	int i = 0, j = 0, k = 0;
+	while (i < na && j < nb) {
+		if (a[i] < b[j]) {
+			out[k++] = a[i++];
+		} else if (b[j] < a[i]) {
+			if (op == LROAR_OR) { out[k++] = b[j]; }
+			j++;
+		} else {
+			if (op == LROAR_OR) { out[k++] = a[i]; }
+			i++;
+			j++;
+		}
+	}
+	while (i < na) { out[k++] = a[i++]; }
+	while (op == LROAR_OR && j < nb) { out[k++] = b[j++]; }
+	return k;
+}
+
+/* a op b, NULL if it is empty */
+static lrcont * lrc_op(int op, lrcont *a, lrcont *b) {
+	a = lrc_flat(a);
+	b = lrc_flat(b);
+
+	/* the array first, unless it is taken from a bitmap */
+	if (op != LROAR_ANDNOT && a->type == LRC_BITMAP && b->type == LRC_ARRAY) {
+		lrcont *t = a;
+		a = b;
+		b = t;
+	}
+
+	lrcont *r = NULL;
+	if (a->type == LRC_BITMAP && b->type == LRC_BITMAP) {
+		r = lrc_new(LRC_BITMAP, 0);
+		r->card = lrc_bits(op, r->bits, a->bits, b->bits);
+	} else if (a->type == LRC_ARRAY && b->type == LRC_ARRAY) {
+		uint16_t *v = malloc(sizeof(uint16_t) * (a->n + b->n));
+		int n = op == LROAR_AND ? lrc_inter(v, a->vals, a->n, b->vals, b->n)
+			: lrc_merge(op, v, a->vals, a->n, b->vals, b->n);
+		r = n ? lrc_from(v, n) : NULL;
+		free(v);
+	} else if (a->type == LRC_ARRAY && op != LROAR_OR) {
+		/* array and, or and not, bitmap */
+		uint16_t *v = malloc(sizeof(uint16_t) * a->n);
+		int n = 0;
+		for (int i = 0; i < a->n; i++) {
+			if (lrc_has(b, a->vals[i]) == (op == LROAR_AND)) { v[n++] = a->vals[i]; }
+		}
+		r = n ? lrc_from(v, n) : NULL;
+		free(v);
+	} else {
+		/* array or bitmap, bitmap and not array */
+		lrcont *m = a->type == LRC_BITMAP ? a : b;
+		lrcont *x = a->type == LRC_BITMAP ? b : a;
+		r = lrc_new(LRC_BITMAP, 0);
+		memcpy(r->bits, m->bits, sizeof(uint64_t) * LRC_WORDS);
+		r->card = m->card;
+		for (int i = 0; i < x->n; i++) {
+			uint16_t v = x->vals[i];
+			uint64_t bit = 1ULL << (v & 63);
+			int set = (r->bits[v >> 6] & bit) != 0;
+			if (op == LROAR_OR && !set) {
+				r->bits[v >> 6] |= bit;
+				r->card++;
+			} else if (op == LROAR_ANDNOT && set) {
+				r->bits[v >> 6] &= ~bit;
+				r->card--;
+			}
+		}
+	}
+
+	lrc_release(a);
+	lrc_release(b);
+	if (r && r->type == LRC_BITMAP) {
+		if (r->card == 0) {
+			lrc_release(r);
+			return NULL;
+		}
+		r = lrc_shrink(r);
+	}
+	return r;
+}
+
+static lroar * lroar_new(void) {
+	lroar *s = calloc(1, sizeof(lroar));
+	s->refs = 1;
+	return s;
+}
+
+static void lroar_release(lroar *s) {
+	if (--s->refs > 0) { return; }
+	for (long i = 0; i < s->n; i++) { lrc_release(s->conts[i]); }
+	free(s->keys);
+	free(s->conts);
+	free(s);
+}
+
+/* Insert container c with key k at position i, takes the reference */
+static void lroar_insert(lroar *s, long i, int64_t k, lrcont *c) {
+	if (s->n == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 4;
+		s->keys = realloc(s->keys, sizeof(int64_t) * s->cap);
+		s->conts = realloc(s->conts, sizeof(lrcont *) * s->cap);
+	}
+	memmove(&s->keys[i + 1], &s->keys[i], sizeof(int64_t) * (s->n - i));
+	memmove(&s->conts[i + 1], &s->conts[i], sizeof(lrcont *) * (s->n - i));
+	s->keys[i] = k;
+	s->conts[i] = c;
+	s->card += c->card;
+	s->n++;
+}
+
+/* s if it is not shared, otherwise a copy sharing its containers */
+static lroar * lroar_own(lroar *s) {
+	if (s->refs == 1) { return s; }
+	lroar *r = lroar_new();
+	for (long i = 0; i < s->n; i++) {
+		s->conts[i]->refs++;
+		lroar_insert(r, i, s->keys[i], s->conts[i]);
+	}
+	s->refs--;
+	return r;
+}
+
+/* position of the first container with a key not less than k */
+static long lroar_find(lroar *s, int64_t k) {
+	long lo = 0, hi = s->n;
+	while (lo < hi) {
+		long mid = (lo + hi) / 2;
+		if (s->keys[mid] < k) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static int lroar_has(lroar *s, long x) {
+	long i = lroar_find(s, x >> 16);
+	return i < s->n && s->keys[i] == x >> 16 && lrc_has(s->conts[i], x & 0xffff);
+}
+
+/* Add x to the unshared set s */
+static void lroar_add(lroar *s, long x) {
+	int64_t k = x >> 16;
+	long i = lroar_find(s, k);
+	if (i == s->n || s->keys[i] != k) {
+		lroar_insert(s, i, k, lrc_new(LRC_ARRAY, 0));
+	} else if (lrc_has(s->conts[i], x & 0xffff)) {
+		return;
+	}
+
+	lrcont *c = s->conts[i];
+	if (c->refs > 1) {
+		lrcont *r = lrc_convert(c, c->type == LRC_BITMAP || c->card >= LRC_ARRAY_MAX
+					? LRC_BITMAP : LRC_ARRAY);
+		lrc_release(c);
+		c = r;
+	}
+	s->card -= c->card;
+	s->conts[i] = c = lrc_add(c, x & 0xffff);
+	s->card += c->card;
+}
+
+static lroar * lroar_op(int op, lroar *x, lroar *y) {
+	lroar *r = lroar_new();
+	long i = 0, j = 0;
+	while (i < x->n || j < y->n) {
+		int64_t kx = i < x->n ? x->keys[i] : INT64_MAX;
+		int64_t ky = j < y->n ? y->keys[j] : INT64_MAX;
+		if (kx < ky) {
+			if (op != LROAR_AND) {
+				x->conts[i]->refs++;
+				lroar_insert(r, r->n, kx, x->conts[i]);
+			}
+			i++;
+		} else if (ky < kx) {
+			if (op == LROAR_OR) {
+				y->conts[j]->refs++;
+				lroar_insert(r, r->n, ky, y->conts[j]);
+			}
+			j++;
+		} else {
+			lrcont *c = lrc_op(op, x->conts[i], y->conts[j]);
+			if (c) { lroar_insert(r, r->n, kx, c); }
+			i++;
+			j++;
+		}
+	}
+	return r;
+}
+
+static long lroar_value(int64_t k, uint16_t v) {
+	return (long)(((uint64_t)k << 16) | v);
+}
+
+static int lroar_eq(lroar *x, lroar *y) {
+	if (x == y) { return 1; }
+	if (x->card != y->card || x->n != y->n) { return 0; }
+
+	uint16_t *a = NULL, *b = NULL;
+	int eq = 1;
+	for (long i = 0; eq && i < x->n; i++) {
+		lrcont *c = x->conts[i], *d = y->conts[i];
+		if (x->keys[i] != y->keys[i] || c->card != d->card) {
+			eq = 0;
+		} else if (c != d) {
+			if (!a) {
+				a = malloc(sizeof(uint16_t) * 65536);
+				b = malloc(sizeof(uint16_t) * 65536);
+			}
+			int n = lrc_values(c, a);
+			lrc_values(d, b);
+			eq = memcmp(a, b, sizeof(uint16_t) * n) == 0;
+		}
+	}
+	free(a);
+	free(b);
+	return eq;
+}
+
+static uint64_t lroar_hash(lroar *s) {
+	uint64_t h = s->card;
+	uint16_t *v = malloc(sizeof(uint16_t) * 65536);
+	for (long i = 0; i < s->n; i++) {
+		int n = lrc_values(s->conts[i], v);
+		h = lhash_mix(h ^ s->keys[i]);
+		for (int j = 0; j < n; j++) { h = lhash_mix(h + v[j]); }
+	}
+	free(v);
+	return h;
+}
+
+/* Calls f for each value of s in ascending order */
+static void lroar_each(lroar *s, void (*f)(long, void *), void *ctx) {
+	uint16_t *v = malloc(sizeof(uint16_t) * 65536);
+	for (long i = 0; i < s->n; i++) {
+		int n = lrc_values(s->conts[i], v);
+		for (int j = 0; j < n; j++) { f(lroar_value(s->keys[i], v[j]), ctx); }
+	}
+	free(v);
+}
+
+static void lval_print_set_value(long x, void *first) {
+	if (!*(int *)first) { putchar(' '); }
+	*(int *)first = 0;
+	printf("%li", x);
+}
+
+static void lval_print_set(lval *v) {
+	int first = 1;
+	printf("#set{");
+	lroar_each(v->set, lval_print_set_value, &first);
+	putchar('}');
+}
+
+static void lroar_collect(long x, void *q) {
+	lval_add(q, lval_num(x));
+}
+
+static lval * lval_set(lroar *s) {
+	lval *v = malloc(sizeof(lval));
+	v->type = LVAL_SET;
+	v->set = s;
+	return v;
+}
+
+/* (set {x ...}) is the set of the numbers in a list */
+static lval * builtin_set(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "set");
+	LASSERT_QEXPR_AT(a, 0, "set");
+
+	lval *q = a->cell[0];
+	for (int i = 0; i < q->count; i++) {
+		LASSERT(a, q->cell[i]->type == LVAL_NUM,
+			"Function 'set' passed %s at %i, expected %s!",
+			ltype_name(q->cell[i]->type), i + 1, ltype_name(LVAL_NUM));
+	}
+
+	/* radix sort, then one container per run of equal upper bits */
+	long n = q->count;
+	lsort_item *items = malloc(sizeof(lsort_item) * (n + 1));
+	lsort_item *tmp = malloc(sizeof(lsort_item) * (n + 1));
+	for (long i = 0; i < n; i++) {
+		items[i].key = (uint64_t)q->cell[i]->num ^ (1ULL << 63);
+	}
+	lsort_radix(items, tmp, n);
+
+	lroar *s = lroar_new();
+	uint16_t *v = malloc(sizeof(uint16_t) * 65536);
+	int m = 0;
+	for (long i = 0; i < n; i++) {
+		long x = (long)(items[i].key ^ (1ULL << 63));
+		if (i == 0 || items[i].key != items[i - 1].key) { v[m++] = x & 0xffff; }
+		if (i + 1 == n || items[i + 1].key >> 16 != items[i].key >> 16) {
+			lroar_insert(s, s->n, x >> 16, lrc_from(v, m));
+			m = 0;
+		}
+	}
+
+	free(v);
+	free(items);
+	free(tmp);
+	lval_del(a);
+	return lval_set(s);
+}
+
+/* (set-add s x ...) */
+static lval * builtin_set_add(lenv *e, lval *a) {
+	LASSERT(a, a->count >= 2,
+		"Function 'set-add' passed incorrect number of arguments! "
+		"Got %i, expected at least 2", a->count);
+	LASSERT_SET_AT(a, 0, "set-add");
+	for (int i = 1; i < a->count; i++) { LASSERT_NUM_AT(a, i, "set-add"); }
+
+	lval *s = lval_pop(a, 0);
+	s->set = lroar_own(s->set);
+	for (int i = 0; i < a->count; i++) { lroar_add(s->set, a->cell[i]->num); }
+
+	lval_del(a);
+	return s;
+}
+
+static lval * builtin_set_has(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "set-has");
+	LASSERT_SET_AT(a, 0, "set-has");
+	LASSERT_NUM_AT(a, 1, "set-has");
+
+	lval *x = lval_bool(lroar_has(a->cell[0]->set, a->cell[1]->num));
+	lval_del(a);
+	return x;
+}
+
+static lval * builtin_set_card(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "set-card");
+	LASSERT_SET_AT(a, 0, "set-card");
+
+	lval *x = lval_num(a->cell[0]->set->card);
+	lval_del(a);
+	return x;
+}
+
+static lval * builtin_set_list(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "set->list");
+	LASSERT_SET_AT(a, 0, "set->list");
+
+	lval *x = lval_qexpr();
+	lroar_each(a->cell[0]->set, lroar_collect, x);
+	lval_del(a);
+	return x;
+}
+
+/* Combine the first set with each of the others in turn */
+static lval * builtin_set_op(lenv *e, lval *a, char *fn, int op) {
+	LASSERT(a, a->count >= 2,
+		"Function '%s' passed incorrect number of arguments! "
+		"Got %i, expected at least 2", fn, a->count);
+	for (int i = 0; i < a->count; i++) { LASSERT_SET_AT(a, i, fn); }
+
+	lroar *s = a->cell[0]->set;
+	s->refs++;
+	for (int i = 1; i < a->count; i++) {
+		lroar *r = lroar_op(op, s, a->cell[i]->set);
+		lroar_release(s);
+		s = r;
+	}
+
+	lval_del(a);
+	return lval_set(s);
+}
+
+static lval * builtin_set_union(lenv *e, lval *a) {
+	return builtin_set_op(e, a, "set-union", LROAR_OR);
+}
+
+static lval * builtin_set_inter(lenv *e, lval *a) {
+	return builtin_set_op(e, a, "set-inter", LROAR_AND);
+}
+
+static lval * builtin_set_diff(lenv *e, lval *a) {
+	return builtin_set_op(e, a, "set-diff", LROAR_ANDNOT);
+}
+
+
+/* Byte buffers
+ *
+ * Bytes are a view of vlen bytes into a reference counted lbuf, like
+ * vectors: slices share the buffer and files are mapped, not read.
+ * pack and unpack convert between values and binary records laid out
+ * by a format of fields:
+ *
+ *   b B  signed and unsigned 8 bit integers    h H  16 bit
+ *   i I  32 bit                                 q Q  64 bit
+ *   f d  32 and 64 bit floats                   x    a pad byte
+ *   s    a string, NUL padded to the field count
+ *
+ * A count repeats a field, "4i" is four integers, but "8s" is a single
+ * 8 byte string. < and > select little (the default) or big endian
+ * for the fields after them. */
+
+typedef struct {
+	char code;
+	int big;
+	int size;
+	long count;
+} lpack_field;
+
+static lval * lval_bytes(lbuf *b, void *data, long len) {
+	lval *v = malloc(sizeof(lval));
+	v->type = LVAL_BYTES;
+	v->vtype = LVEC_INT;
+	v->vbuf = b;
+	v->vdata = data;
+	v->vlen = len;
+	return v;
+}
+
+static int lpack_size(char c) {
+	switch (c) {
+	case 'b': case 'B': case 'x': case 's': return 1;
+	case 'h': case 'H': return 2;
+	case 'i': case 'I': case 'f': return 4;
+	case 'q': case 'Q': case 'd': return 8;
+	}
+	return 0;
+}
+
+/* Parse fmt into f, which has room for strlen(fmt) fields. Returns the
+ * number of fields or -1 if fmt is invalid, *size is the record size
+ * and *nvals the number of values in a record. Both are limited to
+ * INT_MAX, the values of a record are a Q-expression. */
+static int lpack_parse(const char *fmt, lpack_field *f, long *size, long *nvals) {
+	int n = 0, big = 0;
+	*size = 0;
+	*nvals = 0;
+	for (const char *p = fmt; *p; p++) {
+		if (*p == ' ') { continue; }
+		if (*p == '<' || *p == '>') {
+			big = *p == '>';
+			continue;
+		}
+
+		long count = 1;
+		if (*p >= '0' && *p <= '9') { count = strtol(p, (char **)&p, 10); }
+		if (!lpack_size(*p)) { return -1; }
+
+		f[n] = (lpack_field){ *p, big, lpack_size(*p), count };
+		long vals = *p == 's' ? 1 : *p == 'x' ? 0 : count;
+		if (count > (INT_MAX - *size) / f[n].size || vals > INT_MAX - *nvals) {
+			return -1;
+		}
+		*size += f[n].size * count;
+		*nvals += vals;
+		n++;
+	}
+	return n;
+}
+
+static uint64_t lpack_load(const unsigned char *p, int size, int big) {
+	uint64_t u = 0;
+	for (int i = 0; i < size; i++) {
+		u |= (uint64_t)p[big ? size - 1 - i : i] << (8 * i);
+	}
+	return u;
+}
+
+static void lpack_store(unsigned char *p, uint64_t u, int size, int big) {
+	for (int i = 0; i < size; i++) {
+		p[big ? size - 1 - i : i] = (unsigned char)(u >> (8 * i));
+	}
+}
+
+static lval * lpack_value(lpack_field *f, const unsigned char *p) {
+	uint64_t u = lpack_load(p, f->size, f->big);
+	int shift = 64 - 8 * f->size;
+	uint32_t w;
+	float x;
+	double d;
+	lbig b;
+
+	switch (f->code) {
+	case 'f':
+		w = (uint32_t)u;
+		memcpy(&x, &w, sizeof(x));
+		return lval_float(x);
+	case 'd':
+		memcpy(&d, &u, sizeof(d));
+		return lval_float(d);
+	case 'b': case 'h': case 'i': case 'q':
+		/* sign extend */
+		return lval_num((long)((int64_t)(u << shift) >> shift));
+	case 'Q':
+		if (u > LONG_MAX) {
+			lbig_init(&b, 2);
+			b.d[0] = (uint32_t)u;
+			b.d[1] = (uint32_t)(u >> 32);
+			return lval_big(&b);
+		}
+	}
+	return lval_num((long)u);
+}
+
+/* Decode the record at p into out, which has room for its values */
+static void lpack_unpack(lpack_field *f, int nf, const unsigned char *p, lval **out) {
+	for (int i = 0; i < nf; i++) {
+		if (f[i].code == 's') {
+			long n = f[i].count;
+			while (n > 0 && p[n - 1] == '\0') { n--; }
+			lstr *s = lstr_new(n);
+			memcpy(s->data, p, n);
+			*out++ = lval_str_lstr(s);
+			p += f[i].count;
+			continue;
+		}
+		for (long j = 0; j < f[i].count; j++, p += f[i].size) {
+			if (f[i].code != 'x') { *out++ = lpack_value(&f[i], p); }
+		}
+	}
+}
+
+/* Encode the values of q as a record at p. Returns an error or NULL. */
+static lval * lpack_pack(lpack_field *f, int nf, lval *q, unsigned char *p) {
+	int k = 0;
+	for (int i = 0; i < nf; i++) {
+		char c = f[i].code;
+		if (c == 's') {
+			lval *v = q->cell[k++];
+			if (v->type != LVAL_STR) {
+				return lval_err("Function 'pack' passed %s for field 's' at %i, "
+						"expected %s!", ltype_name(v->type), k,
+						ltype_name(LVAL_STR));
+			}
+			size_t n = v->slen < (size_t)f[i].count ? v->slen : (size_t)f[i].count;
+			memcpy(p, lval_sdata(v), n);
+			memset(p + n, 0, f[i].count - n);
+			p += f[i].count;
+			continue;
+		}
+
+		for (long j = 0; j < f[i].count; j++, p += f[i].size) {
+			if (c == 'x') {
+				*p = 0;
+				continue;
+			}
+
+			lval *v = q->cell[k++];
+			if (c == 'f' || c == 'd') {
+				if (!lval_is_num(v)) {
+					return lval_err("Function 'pack' passed %s for field '%c' at %i, "
+							"expected a number!", ltype_name(v->type), c, k);
+				}
+				double d = lval_to_double(v);
+				float x = (float)d;
+				uint32_t w;
+				uint64_t u;
+				memcpy(&w, &x, sizeof(w));
+				memcpy(&u, &d, sizeof(u));
+				lpack_store(p, c == 'f' ? w : u, f[i].size, f[i].big);
+				continue;
+			}
+
+			/* integers must fit the field */
+			if (v->type != LVAL_NUM && v->type != LVAL_BIG) {
+				return lval_err("Function 'pack' passed %s for field '%c' at %i, "
+						"expected an integer!", ltype_name(v->type), c, k);
+			}
+			uint64_t u;
+			int bits = 8 * f[i].size;
+			int ok;
+			if (v->type == LVAL_NUM && c >= 'a') {
+				/* lower case codes are signed */
+				long x = v->num;
+				ok = bits == 64 || (x >= -(1L << (bits - 1)) && x < (1L << (bits - 1)));
+				u = (uint64_t)x;
+			} else if (v->type == LVAL_NUM) {
+				ok = v->num >= 0 && (bits == 64 || v->num < (1L << bits));
+				u = (uint64_t)v->num;
+			} else {
+				/* only a Q field holds numbers beyond a fixnum */
+				ok = v->type == LVAL_BIG && c == 'Q' && !v->big.neg
+					&& mag_norm(v->big.d, v->big.len) <= 2;
+				u = ok ? v->big.d[0] | (uint64_t)v->big.d[1] << 32 : 0;
+			}
+			if (!ok) {
+				return lval_err("Function 'pack' value %i does not fit field '%c'!",
+						k, c);
+			}
+			lpack_store(p, u, f[i].size, f[i].big);
+		}
+	}
+	return NULL;
+}
+
+/* Parse the format of argument 0 of a. Returns an error or NULL. */
+static lval * lpack_compile(lval *a, char *fn, lpack_field **f, int *nf,
+			    long *size, long *nvals) {
+	char *fmt = lval_cstr(a->cell[0]);
+	*f = malloc(sizeof(lpack_field) * (strlen(fmt) + 1));
+	*nf = lpack_parse(fmt, *f, size, nvals);
+	if (*nf >= 0) { return NULL; }
+	free(*f);
+	return lval_err("Function '%s' passed invalid format \"%s\"!", fn, fmt);
+}
+
+/* (bytes "text") or (bytes {b ...}) */
+static lval * builtin_bytes(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "bytes");
+	lval *x = a->cell[0];
+	LASSERT(a, x->type == LVAL_STR || x->type == LVAL_QEXPR,
+		"Function 'bytes' passed incorrect type for argument 1! "
+		"Got %s, expected %s or %s", ltype_name(x->type),
+		ltype_name(LVAL_STR), ltype_name(LVAL_QEXPR));
+
+	if (x->type == LVAL_STR) {
+		lbuf *b = lbuf_new(x->slen);
+		memcpy(b->data, lval_sdata(x), x->slen);
+		lval_del(a);
+		return lval_bytes(b, b->data, b->size);
+	}
+
+	for (int i = 0; i < x->count; i++) {
+		lval *y = x->cell[i];
+		LASSERT(a, y->type == LVAL_NUM && y->num >= 0 && y->num <= 255,
+			"Function 'bytes' element %i is not a byte!", i + 1);
+	}
+	lbuf *b = lbuf_new(x->count);
+	for (int i = 0; i < x->count; i++) { b->data[i] = (char)x->cell[i]->num; }
+	lval_del(a);
+	return lval_bytes(b, b->data, b->size);
+}
+
+/* (bytes-open path) maps a file */
+static lval * builtin_bytes_open(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "bytes-open");
+	LASSERT_STR_AT(a, 0, "bytes-open");
+
+	char *path = lval_cstr(a->cell[0]);
+	lbuf *b = lbuf_map(path, 0);
+	LASSERT(a, b != NULL, "Could not map '%s': %s", path, strerror(errno));
+
+	lval_del(a);
+	return lval_bytes(b, b->data, b->size);
+}
+
+static lval * builtin_bytes_len(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "bytes-len");
+	LASSERT_BYTES_AT(a, 0, "bytes-len");
+
+	lval *x = lval_num(a->cell[0]->vlen);
+	lval_del(a);
+	return x;
+}
+
+static lval * builtin_bytes_ref(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "bytes-ref");
+	LASSERT_BYTES_AT(a, 0, "bytes-ref");
+	LASSERT_NUM_AT(a, 1, "bytes-ref");
+
+	lval *v = a->cell[0];
+	long i = a->cell[1]->num;
+	LASSERT(a, 0 <= i && i < v->vlen,
+		"Function 'bytes-ref' passed invalid index! "
+		"Got %li, expected 0 to %li", i, v->vlen - 1);
+
+	lval *x = lval_num(((unsigned char *)v->vdata)[i]);
+	lval_del(a);
+	return x;
+}
+
+/* (bytes-slice b from to) shares the buffer of b */
+static lval * builtin_bytes_slice(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 3, "bytes-slice");
+	LASSERT_BYTES_AT(a, 0, "bytes-slice");
+	LASSERT_NUM_AT(a, 1, "bytes-slice");
+	LASSERT_NUM_AT(a, 2, "bytes-slice");
+
+	lval *v = a->cell[0];
+	long from = a->cell[1]->num;
+	long to = a->cell[2]->num;
+	LASSERT(a, 0 <= from && from <= to && to <= v->vlen,
+		"Function 'bytes-slice' passed invalid range! "
+		"Got %li to %li, expected 0 to %li", from, to, v->vlen);
+
+	v = lval_pop(a, 0);
+	v->vdata = (char *)v->vdata + from;
+	v->vlen = to - from;
+	lval_del(a);
+	return v;
+}
+
+static lval * builtin_bytes_str(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "bytes->str");
+	LASSERT_BYTES_AT(a, 0, "bytes->str");
+
+	lval *v = a->cell[0];
+	lstr *s = lstr_new(v->vlen);
+	memcpy(s->data, v->vdata, v->vlen);
+	lval_del(a);
+	return lval_str_lstr(s);
+}
+
+static lval * builtin_bytes_list(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "bytes->list");
+	LASSERT_BYTES_AT(a, 0, "bytes->list");
+
+	lval *v = a->cell[0];
+	const unsigned char *p = v->vdata;
+	lval *q = lval_qexpr();
+	q->count = v->vlen;
+	q->cell = malloc(sizeof(lval *) * v->vlen);
+	for (long i = 0; i < v->vlen; i++) { q->cell[i] = lval_num(p[i]); }
+	lval_del(a);
+	return q;
+}
+
+/* (pack fmt {x ...}) encodes one record */
+static lval * builtin_pack(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "pack");
+	LASSERT_STR_AT(a, 0, "pack");
+	LASSERT_QEXPR_AT(a, 1, "pack");
+
+	lpack_field *f;
+	int nf;
+	long size, nvals;
+	lval *err = lpack_compile(a, "pack", &f, &nf, &size, &nvals);
+	if (err) {
+		lval_del(a);
+		return err;
+	}
+	if (a->cell[1]->count != nvals) {
+		err = lval_err("Function 'pack' passed %i values, the format has %li!",
+			       a->cell[1]->count, nvals);
+		free(f);
+		lval_del(a);
+		return err;
+	}
+
+	lbuf *b = lbuf_new(size);
+	err = lpack_pack(f, nf, a->cell[1], (unsigned char *)b->data);
+	free(f);
+	lval_del(a);
+	if (err) {
+		lbuf_release(b);
+		return err;
+	}
+	return lval_bytes(b, b->data, b->size);
+}
+
+/* (unpack fmt b [offset]) decodes the record at offset */
+static lval * builtin_unpack(lenv *e, lval *a) {
+	LASSERT(a, a->count == 2 || a->count == 3,
+		"Function 'unpack' passed incorrect number of arguments! "
+		"Got %i, expected 2 or 3", a->count);
+	LASSERT_STR_AT(a, 0, "unpack");
+	LASSERT_BYTES_AT(a, 1, "unpack");
+	if (a->count == 3) { LASSERT_NUM_AT(a, 2, "unpack"); }
+
+	lpack_field *f;
+	int nf;
+	long size, nvals;
+	lval *err = lpack_compile(a, "unpack", &f, &nf, &size, &nvals);
+	if (err) {
+		lval_del(a);
+		return err;
+	}
+
+	lval *v = a->cell[1];
+	long off = a->count == 3 ? a->cell[2]->num : 0;
+	if (off < 0 || size > v->vlen - off) {
+		err = lval_err("Function 'unpack' record of %li bytes at %li "
+			       "is outside of %li bytes!", size, off, v->vlen);
+		free(f);
+		lval_del(a);
+		return err;
+	}
+
+	lval *q = lval_qexpr();
+	q->count = nvals;
+	q->cell = malloc(sizeof(lval *) * nvals);
+	lpack_unpack(f, nf, (unsigned char *)v->vdata + off, q->cell);
+	free(f);
+	lval_del(a);
+	return q;
+}
+
+/* (unpack-all fmt b) decodes each whole record of b, a partial record
+ * at the end is left out */
+static lval * builtin_unpack_all(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 2, "unpack-all");
+	LASSERT_STR_AT(a, 0, "unpack-all");
+	LASSERT_BYTES_AT(a, 1, "unpack-all");
+
+	lpack_field *f;
+	int nf;
+	long size, nvals;
+	lval *err = lpack_compile(a, "unpack-all", &f, &nf, &size, &nvals);
+	if (err) {
+		lval_del(a);
+		return err;
+	}
+	if (size == 0) {
+		free(f);
+		lval_del(a);
+		return lval_err("Function 'unpack-all' passed an empty record format!");
+	}
+
+	lval *v = a->cell[1];
+	const unsigned char *p = v->vdata;
+	long n = v->vlen / size;
+	long chunk = 8 * LVEC_CHUNK, mark = 0;
+
+	lval *q = lval_qexpr();
+	q->count = n;
+	q->cell = malloc(sizeof(lval *) * n);
+	lbuf_stream(v->vbuf, p, p, p + (v->vlen < chunk ? v->vlen : chunk));
+	for (long r = 0; r < n; r++) {
+		long off = r * size;
+		if (off - mark >= chunk) {
+			long ahead = v->vlen - off < chunk ? v->vlen - off : chunk;
+			lbuf_stream(v->vbuf, p + mark, p + off, p + off + ahead);
+			mark = off;
+		}
+
+		lval *x = q->cell[r] = lval_qexpr();
+		x->count = nvals;
+		x->cell = malloc(sizeof(lval *) * nvals);
+		lpack_unpack(f, nf, p + off, x->cell);
+	}
+
+	free(f);
+	lval_del(a);
+	return q;
+}
+
+
+/* JSON
+ *
+ * json-parse reads a whole document in one pass without going through
+ * mpc. Objects become maps, arrays Q-expressions, strings, numbers and
+ * booleans the matching values and null the symbol null. Inside strings
+ * the bytes up to the next quote, backslash or control character are
+ * found a block at a time, so plain text is copied in one go. Object
+ * keys are interned, documents tend to repeat the same few keys.
+ * json-emit writes a value back as compact JSON, growing the string it
+ * returns in place. */
+
+#define LJSON_DEPTH 512
+
+typedef struct {
+	const char *p;
+	const char *start;
+	const char *end;
+	int depth;
+	const char *err;
+	char *buf;
+	size_t cap;
+} ljson;
+
+#ifdef LVEC_X86
+LVEC_AVX2 static const char * ljson_scan_avx2(const char *p, const char *end) {
+	__m256i quote = _mm256_set1_epi8('"');
+	__m256i slash = _mm256_set1_epi8('\\');
+	__m256i ctl = _mm256_set1_epi8(0x1f);
+	for (; end - p >= 32; p += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)p);
+		__m256i m = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(x, quote),
+					_mm256_cmpeq_epi8(x, slash)),
+			_mm256_cmpeq_epi8(_mm256_max_epu8(x, ctl), ctl));
+		unsigned mask = _mm256_movemask_epi8(m);
+		if (mask) { return p + __builtin_ctz(mask); }
+	}
+	return p;
+}
+#endif
+
+/* First quote, backslash or control character in [p, end), or end */
+static const char * ljson_scan(const char *p, const char *end) {
+#ifdef LVEC_X86
+	if (lvec_avx2) {
+		p = ljson_scan_avx2(p, end);
+	} else {
+		__m128i quote = _mm_set1_epi8('"');
+		__m128i slash = _mm_set1_epi8('\\');
+		__m128i ctl = _mm_set1_epi8(0x1f);
+		for (; end - p >= 16; p += 16) {
+			__m128i x = _mm_loadu_si128((const __m128i *)p);
+			__m128i m = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(x, quote),
+					     _mm_cmpeq_epi8(x, slash)),
+				_mm_cmpeq_epi8(_mm_max_epu8(x, ctl), ctl));
+			unsigned mask = _mm_movemask_epi8(m);
+			if (mask) { return p + __builtin_ctz(mask); }
+		}
+	}
+#endif
+	for (; p < end; p++) {
+		unsigned char c = *p;
+		if (c == '"' || c == '\\' || c < 0x20) { break; }
+	}
+	return p;
+}
+
+static void ljson_ws(ljson *j) {
+	const char *p = j->p;
+	while (p < j->end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) {
+		p++;
+	}
+	j->p = p;
+}
+
+static lval * ljson_fail(ljson *j, const char *err) {
+	j->err = err;
+	return NULL;
+}
+
+static void ljson_reserve(ljson *j, size_t n) {
+	if (n > j->cap) {
+		j->cap = 2 * n;
+		j->buf = realloc(j->buf, j->cap);
+	}
+}
+
+static int ljson_hex(const char *p) {
+	int x = 0;
+	for (int i = 0; i < 4; i++) {
+		char c = p[i];
+		x <<= 4;
+		if (c >= '0' && c <= '9')      { x |= c - '0'; }
+		else if (c >= 'a' && c <= 'f') { x |= c - 'a' + 10; }
+		else if (c >= 'A' && c <= 'F') { x |= c - 'A' + 10; }
+		else { return -1; }
+	}
+	return x;
+}
+
+static size_t ljson_utf8(char *o, unsigned long c) {
+	if (c < 0x80) {
+		o[0] = c;
+		return 1;
+	}
+	if (c < 0x800) {
+		o[0] = 0xc0 | (c >> 6);
+		o[1] = 0x80 | (c & 0x3f);
+		return 2;
+	}
+	if (c < 0x10000) {
+		o[0] = 0xe0 | (c >> 12);
+		o[1] = 0x80 | ((c >> 6) & 0x3f);
+		o[2] = 0x80 | (c & 0x3f);
+		return 3;
+	}
+	o[0] = 0xf0 | (c >> 18);
+	o[1] = 0x80 | ((c >> 12) & 0x3f);
+	o[2] = 0x80 | ((c >> 6) & 0x3f);
+	o[3] = 0x80 | (c & 0x3f);
+	return 4;
+}
+
+/* A string starting after its opening quote, keys are interned */
+static lval * ljson_string(ljson *j, int key) {
+	const char *p = j->p;
+	const char *q = ljson_scan(p, j->end);
+	size_t len = 0;
+
+	/* escapes are decoded into the scratch buffer, which is never
+	 * longer than the source text */
+	if (q < j->end && *q == '\\') {
+		for (;;) {
+			ljson_reserve(j, len + (q - p) + 4);
+			memcpy(j->buf + len, p, q - p);
+			len += q - p;
+			if (q == j->end) { return ljson_fail(j, "unterminated string"); }
+			if (*q == '"') { break; }
+			if (*q != '\\') { return ljson_fail(j, "control character in string"); }
+			if (j->end - q < 2) { return ljson_fail(j, "unterminated string"); }
+
+			char c = q[1];
+			q += 2;
+			switch (c) {
+			case '"':  j->buf[len++] = '"'; break;
+			case '\\': j->buf[len++] = '\\'; break;
+			case '/':  j->buf[len++] = '/'; break;
+			case 'b':  j->buf[len++] = '\b'; break;
+			case 'f':  j->buf[len++] = '\f'; break;
+			case 'n':  j->buf[len++] = '\n'; break;
+			case 'r':  j->buf[len++] = '\r'; break;
+			case 't':  j->buf[len++] = '\t'; break;
+			case 'u': {
+				int u = j->end - q >= 4 ? ljson_hex(q) : -1;
+				if (u < 0) { return ljson_fail(j, "invalid \\u escape"); }
+				q += 4;
+				unsigned long cp = u;
+				if (u >= 0xd800 && u <= 0xdbff) {
+					int lo = j->end - q >= 6 && q[0] == '\\' && q[1] == 'u'
+						? ljson_hex(q + 2) : -1;
+					if (lo < 0xdc00 || lo > 0xdfff) {
+						return ljson_fail(j, "unpaired surrogate in \\u escape");
+					}
+					q += 6;
+					cp = 0x10000 + ((u - 0xd800) << 10) + (lo - 0xdc00);
+				} else if (u >= 0xdc00 && u <= 0xdfff) {
+					return ljson_fail(j, "unpaired surrogate in \\u escape");
+				}
+				len += ljson_utf8(j->buf + len, cp);
+				break;
+			}
+			default:
+				return ljson_fail(j, "invalid escape in string");
+			}
+			p = q;
+			q = ljson_scan(p, j->end);
+		}
+		p = j->buf;
+	} else {
+		if (q == j->end) { return ljson_fail(j, "unterminated string"); }
+		if (*q != '"') { return ljson_fail(j, "control character in string"); }
+		len = q - p;
+	}
+	j->p = q + 1;
+
+	if (key) {
+		return lval_str_lstr(lstr_intern(p, len, lstr_hash_bytes(p, len)));
+	}
+	lstr *s = lstr_new(len);
+	memcpy(s->data, p, len);
+	return lval_str_lstr(s);
+}
+
+/* -?int(.digits)?([eE][+-]?digits)?, integers of more than 18 digits
+ * go through bignums, which demote again when they fit */
+static lval * ljson_number(ljson *j) {
+	const char *s = j->p, *p = s, *end = j->end;
+	int neg = 0;
+	if (p < end && *p == '-') { neg = 1; p++; }
+
+	const char *digits = p;
+	long x = 0;
+	while (p < end && *p >= '0' && *p <= '9') {
+		x = x * 10 + (*p - '0');
+		p++;
+		if (p - digits == 18) { break; }
+	}
+	while (p < end && *p >= '0' && *p <= '9') { p++; }
+	if (p == digits) { return ljson_fail(j, "invalid number"); }
+	if (*digits == '0' && p - digits > 1) {
+		return ljson_fail(j, "leading zero in number");
+	}
+	int integer = 1;
+
+	if (p < end && *p == '.') {
+		integer = 0;
+		const char *f = ++p;
+		while (p < end && *p >= '0' && *p <= '9') { p++; }
+		if (p == f) { return ljson_fail(j, "invalid number"); }
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		integer = 0;
+		p++;
+		if (p < end && (*p == '+' || *p == '-')) { p++; }
+		const char *f = p;
+		while (p < end && *p >= '0' && *p <= '9') { p++; }
+		if (p == f) { return ljson_fail(j, "invalid number"); }
+	}
+	j->p = p;
+
+	if (integer && p - digits <= 18) { return lval_num(neg ? -x : x); }
+
+	/* strtod and lbig_from_str want a NUL terminated copy */
+	ljson_reserve(j, p - s + 1);
+	memcpy(j->buf, s, p - s);
+	j->buf[p - s] = '\0';
+	if (!integer) { return lval_float(strtod(j->buf, NULL)); }
+	lbig b;
+	lbig_from_str(&b, j->buf);
+	return lval_big(&b);
+}
+
+static lval * ljson_value(ljson *j);
+
+static lval * ljson_array(ljson *j) {
+	lval *q = lval_qexpr();
+	long cap = 0;
+	ljson_ws(j);
+	if (j->p < j->end && *j->p == ']') {
+		j->p++;
+		return q;
+	}
+
+	for (;;) {
+		lval *x = ljson_value(j);
+		if (!x) {
+			lval_del(q);
+			return NULL;
+		}
+		if (q->count == cap) {
+			cap = cap ? 2 * cap : 8;
+			q->cell = realloc(q->cell, sizeof(lval *) * cap);
+		}
+		q->cell[q->count++] = x;
+
+		ljson_ws(j);
+		if (j->p < j->end && *j->p == ',') {
+			j->p++;
+			continue;
+		}
+		if (j->p < j->end && *j->p == ']') {
+			j->p++;
+			return q;
+		}
+		lval_del(q);
+		return ljson_fail(j, "expected ',' or ']'");
+	}
+}
+
+static lval * ljson_object(ljson *j) {
+	lval *m = lval_map(NULL, 0);
+	ljson_ws(j);
+	if (j->p < j->end && *j->p == '}') {
+		j->p++;
+		return m;
+	}
+
+	for (;;) {
+		ljson_ws(j);
+		if (j->p == j->end || *j->p != '"') {
+			lval_del(m);
+			return ljson_fail(j, "expected a string key");
+		}
+		j->p++;
+		lval *k = ljson_string(j, 1);
+		if (!k) {
+			lval_del(m);
+			return NULL;
+		}
+
+		ljson_ws(j);
+		if (j->p == j->end || *j->p != ':') {
+			lval_del(k);
+			lval_del(m);
+			return ljson_fail(j, "expected ':'");
+		}
+		j->p++;
+		lval *v = ljson_value(j);
+		if (!v) {
+			lval_del(k);
+			lval_del(m);
+			return NULL;
+		}
+		lval_map_put(m, k, v);
+
+		ljson_ws(j);
+		if (j->p < j->end && *j->p == ',') {
+			j->p++;
+			continue;
+		}
+		if (j->p < j->end && *j->p == '}') {
+			j->p++;
+			return m;
+		}
+		lval_del(m);
+		return ljson_fail(j, "expected ',' or '}'");
+	}
+}
+
+static int ljson_word(ljson *j, const char *w, size_t n) {
+	if ((size_t)(j->end - j->p) < n || memcmp(j->p, w, n) != 0) { return 0; }
+	j->p += n;
+	return 1;
+}
+
+static lval * ljson_value(ljson *j) {
+	ljson_ws(j);
+	if (j->p == j->end) { return ljson_fail(j, "unexpected end of input"); }
+
+	lval *x;
+	switch (*j->p) {
+	case '{':
+	case '[':
+		if (j->depth == LJSON_DEPTH) { return ljson_fail(j, "nesting too deep"); }
+		j->depth++;
+		x = *j->p++ == '{' ? ljson_object(j) : ljson_array(j);
+		j->depth--;
+		return x;
+	case '"':
+		j->p++;
+		return ljson_string(j, 0);
+	case 't':
+		if (ljson_word(j, "true", 4)) { return lval_bool(1); }
+		break;
+	case 'f':
+		if (ljson_word(j, "false", 5)) { return lval_bool(0); }
+		break;
+	case 'n':
+		if (ljson_word(j, "null", 4)) { return lval_sym("null"); }
+		break;
+	default:
+		if (*j->p == '-' || (*j->p >= '0' && *j->p <= '9')) {
+			return ljson_number(j);
+		}
+	}
+	return ljson_fail(j, "unexpected character");
+}
+
+/* (json-parse s) reads one JSON document from a string or bytes */
+static lval * builtin_json_parse(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "json-parse");
+	lval *s = a->cell[0];
+	LASSERT(a, s->type == LVAL_STR || s->type == LVAL_BYTES,
+		"Function 'json-parse' passed incorrect type for argument 1! "
+		"Got %s, expected %s or %s",
+		ltype_name(s->type), ltype_name(LVAL_STR), ltype_name(LVAL_BYTES));
+
+	ljson j = {0};
+	if (s->type == LVAL_STR) {
+		j.p = lval_sdata(s);
+		j.end = j.p + s->slen;
+	} else {
+		j.p = s->vdata;
+		j.end = j.p + s->vlen;
+	}
+	j.start = j.p;
+
+	lval *x = ljson_value(&j);
+	if (x) {
+		ljson_ws(&j);
+		if (j.p != j.end) {
+			lval_del(x);
+			x = ljson_fail(&j, "trailing characters");
+		}
+	}
+	if (!x) {
+		x = lval_err("Function 'json-parse' failed at byte %li: %s!",
+			     (long)(j.p - j.start), j.err);
+	}
+
+	free(j.buf);
+	lval_del(a);
+	return x;
+}
+
+/* Output grows an lstr in place, which becomes the result as it is */
+typedef struct {
+	lstr *s;
+	size_t cap;
+	lval *err;
+} ljout;
+
+static char * ljout_grow(ljout *o, size_t n) {
+	if (o->s->len + n > o->cap) {
+		while (o->s->len + n > o->cap) { o->cap *= 2; }
+		o->s = realloc(o->s, sizeof(lstr) + o->cap + 1);
+	}
+	char *p = o->s->data + o->s->len;
+	o->s->len += n;
+	return p;
+}
+
+static void ljout_put(ljout *o, const char *p, size_t n) {
+	memcpy(ljout_grow(o, n), p, n);
+}
+
+static void ljout_str(ljout *o, const char *p, size_t n) {
+	const char *end = p + n;
+	*ljout_grow(o, 1) = '"';
+	for (;;) {
+		const char *q = ljson_scan(p, end);
+		ljout_put(o, p, q - p);
+		if (q == end) { break; }
+
+		unsigned char c = *q;
+		char esc[8];
+		switch (c) {
+		case '"':  ljout_put(o, "\\\"", 2); break;
+		case '\\': ljout_put(o, "\\\\", 2); break;
+		case '\b': ljout_put(o, "\\b", 2); break;
+		case '\f': ljout_put(o, "\\f", 2); break;
+		case '\n': ljout_put(o, "\\n", 2); break;
+		case '\r': ljout_put(o, "\\r", 2); break;
+		case '\t': ljout_put(o, "\\t", 2); break;
+		default:
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			ljout_put(o, esc, 6);
+		}
+		p = q + 1;
+	}
+	*ljout_grow(o, 1) = '"';
+}
+
+/* Writes a number and returns 1, 0 for anything else. Floats which
+ * JSON cannot represent are an error. */
+static int ljout_num(ljout *o, lval *v) {
+	char buf[32];
+	switch (v->type) {
+	case LVAL_NUM:
+		ljout_put(o, buf, snprintf(buf, sizeof(buf), "%li", v->num));
+		return 1;
+	case LVAL_FLOAT:
+		if (!isfinite(v->fnum)) {
+			o->err = lval_err("Function 'json-emit' cannot encode %s!",
+					  v->fnum != v->fnum ? "nan" : "inf");
+			return 1;
+		}
+		lfloat_format(v->fnum, buf);
+		ljout_put(o, buf, strlen(buf));
+		return 1;
+	case LVAL_BIG: {
+		char *s = lbig_to_str(&v->big);
+		ljout_put(o, s, strlen(s));
+		free(s);
+		return 1;
+	}
+	default:
+		return 0;
+	}
+}
+
+static void ljout_value(ljout *o, lval *v);
+
+typedef struct {
+	ljout *o;
+	int first;
+} ljout_map;
+
+static void ljout_entry(lhleaf *l, void *ctx) {
+	ljout_map *m = ctx;
+	ljout *o = m->o;
+	if (o->err) { return; }
+	if (!m->first) { *ljout_grow(o, 1) = ','; }
+	m->first = 0;
+
+	lval *k = l->key;
+	if (k->type == LVAL_STR) {
+		ljout_str(o, lval_sdata(k), k->slen);
+	} else if (k->type == LVAL_SYM) {
+		ljout_str(o, k->sym, strlen(k->sym));
+	} else if (lval_is_num(k)) {
+		*ljout_grow(o, 1) = '"';
+		ljout_num(o, k);
+		*ljout_grow(o, 1) = '"';
+	} else {
+		o->err = lval_err("Function 'json-emit' cannot encode %s as an object key!",
+				  ltype_name(k->type));
+		return;
+	}
+	*ljout_grow(o, 1) = ':';
+	ljout_value(o, l->val);
+}
+
+static void ljout_value(ljout *o, lval *v) {
+	if (o->err || ljout_num(o, v)) { return; }
+
+	switch (v->type) {
+	case LVAL_BOOL:
+		if (v->b) { ljout_put(o, "true", 4); }
+		else      { ljout_put(o, "false", 5); }
+		return;
+	case LVAL_STR:
+		ljout_str(o, lval_sdata(v), v->slen);
+		return;
+	case LVAL_SYM:
+		if (strcmp(v->sym, "null") == 0) {
+			ljout_put(o, "null", 4);
+			return;
+		}
+		break;
+	case LVAL_QEXPR:
+	case LVAL_SEXPR:
+		*ljout_grow(o, 1) = '[';
+		for (int i = 0; i < v->count && !o->err; i++) {
+			if (i) { *ljout_grow(o, 1) = ','; }
+			ljout_value(o, v->cell[i]);
+		}
+		*ljout_grow(o, 1) = ']';
+		return;
+	case LVAL_MAP: {
+		ljout_map m = {o, 1};
+		*ljout_grow(o, 1) = '{';
+		if (v->hroot) { lhamt_each(v->hroot, ljout_entry, &m); }
+		*ljout_grow(o, 1) = '}';
+		return;
+	}
+	default:
+		break;
+	}
+	o->err = lval_err("Function 'json-emit' cannot encode %s!", ltype_name(v->type));
+}
+
+/* (json-emit v) is the compact JSON text of v */
+static lval * builtin_json_emit(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "json-emit");
+
+	ljout o = {lstr_new(64), 64, NULL};
+	o.s->len = 0;
+	ljout_value(&o, a->cell[0]);
+	lval_del(a);
+	if (o.err) {
+		free(o.s);
+		return o.err;
+	}
+
+	o.s = realloc(o.s, sizeof(lstr) + o.s->len + 1);
+	o.s->data[o.s->len] = '\0';
+	return lval_str_lstr(o.s);
+}
+
+
+/* CSV
+ *
+ * csv-fold folds a function over the rows of a CSV file without
+ * holding the file or a list of rows: the file is mapped, pages are
+ * dropped once they have been read, and each row is a Q-expression
+ * which only lives for the call. Unquoted fields are found by scanning
+ * a block of bytes at a time for the next comma, quote or line end.
+ * Fields which read as decimal numbers become fixnums, bignums or
+ * floats, everything else and all quoted fields stay strings. A quoted
+ * field which is not closed is an error. */
+
+typedef struct {
+	const char *p;
+	const char *end;
+	char *buf;
+	size_t cap;
+} lcsv;
+
+#ifdef LVEC_X86
+LVEC_AVX2 static const char * lcsv_scan_avx2(const char *p, const char *end) {
+	__m256i comma = _mm256_set1_epi8(',');
+	__m256i quote = _mm256_set1_epi8('"');
+	__m256i nl = _mm256_set1_epi8('\n');
+	__m256i cr = _mm256_set1_epi8('\r');
+	for (; end - p >= 32; p += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)p);
+		__m256i m = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(x, comma),
+					_mm256_cmpeq_epi8(x, quote)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(x, nl),
+					_mm256_cmpeq_epi8(x, cr)));
+		unsigned mask = _mm256_movemask_epi8(m);
+		if (mask) { return p + __builtin_ctz(mask); }
+	}
+	return p;
+}
+#endif
+
+/* First comma, quote or line end in [p, end), or end */
+static const char * lcsv_scan(const char *p, const char *end) {
+#ifdef LVEC_X86
+	if (lvec_avx2) {
+		p = lcsv_scan_avx2(p, end);
+	} else {
+		__m128i comma = _mm_set1_epi8(',');
+		__m128i quote = _mm_set1_epi8('"');
+		__m128i nl = _mm_set1_epi8('\n');
+		__m128i cr = _mm_set1_epi8('\r');
+		for (; end - p >= 16; p += 16) {
+			__m128i x = _mm_loadu_si128((const __m128i *)p);
+			__m128i m = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(x, comma),
+					     _mm_cmpeq_epi8(x, quote)),
+				_mm_or_si128(_mm_cmpeq_epi8(x, nl),
+					     _mm_cmpeq_epi8(x, cr)));
+			unsigned mask = _mm_movemask_epi8(m);
+			if (mask) { return p + __builtin_ctz(mask); }
+		}
+	}
+#endif
+	for (; p < end; p++) {
+		char c = *p;
+		if (c == ',' || c == '"' || c == '\n' || c == '\r') { break; }
+	}
+	return p;
+}
+
+/* Read one field into s and n, returns 1 if another field follows on
+ * the same row, 0 at the end of the row and -1 if a quoted field is not
+ * closed before the end of the input. A doubled quote inside a quoted
+ * field is decoded into the scratch buffer, other fields point into
+ * the input. */
+static int lcsv_field(lcsv *c, const char **s, size_t *n, int *quoted) {
+	const char *p = c->p, *end = c->end;
+	*quoted = p < end && *p == '"';
+
+	if (*quoted) {
+		size_t len = 0;
+		p++;
+		for (;;) {
+			const char *q = memchr(p, '"', end - p);
+			if (!q) { return -1; }
+			int twice = q + 1 < end && q[1] == '"';
+			if (len || twice) {
+				size_t m = q - p + twice;
+				if (len + m > c->cap) {
+					c->cap = 2 * (len + m);
+					c->buf = realloc(c->buf, c->cap);
+				}
+				memcpy(c->buf + len, p, m);
+				len += m;
+			}
+			if (twice) {
+				p = q + 2;
+				continue;
+			}
+			if (len) {
+				*s = c->buf;
+				*n = len;
+			} else {
+				*s = p;
+				*n = q - p;
+			}
+			p = q + 1;
+			break;
+		}
+		/* text between the closing quote and the delimiter is dropped */
+		while (p < end && *p != ',' && *p != '\n' && *p != '\r') { p++; }
+	} else {
+		/* a quote inside an unquoted field is just text */
+		const char *q = lcsv_scan(p, end);
+		while (q < end && *q == '"') { q = lcsv_scan(q + 1, end); }
+		*s = p;
+		*n = q - p;
+		p = q;
+	}
+
+	if (p < end && *p == ',') {
+		c->p = p + 1;
+		return 1;
+	}
+	if (p < end && *p == '\r') { p++; }
+	if (p < end && *p == '\n') { p++; }
+	c->p = p;
+	return 0;
+}
+
+/* Integers of up to 18 digits are read directly, longer ones become
+ * bignums and decimal fractions or exponents floats, anything else
+ * (hex, inf, nan, ...) is a string */
+static lval * lcsv_value(const char *s, size_t n, int quoted) {
+	if (!quoted && n > 0) {
+		size_t i = (*s == '-' || *s == '+'), j = i;
+		long x = 0;
+		while (j < n && s[j] >= '0' && s[j] <= '9') {
+			if (j - i < 18) { x = x * 10 + (s[j] - '0'); }
+			j++;
+		}
+		size_t digits = j - i;
+		int integer = 1;
+
+		if (j < n && s[j] == '.') {
+			integer = 0;
+			size_t f = ++j;
+			while (j < n && s[j] >= '0' && s[j] <= '9') { j++; }
+			digits += j - f;
+		}
+		if (digits && j < n && (s[j] == 'e' || s[j] == 'E')) {
+			integer = 0;
+			j++;
+			if (j < n && (s[j] == '+' || s[j] == '-')) { j++; }
+			size_t f = j;
+			while (j < n && s[j] >= '0' && s[j] <= '9') { j++; }
+			if (j == f) { digits = 0; }
+		}
+
+		if (digits && j == n) {
+			if (integer && digits <= 18) { return lval_num(*s == '-' ? -x : x); }
+
+			/* strtod and lbig_from_str want a NUL terminated copy */
+			size_t skip = *s == '+';
+			char *buf = malloc(n - skip + 1);
+			memcpy(buf, s + skip, n - skip);
+			buf[n - skip] = '\0';
+			lval *v;
+			if (integer) {
+				lbig b;
+				lbig_from_str(&b, buf);
+				v = lval_big(&b);
+			} else {
+				v = lval_float(strtod(buf, NULL));
+			}
+			free(buf);
+			return v;
+		}
+	}
+
+	lstr *t = lstr_new(n);
+	memcpy(t->data, s, n);
+	return lval_str_lstr(t);
+}
+
+static lval * lcsv_unclosed(lcsv *c, const char *base) {
+	return lval_err("Function 'csv-fold' found an unterminated quoted field "
+			"at byte %li!", (long)(c->p - base));
+}
+
+/* (csv-fold f z src) is (f (f z row1) row2) ... over all rows of src, a
+ * path or bytes. (csv-fold f z src {"a" "b"}) reads the first row as
+ * a header and passes only the fields of columns a and b, in that
+ * order; the other fields are skipped without being converted. */
+static lval * builtin_csv_fold(lenv *e, lval *a) {
+	LASSERT(a, a->count == 3 || a->count == 4,
+		"Function 'csv-fold' passed incorrect number of arguments! "
+		"Got %i, expected 3 or 4", a->count);
+	LASSERT_TYPE_AT(a, 0, LVAL_FUN, "csv-fold");
+	lval *src = a->cell[2];
+	LASSERT(a, src->type == LVAL_STR || src->type == LVAL_BYTES,
+		"Function 'csv-fold' passed incorrect type for argument 3! "
+		"Got %s, expected %s or %s",
+		ltype_name(src->type), ltype_name(LVAL_STR), ltype_name(LVAL_BYTES));
+
+	int ncols = 0;
+	if (a->count == 4) {
+		LASSERT_QEXPR_AT(a, 3, "csv-fold");
+		lval *cols = a->cell[3];
+		for (int i = 0; i < cols->count; i++) {
+			LASSERT(a, cols->cell[i]->type == LVAL_STR,
+				"Function 'csv-fold' passed a non string column name!");
+		}
+		ncols = cols->count;
+	}
+
+	lbuf *b;
+	const char *base;
+	size_t size;
+	if (src->type == LVAL_STR) {
+		char *path = lval_cstr(src);
+		b = lbuf_map(path, 0);
+		LASSERT(a, b != NULL, "Could not map '%s': %s", path, strerror(errno));
+		base = b->data;
+		size = b->size;
+	} else {
+		b = src->vbuf;
+		b->refs++;
+		base = src->vdata;
+		size = src->vlen;
+	}
+
+	lcsv c = { base, base + size, NULL, 0 };
+	const char *s;
+	size_t n;
+	int quoted, more;
+
+	/* want[i] is the position of header column i in a row, or -1 */
+	int *want = NULL, nwant = 0;
+	lval *err = NULL;
+	if (a->count == 4) {
+		lval *cols = a->cell[3];
+		int *found = calloc(ncols ? ncols : 1, sizeof(int));
+		more = c.p < c.end;
+		while (more > 0) {
+			more = lcsv_field(&c, &s, &n, &quoted);
+			if (more < 0) { break; }
+			want = realloc(want, sizeof(int) * (nwant + 1));
+			want[nwant] = -1;
+			for (int j = 0; j < ncols; j++) {
+				lval *k = cols->cell[j];
+				if (!found[j] && k->slen == n && memcmp(lval_sdata(k), s, n) == 0) {
+					want[nwant] = j;
+					found[j] = 1;
+					break;
+				}
+			}
+			nwant++;
+		}
+
+		if (more < 0) { err = lcsv_unclosed(&c, base); }
+		for (int j = 0; j < ncols && !err; j++) {
+			if (!found[j]) {
+				err = lval_err("Function 'csv-fold' found no column \"%s\"!",
+					       lval_cstr(cols->cell[j]));
+			}
+		}
+		free(found);
+	}
+
+	lval *f = a->cell[0];
+	lval *acc = lval_pop(a, 1);
+	long chunk = 8 * LVEC_CHUNK;
+	const char *mark = base;
+	lbuf_stream(b, base, base, base + (size < (size_t)chunk ? size : (size_t)chunk));
+	while (!err && c.p < c.end) {
+		if (*c.p == '\n' || *c.p == '\r') {
+			c.p++;
+			continue;
+		}
+
+		lval *row = lval_qexpr();
+		if (want) {
+			row->count = ncols;
+			row->cell = calloc(ncols ? ncols : 1, sizeof(lval *));
+		}
+		int col = 0;
+		do {
+			more = lcsv_field(&c, &s, &n, &quoted);
+			if (more < 0) { break; }
+			if (!want) {
+				lval_add(row, lcsv_value(s, n, quoted));
+			} else if (col < nwant && want[col] >= 0) {
+				row->cell[want[col]] = lcsv_value(s, n, quoted);
+			}
+			col++;
+		} while (more);
+		if (more < 0) {
+			lval_del(row);
+			err = lcsv_unclosed(&c, base);
+			break;
+		}
+
+		/* short rows leave selected columns empty */
+		for (int j = 0; j < row->count; j++) {
+			if (!row->cell[j]) { row->cell[j] = lval_str(""); }
+		}
+
+		acc = lval_apply2(e, f, acc, row);
+		if (acc->type == LVAL_ERR) { break; }
+
+		if (c.p - mark >= chunk) {
+			long ahead = c.end - c.p < chunk ? c.end - c.p : chunk;
+			lbuf_stream(b, mark, c.p, c.p + ahead);
+			mark = c.p;
+		}
+	}
+
+	if (err) {
+		lval_del(acc);
+		acc = err;
+	}
+	free(want);
+	free(c.buf);
+	lbuf_release(b);
+	lval_del(a);
+	return acc;
+}
+
+
+/* Regular expressions
+ *
+ * Patterns are compiled by mpc_re, which runs the regex grammar through
+ * mpc_parse and costs far more than a match, so compiled patterns are
+ * kept in a cache keyed on the pattern text which drops the least
+ * recently used one when full. Each pattern has three parsers built
+ * around the compiled regex: a match at the start of the input, a
+ * search for the first match and a scan for all matches, each a
+ * single pass over the input so ^ and $ keep their meaning. Matches
+ * are slices of the searched string. */
+
+#define LRE_CAP 64
+
+typedef struct lre lre;
+struct lre {
+	unsigned long hash;
+	char *pat;
+	mpc_parser_t *re;
+	mpc_parser_t *match;
+	mpc_parser_t *hit;
+	mpc_parser_t *find;
+	mpc_parser_t *all;
+	lre *prev;
+	lre *next;
+};
+
+/* most recently used first */
+static struct {
+	lre *head;
+	lre *tail;
+	int count;
+} lre_cache;
+
+typedef struct {
+	long pos;
+	long len;
+} lre_span;
+
+typedef struct {
+	long n;
+	lre_span s[];
+} lre_spans;
+
+/* Length of the latest match, a scan only takes matches which consume
+ * input or it would never move on */
+static long lre_last;
+
+static int lre_moved(char prev, char next) {
+	return lre_last > 0;
+}
+
+static mpc_val_t * lre_fold_skip(int n, mpc_val_t **xs) {
+	for (int i = 0; i < n; i++) { free(xs[i]); }
+	return NULL;
+}
+
+/* {state text state} to the span of the text */
+static mpc_val_t * lre_fold_span(int n, mpc_val_t **xs) {
+	lre_span *s = malloc(sizeof(lre_span));
+	s->pos = ((mpc_state_t *)xs[0])->pos;
+	s->len = ((mpc_state_t *)xs[2])->pos - s->pos;
+	lre_last = s->len;
+	for (int i = 0; i < n; i++) { free(xs[i]); }
+	return s;
+}
+
+static mpc_parser_t * lre_span_of(mpc_parser_t *re) {
+	return mpc_and(3, lre_fold_span, mpc_state(), re, mpc_state(), free, free);
+}
+
+static mpc_val_t * lre_fold_all(int n, mpc_val_t **xs) {
+	lre_spans *s = malloc(sizeof(lre_spans) + sizeof(lre_span) * n);
+	s->n = 0;
+	for (int i = 0; i < n; i++) {
+		if (xs[i]) {
+			s->s[s->n++] = *(lre_span *)xs[i];
+			free(xs[i]);
+		}
+	}
+	return s;
+}
+
+static void lre_free(lre *r) {
+	mpc_delete(r->match);
+	mpc_delete(r->find);
+	mpc_delete(r->all);
+	mpc_cleanup(2, r->hit, r->re);
+	free(r->pat);
+	free(r);
+}
+
+/* End of the regex starting at p, NULL if it is malformed. mpc_re
+ * reads many malformed patterns as literal text or as a parser which
+ * never matches, so pat is checked against its grammar first: groups
+ * and classes are closed, a class is not empty, a quantifier follows
+ * something to repeat and {n} has a count. */
+static const char * lre_check(const char *p) {
+	for (;;) {
+		while (*p && *p != '|' && *p != ')') {
+			if (*p == '(') {
+				p = lre_check(p + 1);
+				if (!p || *p != ')') { return NULL; }
+				p++;
+			} else if (*p == '[') {
+				p += p[1] == '^' ? 2 : 1;
+				if (*p == ']') { return NULL; }
+				while (*p && *p != ']') {
+					if (*p == '\\' && !*++p) { return NULL; }
+					p++;
+				}
+				if (!*p) { return NULL; }
+				p++;
+			} else if (*p == '*' || *p == '+' || *p == '?' || *p == '{') {
+				return NULL;
+			} else {
+				if (*p == '\\' && !*++p) { return NULL; }
+				p++;
+			}
+
+			if (*p == '*' || *p == '+' || *p == '?') {
+				p++;
+			} else if (*p == '{') {
+				const char *d = ++p;
+				while (*p >= '0' && *p <= '9') { p++; }
+				if (p == d || p - d > 9 || *p != '}') { return NULL; }
+				p++;
+			}
+		}
+		if (*p != '|') { return p; }
+		p++;
+	}
+}
+
+/* Compile pat, NULL if it is not a valid regex */
+static lre * lre_compile(const char *pat, unsigned long h) {
+	const char *end = lre_check(pat);
+	if (!end || *end) { return NULL; }
+	mpc_parser_t *re = mpc_define(mpc_new("regex"), mpc_re(pat));
+
+	lre *x = malloc(sizeof(lre));
+	x->hash = h;
+	x->pat = malloc(strlen(pat) + 1);
+	strcpy(x->pat, pat);
+	x->re = re;
+	x->match = lre_span_of(re);
+
+	/* first match: skip while there is none */
+	x->find = mpc_and(2, mpcf_snd_free,
+		mpc_many(lre_fold_skip,
+			 mpc_and(2, lre_fold_skip, mpc_not(re, free), mpc_any(), free)),
+		lre_span_of(re),
+		free);
+
+	/* all matches: a non empty match or a run without one */
+	x->hit = mpc_define(mpc_new("hit"), mpc_and(2, mpcf_fst_free,
+		lre_span_of(re), mpc_anchor(lre_moved), free));
+	x->all = mpc_many(lre_fold_all, mpc_or(2, x->hit,
+		mpc_many1(lre_fold_skip,
+			  mpc_and(2, lre_fold_skip, mpc_not(x->hit, free), mpc_any(), free))));
+	return x;
+}
+
+static void lre_unlink(lre *x) {
+	if (x->prev) { x->prev->next = x->next; } else { lre_cache.head = x->next; }
+	if (x->next) { x->next->prev = x->prev; } else { lre_cache.tail = x->prev; }
+}
+
+static void lre_push(lre *x) {
+	x->prev = NULL;
+	x->next = lre_cache.head;
+	if (lre_cache.head) { lre_cache.head->prev = x; } else { lre_cache.tail = x; }
+	lre_cache.head = x;
+}
+
+/* The compiled pattern, from the cache if possible */
+static lre * lre_get(const char *pat) {
+	unsigned long h = lstr_hash_bytes(pat, strlen(pat));
+	for (lre *x = lre_cache.head; x; x = x->next) {
+		if (x->hash == h && strcmp(x->pat, pat) == 0) {
+			lre_unlink(x);
+			lre_push(x);
+			return x;
+		}
+	}
+
+	lre *x = lre_compile(pat, h);
+	if (!x) { return NULL; }
+	if (lre_cache.count == LRE_CAP) {
+		lre *old = lre_cache.tail;
+		lre_unlink(old);
+		lre_free(old);
+		lre_cache.count--;
+	}
+	lre_push(x);
+	lre_cache.count++;
+	return x;
+}
+
+/* Run p over the text of string s. mpc takes strlen of string input for
+ * every character it consumes, a stream over the bytes avoids that. */
+static int lmpc_parse(const char *name, lval *s, mpc_parser_t *p, mpc_result_t *r) {
+	/* fmemopen may refuse an empty buffer */
+	FILE *f = s->slen ? fmemopen(lval_sdata(s), s->slen, "r") : NULL;
+	if (!f) { return mpc_parse(name, lval_cstr(s), p, r); }
+	int ok = mpc_parse_file(name, f, p, r);
+	fclose(f);
+	return ok;
+}
+
+static lval * lre_slice(lval *s, long pos, long len) {
+	lval *x = lval_str_lstr(s->str);
+	s->str->refs++;
+	x->soff = s->soff + pos;
+	x->slen = len;
+	return x;
+}
+
+enum { LRE_MATCH, LRE_FIND, LRE_ALL };
+
+static lval * lre_run(lval *a, char *fn, int mode) {
+	LASSERT_COUNT(a, 2, fn);
+	LASSERT_STR_AT(a, 0, fn);
+	LASSERT_STR_AT(a, 1, fn);
+
+	char *pat = lval_cstr(a->cell[0]);
+	lre *re = lre_get(pat);
+	LASSERT(a, re != NULL,
+		"Function '%s' passed invalid regex \"%s\"!", fn, pat);
+
+	lval *s = a->cell[1];
+	mpc_parser_t *p = mode == LRE_MATCH ? re->match
+		: mode == LRE_FIND ? re->find : re->all;
+	mpc_result_t r;
+	if (!lmpc_parse("<regex>", s, p, &r)) {
+		mpc_err_delete(r.error);
+		lval_del(a);
+		return lval_qexpr();
+	}
+
+	lval *x;
+	if (mode != LRE_ALL) {
+		lre_span *m = r.output;
+		x = lre_slice(s, m->pos, m->len);
+	} else {
+		lre_spans *m = r.output;
+		x = lval_qexpr();
+		x->count = m->n;
+		x->cell = malloc(sizeof(lval *) * m->n);
+		for (long i = 0; i < m->n; i++) {
+			x->cell[i] = lre_slice(s, m->s[i].pos, m->s[i].len);
+		}
+	}
+
+	free(r.output);
+	lval_del(a);
+	return x;
+}
+
+/* (re-match pat s) is the match of pat at the start of s, or {} */
+static lval * builtin_re_match(lenv *e, lval *a) {
+	return lre_run(a, "re-match", LRE_MATCH);
+}
+
+/* (re-find pat s) is the leftmost match of pat in s, or {} */
+static lval * builtin_re_find(lenv *e, lval *a) {
+	return lre_run(a, "re-find", LRE_FIND);
+}
+
+/* (re-find-all pat s) lists the non overlapping, non empty matches */
+static lval * builtin_re_find_all(lenv *e, lval *a) {
+	return lre_run(a, "re-find-all", LRE_ALL);
+}
+
+
+/* Grammars
+ *
+ * (grammar text) compiles rules written for mpca_lang, the way main
+ * builds the Lispy grammar, into a handle for parse-with. The rule
+ * names are read from the text, every "name :" at the top level, and
+ * passed to mpca_lang as its parsers. Compiled grammars are cached by
+ * their text, the cache and the handles share them by reference
+ * count. parse-with turns the syntax tree into nested Q-expressions
+ * {tag contents child ...} with an explicit stack, so deep trees do
+ * not use up the C stack. */
+
+#define LGRAMMAR_RULES 32
+#define LGRAMMAR_CAP 16
+
+/* most recently used first */
+static struct {
+	lgrammar *head;
+	lgrammar *tail;
+	int count;
+} lgrammar_cache;
+
+static void lgrammar_free_rules(mpc_parser_t **rules, int n) {
+	for (int i = 0; i < n; i++) { mpc_undefine(rules[i]); }
+	for (int i = 0; i < n; i++) { mpc_delete(rules[i]); }
+}
+
+static void lgrammar_release(lgrammar *g) {
+	if (--g->refs > 0) { return; }
+	lgrammar_free_rules(g->rules, g->n);
+	for (int i = 0; i < g->n; i++) { free(g->names[i]); }
+	free(g->names);
+	free(g->rules);
+	free(g->text);
+	free(g);
+}
+
+static int lgrammar_ident(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+		|| (c >= '0' && c <= '9') || c == '_';
+}
+
+static const char * lgrammar_space(const char *p) {
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') { p++; }
+	return p;
+}
+
+/* Skip a "string", 'char' or /regex/ literal starting at p */
+static const char * lgrammar_literal(const char *p) {
+	char close = *p++;
+	while (*p && *p != close) {
+		if (*p == '\\' && p[1]) { p++; }
+		p++;
+	}
+	return *p ? p + 1 : p;
+}
+
+/* Names of the rules defined in text: "name :" or "name "display" :"
+ * at the start of each statement. Returns the count, -1 with no names
+ * left allocated if there are more than LGRAMMAR_RULES. Malformed text
+ * stops the scan, mpca_lang reports the error. */
+static int lgrammar_names(const char *p, char **names) {
+	int n = 0;
+	for (;;) {
+		p = lgrammar_space(p);
+		const char *s = p;
+		while (lgrammar_ident(*p)) { p++; }
+		if (p == s) { return n; }
+		size_t len = p - s;
+
+		p = lgrammar_space(p);
+		if (*p == '"') { p = lgrammar_space(lgrammar_literal(p)); }
+		if (*p != ':') { return n; }
+
+		int seen = 0;
+		for (int i = 0; i < n && !seen; i++) {
+			seen = strlen(names[i]) == len && strncmp(names[i], s, len) == 0;
+		}
+		if (!seen) {
+			if (n == LGRAMMAR_RULES) {
+				for (int i = 0; i < n; i++) { free(names[i]); }
+				return -1;
+			}
+			names[n] = malloc(len + 1);
+			memcpy(names[n], s, len);
+			names[n][len] = '\0';
+			n++;
+		}
+
+		/* the body ends at the first ; outside a literal */
+		for (p++; *p && *p != ';'; ) {
+			if (*p == '"' || *p == '\'' || *p == '/') {
+				p = lgrammar_literal(p);
+			} else {
+				p++;
+			}
+		}
+		if (*p) { p++; }
+	}
+}
+
+/* The first <name> or <index> in text which is not one of the n rules,
+ * NULL if there is none. mpca_lang would only fail on it when the rule
+ * is used, and reads an index past the rules from beyond its varargs. */
+static char * lgrammar_undefined(const char *p, char **names, int n) {
+	static char ref[64];
+	while (*p) {
+		if (*p == '"' || *p == '\'' || *p == '/') {
+			p = lgrammar_literal(p);
+			continue;
+		}
+		if (*p++ != '<') { continue; }
+
+		const char *s = lgrammar_space(p);
+		const char *t = s;
+		while (lgrammar_ident(*t)) { t++; }
+		if (t == s || *lgrammar_space(t) != '>') { continue; }
+		size_t len = t - s;
+
+		int found = strspn(s, "0123456789") == len && len < 4
+			&& strtol(s, NULL, 10) < n;
+		for (int i = 0; i < n && !found; i++) {
+			found = strlen(names[i]) == len && strncmp(names[i], s, len) == 0;
+		}
+		if (!found) {
+			snprintf(ref, sizeof(ref), "%.*s", (int)len, s);
+			return ref;
+		}
+		p = t;
+	}
+	return NULL;
+}
+
+#define LGRAMMAR_ARGS4(r, i) r[i], r[i + 1], r[i + 2], r[i + 3]
+
+/* Compile text, on failure NULL with the reason in err */
+static lgrammar * lgrammar_compile(const char *text, unsigned long h, char **err) {
+	char **names = malloc(sizeof(char *) * LGRAMMAR_RULES);
+	int n = lgrammar_names(text, names);
+	if (n <= 0) {
+		for (int i = 0; i < n; i++) { free(names[i]); }
+		free(names);
+		*err = n < 0 ? "too many rules" : "no rules";
+		return NULL;
+	}
+	char *ref = lgrammar_undefined(text, names, n);
+	if (ref) {
+		static char msg[96];
+		snprintf(msg, sizeof(msg), "undefined rule <%s>", ref);
+		for (int i = 0; i < n; i++) { free(names[i]); }
+		free(names);
+		*err = msg;
+		return NULL;
+	}
+
+	/* mpca_lang takes the parsers as NULL terminated varargs */
+	mpc_parser_t *rules[LGRAMMAR_RULES] = {0};
+	for (int i = 0; i < n; i++) { rules[i] = mpc_new(names[i]); }
+	mpc_err_t *e = mpca_lang(MPCA_LANG_DEFAULT, text,
+		LGRAMMAR_ARGS4(rules, 0), LGRAMMAR_ARGS4(rules, 4),
+		LGRAMMAR_ARGS4(rules, 8), LGRAMMAR_ARGS4(rules, 12),
+		LGRAMMAR_ARGS4(rules, 16), LGRAMMAR_ARGS4(rules, 20),
+		LGRAMMAR_ARGS4(rules, 24), LGRAMMAR_ARGS4(rules, 28), NULL);
+	if (e) {
+		static char msg[512];
+		char *s = mpc_err_string(e);
+		snprintf(msg, sizeof(msg), "%s", s);
+		msg[strcspn(msg, "\n")] = '\0';
+		free(s);
+		mpc_err_delete(e);
+		lgrammar_free_rules(rules, n);
+		for (int i = 0; i < n; i++) { free(names[i]); }
+		free(names);
+		*err = msg;
+		return NULL;
+	}
+	for (int i = 0; i < n; i++) { mpc_optimise(rules[i]); }
+
+	lgrammar *g = malloc(sizeof(lgrammar));
+	g->refs = 1;
+	g->hash = h;
+	g->text = malloc(strlen(text) + 1);
+	strcpy(g->text, text);
+	g->n = n;
+	g->names = names;
+	g->rules = malloc(sizeof(mpc_parser_t *) * n);
+	memcpy(g->rules, rules, sizeof(mpc_parser_t *) * n);
+	return g;
+}
+
+static void lgrammar_unlink(lgrammar *x) {
+	if (x->prev) { x->prev->next = x->next; } else { lgrammar_cache.head = x->next; }
+	if (x->next) { x->next->prev = x->prev; } else { lgrammar_cache.tail = x->prev; }
+}
+
+static void lgrammar_push(lgrammar *x) {
+	x->prev = NULL;
+	x->next = lgrammar_cache.head;
+	if (lgrammar_cache.head) { lgrammar_cache.head->prev = x; } else { lgrammar_cache.tail = x; }
+	lgrammar_cache.head = x;
+}
+
+/* The compiled grammar with a new reference, from the cache if possible */
+static lgrammar * lgrammar_get(const char *text, char **err) {
+	unsigned long h = lstr_hash_bytes(text, strlen(text));
+	for (lgrammar *x = lgrammar_cache.head; x; x = x->next) {
+		if (x->hash == h && strcmp(x->text, text) == 0) {
+			lgrammar_unlink(x);
+			lgrammar_push(x);
+			x->refs++;
+			return x;
+		}
+	}
+
+	lgrammar *x = lgrammar_compile(text, h, err);
+	if (!x) { return NULL; }
+	if (lgrammar_cache.count == LGRAMMAR_CAP) {
+		lgrammar *old = lgrammar_cache.tail;
+		lgrammar_unlink(old);
+		lgrammar_release(old);
+		lgrammar_cache.count--;
+	}
+	lgrammar_push(x);
+	lgrammar_cache.count++;
+	x->refs++;
+	return x;
+}
+
+static void lval_print_grammar(lval *v) {
+	printf("#grammar{");
+	for (int i = 0; i < v->gram->n; i++) {
+		if (i) { putchar(' '); }
+		fputs(v->gram->names[i], stdout);
+	}
+	putchar('}');
+}
+
+/* (grammar text) */
+static lval * builtin_grammar(lenv *e, lval *a) {
+	LASSERT_COUNT(a, 1, "grammar");
+	LASSERT_STR_AT(a, 0, "grammar");
+
+	char *why;
+	lgrammar *g = lgrammar_get(lval_cstr(a->cell[0]), &why);
+	LASSERT(a, g != NULL, "Function 'grammar' passed invalid grammar: %s!", why);
+
+	lval_del(a);
+	lval *v = malloc(sizeof(lval));
+	v->type = LVAL_GRAMMAR;
+	v->gram = g;
+	return v;
+}
+
+/* {tag contents} with room for the children */
+static lval * last_node(mpc_ast_t *t) {
+	lval *q = lval_qexpr();
+	q->count = 2 + t->children_num;
+	q->cell = malloc(sizeof(lval *) * q->count);
+	size_t len = strlen(t->tag);
+	q->cell[0] = lval_str_lstr(lstr_intern(t->tag, len, lstr_hash_bytes(t->tag, len)));
+	q->cell[1] = lval_str(t->contents);
+	return q;
+}
+
+typedef struct {
+	mpc_ast_t *t;
+	lval *q;
+	int i;
+} last_frame;
+
+static lval * last_to_lval(mpc_ast_t *root) {
+	int sp = 0, cap = 64;
+	last_frame *stack = malloc(sizeof(last_frame) * cap);
+	lval *top = last_node(root);
+	stack[sp++] = (last_frame){ root, top, 0 };
+
+	while (sp) {
+		last_frame *f = &stack[sp - 1];
+		if (f->i == f->t->children_num) {
+			sp--;
+			continue;
+		}
+
+		mpc_ast_t *c = f->t->children[f->i];
+		lval *x = f->q->cell[2 + f->i++] = last_node(c);
+		if (c->children_num) {
+			if (sp == cap) {
+				cap *= 2;
+				stack = realloc(stack, sizeof(last_frame) * cap);
+			}
+			stack[sp++] = (last_frame){ c, x, 0 };
+		}
+	}
+
+	free(stack);
+	return top;
+}
+
+/* (parse-with g s [rule]) parses s with the first rule of g, or the
+ * named one */
+static lval * builtin_parse_with(lenv *e, lval *a) {
+	LASSERT(a, a->count == 2 || a->count == 3,
+		"Function 'parse-with' passed incorrect number of arguments! "
+		"Got %i, expected 2 or 3", a->count);
+	LASSERT_GRAMMAR_AT(a, 0, "parse-with");
+	LASSERT_STR_AT(a, 1, "parse-with");
+
+	lgrammar *g = a->cell[0]->gram;
+	int rule = 0;
+	if (a->count == 3) {
+		LASSERT_STR_AT(a, 2, "parse-with");
+		char *name = lval_cstr(a->cell[2]);
+		for (rule = 0; rule < g->n && strcmp(g->names[rule], name) != 0; rule++) {}
+		LASSERT(a, rule < g->n,
+			"Function 'parse-with' passed unknown rule '%s'!", name);
+	}
+
+	mpc_result_t r;
+	lval *x;
+	if (lmpc_parse("<parse-with>", a->cell[1], g->rules[rule], &r)) {
+		x = last_to_lval(r.output);
+		mpc_ast_delete(r.output);
+	} else {
+		char *s = mpc_err_string(r.error);
+		s[strcspn(s, "\n")] = '\0';
+		x = lval_err("%s", s);
+		free(s);
+		mpc_err_delete(r.error);
+	}
+
+	lval_del(a);
+	return x;
+}
+
+
+static void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
+	lval *k = lval_sym(name);
+	lval *v = lval_fun(func);
+	lenv_put(e, k, v);
+	lval_del(k);
+	lval_del(v);
+}
+
+static void lenv_add_builtin_bool(lenv *e, char *sym, boolean val) {
+	lval *v = lval_bool(val);
+	lval *k = lval_sym(sym);
+	lenv_put(e, k, v);
+	lval_del(k);
+	lval_del(v);
+}
+
+static void lenv_add_builtin_float(lenv *e, char *sym, double val) {
+	lval *v = lval_float(val);
+	lval *k = lval_sym(sym);
+	lenv_put(e, k, v);
+	lval_del(k);
+	lval_del(v);
+}
+
+static void lenv_add_builtins(lenv *e) {
+	/* list functions */
+	lenv_add_builtin(e, "list", builtin_list);
+	lenv_add_builtin(e, "head", builtin_head);
+	lenv_add_builtin(e, "tail", builtin_tail);
+	lenv_add_builtin(e, "eval", builtin_eval);
+	lenv_add_builtin(e, "join", builtin_join);
+	lenv_add_builtin(e, "cons", builtin_cons);
+	lenv_add_builtin(e, "len", builtin_len);
+	lenv_add_builtin(e, "map", builtin_map);
+	lenv_add_builtin(e, "filter", builtin_filter);
+	lenv_add_builtin(e, "foldl", builtin_foldl);
+	lenv_add_builtin(e, "foldr", builtin_foldr);
+	lenv_add_builtin(e, "reverse", builtin_reverse);
+	lenv_add_builtin(e, "take", builtin_take);
+	lenv_add_builtin(e, "drop", builtin_drop);
+	lenv_add_builtin(e, "range", builtin_range);
+	lenv_add_builtin(e, "sort", builtin_sort);
+	lenv_add_builtin(e, "sort-by", builtin_sort_by);
+
+	/* mathematical functions */
+	lenv_add_builtin(e, "+", builtin_add);
+	lenv_add_builtin(e, "-", builtin_sub);
+	lenv_add_builtin(e, "*", builtin_mul);
+	lenv_add_builtin(e, "/", builtin_div);
+	lenv_add_builtin(e, "%", builtin_mod);
+	lenv_add_builtin(e, "^", builtin_pow);
+
+	lenv_add_builtin(e, "def", builtin_def);
+	lenv_add_builtin(e, "=", builtin_put);
+	lenv_add_builtin(e, "\\", builtin_lambda);
+
+	lenv_add_builtin(e, "if", builtin_if);
+	lenv_add_builtin(e, "loop", builtin_loop);
+	lenv_add_builtin(e, "recur", builtin_recur);
+	lenv_add_builtin(e, "==", builtin_eq);
+	lenv_add_builtin(e, "!=", builtin_ne);
+	lenv_add_builtin(e, ">",  builtin_gt);
+	lenv_add_builtin(e, "<",  builtin_lt);
+	lenv_add_builtin(e, ">=", builtin_ge);
+	lenv_add_builtin(e, "<=", builtin_le);
+
+	lenv_add_builtin(e, "||", builtin_or);
+	lenv_add_builtin(e, "&&", builtin_and);
+	lenv_add_builtin(e, "!",  builtin_not);
+
+	lenv_add_builtin(e, "load", builtin_load);
+	lenv_add_builtin(e, "print", builtin_print);
+	lenv_add_builtin(e, "error", builtin_error);
+
+	/* strings */
+	lenv_add_builtin(e, "str-cat", builtin_str_cat);
+	lenv_add_builtin(e, "str-len", builtin_str_len);
+	lenv_add_builtin(e, "substr", builtin_substr);
+	lenv_add_builtin(e, "str->list", builtin_str_list);
+	lenv_add_builtin(e, "list->str", builtin_list_str);
+	lenv_add_builtin(e, "num->str", builtin_num_str);
+	lenv_add_builtin(e, "str->num", builtin_str_num);
+	lenv_add_builtin(e, "str-find", builtin_str_find);
+	lenv_add_builtin(e, "str-count", builtin_str_count);
+	lenv_add_builtin(e, "str-split", builtin_str_split);
+	lenv_add_builtin(e, "str-replace", builtin_str_replace);
+
+	/* numeric vectors */
+	lenv_add_builtin(e, "vec", builtin_vec);
+	lenv_add_builtin(e, "vec->list", builtin_vec_list);
+	lenv_add_builtin(e, "vlen", builtin_vlen);
+	lenv_add_builtin(e, "vref", builtin_vref);
+	lenv_add_builtin(e, "vslice", builtin_vslice);
+	lenv_add_builtin(e, "vset", builtin_vset);
+	lenv_add_builtin(e, "mmap-open", builtin_mmap_open);
+	lenv_add_builtin(e, "vsum", builtin_vsum);
+	lenv_add_builtin(e, "vmin", builtin_vmin);
+	lenv_add_builtin(e, "vmax", builtin_vmax);
+	lenv_add_builtin(e, "vdot", builtin_vdot);
+	lenv_add_builtin(e, "v+", builtin_vadd);
+	lenv_add_builtin(e, "v-", builtin_vsub);
+	lenv_add_builtin(e, "v*", builtin_vmul);
+	lenv_add_builtin(e, "v/", builtin_vdiv);
+	lenv_add_builtin(e, "v==", builtin_veq);
+	lenv_add_builtin(e, "v<", builtin_vlt);
+	lenv_add_builtin(e, "v>", builtin_vgt);
+	lenv_add_builtin(e, "v<=", builtin_vle);
+	lenv_add_builtin(e, "v>=", builtin_vge);
+
+	/* matrices */
+	lenv_add_builtin(e, "mat", builtin_mat);
+	lenv_add_builtin(e, "mat-zeros", builtin_mat_zeros);
+	lenv_add_builtin(e, "mat-ident", builtin_mat_ident);
+	lenv_add_builtin(e, "mat->list", builtin_mat_list);
+	lenv_add_builtin(e, "mat-dims", builtin_mat_dims);
+	lenv_add_builtin(e, "mat-ref", builtin_mat_ref);
+	lenv_add_builtin(e, "transpose", builtin_transpose);
+	lenv_add_builtin(e, "mat+", builtin_mat_add);
+	lenv_add_builtin(e, "mat-", builtin_mat_sub);
+	lenv_add_builtin(e, "mat*", builtin_mat_mul);
+	lenv_add_builtin(e, "mat/", builtin_mat_div);
+	lenv_add_builtin(e, "matmul", builtin_matmul);
+
+	/* persistent maps */
+	lenv_add_builtin(e, "map-from", builtin_map_from);
+	lenv_add_builtin(e, "map-get", builtin_map_get);
+	lenv_add_builtin(e, "map-has", builtin_map_has);
+	lenv_add_builtin(e, "map-put", builtin_map_put);
+	lenv_add_builtin(e, "map-del", builtin_map_del);
+	lenv_add_builtin(e, "map-count", builtin_map_count);
+	lenv_add_builtin(e, "map-keys", builtin_map_keys);
+	lenv_add_builtin(e, "map-vals", builtin_map_vals);
+	lenv_add_builtin(e, "map->list", builtin_map_list);
+
+	lenv_add_builtin(e, "memo", builtin_memo);
+	lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+	/* lazy sequences */
+	lenv_add_builtin(e, "lazy-range", builtin_lazy_range);
+	lenv_add_builtin(e, "lazy-iterate", builtin_lazy_iterate);
+	lenv_add_builtin(e, "lazy-map", builtin_lazy_map);
+	lenv_add_builtin(e, "lazy-filter", builtin_lazy_filter);
+	lenv_add_builtin(e, "lazy-take", builtin_lazy_take);
+	lenv_add_builtin(e, "take-while", builtin_take_while);
+	lenv_add_builtin(e, "realize", builtin_realize);
+
+	/* transducers */
+	lenv_add_builtin(e, "xform", builtin_xform);
+	lenv_add_builtin(e, "transduce", builtin_transduce);
+	lenv_add_builtin(e, "into", builtin_into);
+
+	/* tables */
+	lenv_add_builtin(e, "table", builtin_table);
+	lenv_add_builtin(e, "tbl-count", builtin_tbl_count);
+	lenv_add_builtin(e, "tbl-cols", builtin_tbl_cols);
+	lenv_add_builtin(e, "tbl-col", builtin_tbl_col);
+	lenv_add_builtin(e, "tbl-rows", builtin_tbl_rows);
+	lenv_add_builtin(e, "tbl-select", builtin_tbl_select);
+	lenv_add_builtin(e, "tbl-where", builtin_tbl_where);
+	lenv_add_builtin(e, "tbl-group", builtin_tbl_group);
+	lenv_add_builtin(e, "tbl-join", builtin_tbl_join);
+
+	/* priority queues */
+	lenv_add_builtin(e, "heapify", builtin_heapify);
+	lenv_add_builtin(e, "pq-push", builtin_pq_push);
+	lenv_add_builtin(e, "pq-pop", builtin_pq_pop);
+	lenv_add_builtin(e, "pq-peek", builtin_pq_peek);
+	lenv_add_builtin(e, "pq-size", builtin_pq_size);
+
+	/* sorted maps */
+	lenv_add_builtin(e, "sorted", builtin_sorted);
+	lenv_add_builtin(e, "sorted-put", builtin_sorted_put);
+	lenv_add_builtin(e, "sorted-del", builtin_sorted_del);
+	lenv_add_builtin(e, "sorted-get", builtin_sorted_get);
+	lenv_add_builtin(e, "sorted-has", builtin_sorted_has);
+	lenv_add_builtin(e, "sorted-count", builtin_sorted_count);
+	lenv_add_builtin(e, "sorted-first", builtin_sorted_first);
+	lenv_add_builtin(e, "sorted-last", builtin_sorted_last);
+	lenv_add_builtin(e, "sorted-floor", builtin_sorted_floor);
+	lenv_add_builtin(e, "sorted-ceil", builtin_sorted_ceil);
+	lenv_add_builtin(e, "sorted-prev", builtin_sorted_prev);
+	lenv_add_builtin(e, "sorted-next", builtin_sorted_next);
+	lenv_add_builtin(e, "sorted-range", builtin_sorted_range);
+	lenv_add_builtin(e, "sorted->list", builtin_sorted_list);
+
+	/* integer sets */
+	lenv_add_builtin(e, "set", builtin_set);
+	lenv_add_builtin(e, "set-add", builtin_set_add);
+	lenv_add_builtin(e, "set-has", builtin_set_has);
+	lenv_add_builtin(e, "set-card", builtin_set_card);
+	lenv_add_builtin(e, "set-union", builtin_set_union);
+	lenv_add_builtin(e, "set-inter", builtin_set_inter);
+	lenv_add_builtin(e, "set-diff", builtin_set_diff);
+	lenv_add_builtin(e, "set->list", builtin_set_list);
+
+	/* byte buffers */
+	lenv_add_builtin(e, "bytes", builtin_bytes);
+	lenv_add_builtin(e, "bytes-open", builtin_bytes_open);
+	lenv_add_builtin(e, "bytes-len", builtin_bytes_len);
+	lenv_add_builtin(e, "bytes-ref", builtin_bytes_ref);
+	lenv_add_builtin(e, "bytes-slice", builtin_bytes_slice);
+	lenv_add_builtin(e, "bytes->str", builtin_bytes_str);
+	lenv_add_builtin(e, "bytes->list", builtin_bytes_list);
+	lenv_add_builtin(e, "pack", builtin_pack);
+	lenv_add_builtin(e, "unpack", builtin_unpack);
+	lenv_add_builtin(e, "unpack-all", builtin_unpack_all);
+
+	/* json */
+	lenv_add_builtin(e, "json-parse", builtin_json_parse);
+	lenv_add_builtin(e, "json-emit", builtin_json_emit);
+
+	/* csv */
+	lenv_add_builtin(e, "csv-fold", builtin_csv_fold);
+
+	/* regular expressions */
+	lenv_add_builtin(e, "re-match", builtin_re_match);
+	lenv_add_builtin(e, "re-find", builtin_re_find);
+	lenv_add_builtin(e, "re-find-all", builtin_re_find_all);
+
+	/* grammars */
+	lenv_add_builtin(e, "grammar", builtin_grammar);
+	lenv_add_builtin(e, "parse-with", builtin_parse_with);
+
+	lenv_add_builtin(e, "time", builtin_time);
+
+	lenv_add_builtin_bool(e, "t", 1);
+	lenv_add_builtin_bool(e, "false", 0);
+	lenv_add_builtin_float(e, "inf", HUGE_VAL);
+	lenv_add_builtin_float(e, "-inf", -HUGE_VAL);
+	lenv_add_builtin_float(e, "nan", NAN);
+}
+
+
+int main(int argc, char** argv) {
+
+	/* Create some parsers */
+	Number   = mpc_new("number");
+	Symbol   = mpc_new("symbol");
+	String   = mpc_new("string");
+	Comment  = mpc_new("comment");
+	Sexpr    = mpc_new("sexpr");
+	Qexpr    = mpc_new("qexpr");
+	Expr     = mpc_new("expr");
+	Lispy    = mpc_new("lispy");
+
+	/* Define them with the following language */
 	mpca_lang(MPCA_LANG_DEFAULT,
 		  ""
-		  "number   : /-?[0-9]+/ ;"
-		  "symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&|]+/ ;"
+		  "number   : /-?[0-9]+(\\.[0-9]+)?([eE][-+]?[0-9]+)?/ ;"
+		  "symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&|%^]+/ ;"
 		  "string   : /\"(\\\\.|[^\"])*\"/ ;"
 		  "comment  : /;[^\\r\\n]*/ ;"
 		  "sexpr    : '(' <expr>* ')' ;"
@@ -1169,6 +10388,8 @@ int main(int argc, char** argv) {
 		  "",
 		  Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
 
+	lvec_init();
+
 	lenv *e = lenv_new();
 	lenv_add_builtins(e);
 
@@ -1194,7 +10415,7 @@ int main(int argc, char** argv) {
 			if (mpc_parse("<stdin>", input, Lispy, &r)) {
 				/* On success evaluate AST */
 				lval *x = lval_read(r.output);
-				lval *result = lval_eval(e, x);
+				lval *result = lval_no_recur(lval_eval(e, x));
 				lval_println(result);
 				lval_del(result);
 				mpc_ast_delete(r.output);